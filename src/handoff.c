@@ -0,0 +1,163 @@
+// SPDX-License-Identifier: MIT
+
+#include <config.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "handoff.h"
+#include "log_levels.h"
+#include "logger.h"
+
+// Listener handoff
+//
+// A running wsfs listens on a Unix domain socket. A newly started wsfs
+// connects to it and receives the listening sockets with SCM_RIGHTS, so
+// both processes accept on the very same sockets and nothing queued in
+// their backlogs is lost. Once the new process confirms with a single
+// byte, the old one stops accepting and drains its connections.
+
+static int
+handoff_address(struct sockaddr_un *out, const char *path)
+{
+  memset(out, 0, sizeof(*out));
+  out->sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(out->sun_path))
+    return -1;
+  strcpy(out->sun_path, path);
+  return 0;
+}
+
+int
+handoff_listen(const char *path)
+{
+  // handoff_listen():
+  // Create the control socket at `path`, replacing a stale one left by a
+  // previous process. Returns the listening descriptor or -1.
+
+  struct sockaddr_un address;
+  int control_socketfd;
+
+  if (handoff_address(&address, path) != 0)
+    return -1;
+
+  if ((control_socketfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1)
+    return -1;
+
+  unlink(path);
+  if (bind(control_socketfd, (struct sockaddr *)&address, sizeof(address)) == -1
+    || listen(control_socketfd, 1) == -1) {
+    close(control_socketfd);
+    return -1;
+  }
+
+  return control_socketfd;
+}
+
+int
+handoff_send(int control_socketfd, const int *fds, size_t count)
+{
+  // handoff_send():
+  // Wait for the next process to connect to `control_socketfd` and pass
+  // it `fds`. Returns 0 once it confirmed receiving them, -1 if this
+  // attempt failed and the caller should keep serving.
+
+  char control[CMSG_SPACE(sizeof(int) * HANDOFF_FDS_MAX)];
+  char ack;
+  unsigned char fd_count = count;
+  struct iovec iov = { .iov_base = &fd_count, .iov_len = 1 };
+  struct msghdr msg = {
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = control,
+    .msg_controllen = CMSG_SPACE(sizeof(int) * count),
+  };
+  struct pollfd pollfd;
+  struct cmsghdr *cmsg;
+  int socketfd;
+
+  if ((socketfd = accept4(control_socketfd, NULL, NULL, SOCK_CLOEXEC)) == -1)
+    return -1;
+
+  memset(control, 0, sizeof(control));
+  cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * count);
+
+  if (sendmsg(socketfd, &msg, MSG_NOSIGNAL) != 1) {
+    close(socketfd);
+    return -1;
+  }
+
+  pollfd.fd = socketfd;
+  pollfd.events = POLLIN;
+  if (poll(&pollfd, 1, HANDOFF_ACK_TIMEOUT * 1000) != 1 || read(socketfd, &ack, 1) != 1) {
+    logger(LOGL_WARN, NULL, "handoff: new process did not confirm, keep serving");
+    close(socketfd);
+    return -1;
+  }
+
+  close(socketfd);
+  return 0;
+}
+
+int
+handoff_receive(const char *path, int *fds, size_t *count)
+{
+  // handoff_receive():
+  // Connect to the control socket of a running wsfs at `path` and take
+  // over its listening sockets. Returns 0 with `fds` and `count` set,
+  // or -1 if there was nothing to take over.
+
+  char control[CMSG_SPACE(sizeof(int) * HANDOFF_FDS_MAX)];
+  unsigned char fd_count;
+  struct iovec iov = { .iov_base = &fd_count, .iov_len = 1 };
+  struct msghdr msg = {
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = control,
+    .msg_controllen = sizeof(control),
+  };
+  struct sockaddr_un address;
+  struct cmsghdr *cmsg;
+  int socketfd;
+
+  if (handoff_address(&address, path) != 0)
+    return -1;
+
+  if ((socketfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1)
+    return -1;
+
+  if (connect(socketfd, (struct sockaddr *)&address, sizeof(address)) == -1
+    || recvmsg(socketfd, &msg, MSG_CMSG_CLOEXEC) != 1) {
+    close(socketfd);
+    return -1;
+  }
+
+  cmsg = CMSG_FIRSTHDR(&msg);
+  if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS
+    || fd_count > HANDOFF_FDS_MAX || cmsg->cmsg_len != CMSG_LEN(sizeof(int) * fd_count)) {
+    close(socketfd);
+    return -1;
+  }
+
+  memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * fd_count);
+  *count = fd_count;
+
+  // The old process starts draining once it reads this
+  if (write(socketfd, "", 1) != 1) {
+    for (size_t i = 0; i < *count; i++)
+      close(fds[i]);
+    close(socketfd);
+    return -1;
+  }
+
+  close(socketfd);
+  return 0;
+}
@@ -0,0 +1,18 @@
+// SPDX-License-Identifier: MIT
+
+#ifndef _HANDOFF
+#define _HANDOFF
+
+#include <stddef.h>
+
+// Listening sockets passed in one handoff (IPv4 and IPv6)
+#define HANDOFF_FDS_MAX 2
+
+// Seconds the old process waits for the new one to confirm
+#define HANDOFF_ACK_TIMEOUT 10
+
+int handoff_listen(const char *path);
+int handoff_send(int control_socketfd, const int *fds, size_t count);
+int handoff_receive(const char *path, int *fds, size_t *count);
+
+#endif
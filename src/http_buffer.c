@@ -0,0 +1,206 @@
+// SPDX-License-Identifier: MIT
+
+#include <config.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+#include "http_buffer.h"
+
+// I/O buffer pool
+//
+// Connections borrow a buffer only while a request is in flight and
+// give it back as soon as they go idle, so memory follows the number of
+// active requests rather than open connections.
+//
+// Buffers are carved from 2 MiB slabs, backed by a huge page with
+// --huge-pages when the system has one reserved and by transparent huge
+// pages otherwise. The thread carving a slab faults in all of it, so
+// under the default local allocation policy the memory lands on the
+// NUMA node that thread runs on. Slabs are aligned to their size and
+// start with a header naming that node, in place of their first buffer.
+//
+// Each thread keeps a few free buffers per tier without locking, only
+// from its own node. Beyond that they go to the depot of their node,
+// which is also where a thread looks before carving a new slab. Slabs
+// are never unmapped, the pool stays at the size of the busiest moment.
+
+#define HTTP_BUFFER_TIERS 2
+#define HTTP_BUFFER_NODES_MAX 64
+#define HTTP_BUFFER_PAGE 4096
+
+typedef struct http_buffer_free {
+  struct http_buffer_free     *next;
+} http_buffer_free_t;
+
+typedef struct {
+  http_buffer_free_t          *head;
+  size_t                      count;
+} http_buffer_list_t;
+
+typedef struct {
+  unsigned                    node; // NUMA node the slab was faulted in on
+} http_buffer_slab_t;
+
+typedef struct {
+  pthread_mutex_t             lock;
+  http_buffer_list_t          lists[HTTP_BUFFER_TIERS];
+} http_buffer_depot_t;
+
+int http_buffer_huge_pages = 0;
+
+static __thread http_buffer_list_t caches[HTTP_BUFFER_TIERS];
+static http_buffer_depot_t depots[HTTP_BUFFER_NODES_MAX] = {
+  [0 ... HTTP_BUFFER_NODES_MAX - 1] = { .lock = PTHREAD_MUTEX_INITIALIZER },
+};
+
+static const size_t tier_sizes[HTTP_BUFFER_TIERS] = { HTTP_BUFFER_SMALL, HTTP_BUFFER_LARGE };
+
+static int
+http_buffer_tier(size_t size)
+{
+  for (int tier = 0; tier < HTTP_BUFFER_TIERS; tier++)
+    if (size <= tier_sizes[tier])
+      return tier;
+  return -1;
+}
+
+static void
+http_buffer_push(http_buffer_list_t *list, void *buffer)
+{
+  http_buffer_free_t *node = buffer;
+
+  node->next = list->head;
+  list->head = node;
+  list->count++;
+}
+
+static void *
+http_buffer_pop(http_buffer_list_t *list)
+{
+  http_buffer_free_t *node = list->head;
+
+  if (node != NULL) {
+    list->head = node->next;
+    list->count--;
+  }
+  return node;
+}
+
+static unsigned
+http_buffer_node()
+{
+  // NUMA node of the calling thread, from the vDSO
+  unsigned cpu, node;
+
+  if (getcpu(&cpu, &node) != 0)
+    return 0;
+  return node % HTTP_BUFFER_NODES_MAX;
+}
+
+static http_buffer_slab_t *
+http_buffer_slab_of(void *buffer)
+{
+  return (http_buffer_slab_t *)((uintptr_t)buffer & ~(uintptr_t)(HTTP_BUFFER_SLAB - 1));
+}
+
+static int
+http_buffer_slab(int tier, unsigned node)
+{
+  // Carve a new slab into this thread's cache, the rest into the depot
+  // of `node`
+  char *slab = MAP_FAILED, *map;
+  size_t size = tier_sizes[tier];
+  http_buffer_depot_t *depot = &depots[node];
+
+  // Huge pages come aligned to their size. Otherwise twice the size is
+  // mapped and trimmed to an aligned slab.
+  if (http_buffer_huge_pages)
+    slab = mmap(NULL, HTTP_BUFFER_SLAB, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  if (slab == MAP_FAILED) {
+    map = mmap(NULL, 2 * HTTP_BUFFER_SLAB, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED)
+      return -1;
+    slab = (char *)(((uintptr_t)map + HTTP_BUFFER_SLAB - 1) & ~(uintptr_t)(HTTP_BUFFER_SLAB - 1));
+    if (slab > map)
+      munmap(map, slab - map);
+    munmap(slab + HTTP_BUFFER_SLAB, map + HTTP_BUFFER_SLAB - slab);
+    madvise(slab, HTTP_BUFFER_SLAB, MADV_HUGEPAGE);
+  }
+
+  // Every page is faulted in here, by the thread that will use the first
+  // buffers, rather than by whichever thread touches it later
+  for (size_t offset = 0; offset < HTTP_BUFFER_SLAB; offset += HTTP_BUFFER_PAGE)
+    slab[offset] = 0;
+  ((http_buffer_slab_t *)slab)->node = node;
+
+  pthread_mutex_lock(&depot->lock);
+  for (size_t offset = size; offset + size <= HTTP_BUFFER_SLAB; offset += size) {
+    if (caches[tier].count < HTTP_BUFFER_CACHE_MAX)
+      http_buffer_push(&caches[tier], slab + offset);
+    else
+      http_buffer_push(&depot->lists[tier], slab + offset);
+  }
+  pthread_mutex_unlock(&depot->lock);
+  return 0;
+}
+
+void *
+http_buffer_get(size_t size)
+{
+  // http_buffer_get():
+  // Borrow a buffer of at least `size` bytes, up to HTTP_BUFFER_LARGE,
+  // from the node the calling thread runs on. Returns NULL if `size` is
+  // too big or memory ran out.
+
+  int tier = http_buffer_tier(size);
+  unsigned node;
+  http_buffer_depot_t *depot;
+  void *buffer;
+
+  if (tier == -1)
+    return NULL;
+
+  if ((buffer = http_buffer_pop(&caches[tier])) != NULL)
+    return buffer;
+
+  node = http_buffer_node();
+  depot = &depots[node];
+  pthread_mutex_lock(&depot->lock);
+  buffer = http_buffer_pop(&depot->lists[tier]);
+  pthread_mutex_unlock(&depot->lock);
+  if (buffer != NULL)
+    return buffer;
+
+  if (http_buffer_slab(tier, node) != 0)
+    return NULL;
+  return http_buffer_pop(&caches[tier]);
+}
+
+void
+http_buffer_put(void *buffer, size_t size)
+{
+  // http_buffer_put():
+  // Give back a buffer borrowed with the same `size`. One from another
+  // node, borrowed before the connection moved threads, goes back to
+  // the depot of its node.
+  int tier = http_buffer_tier(size);
+  http_buffer_depot_t *depot;
+  unsigned node;
+
+  if (buffer == NULL)
+    return;
+
+  node = http_buffer_slab_of(buffer)->node;
+  if (caches[tier].count < HTTP_BUFFER_CACHE_MAX && node == http_buffer_node()) {
+    http_buffer_push(&caches[tier], buffer);
+    return;
+  }
+
+  depot = &depots[node];
+  pthread_mutex_lock(&depot->lock);
+  http_buffer_push(&depot->lists[tier], buffer);
+  pthread_mutex_unlock(&depot->lock);
+}
@@ -0,0 +1,21 @@
+// SPDX-License-Identifier: MIT
+
+#ifndef _HTTP_BUFFER
+#define _HTTP_BUFFER
+
+#include <stddef.h>
+
+// Buffer tiers: requests start small, oversized header sections move
+// to a large buffer
+#define HTTP_BUFFER_SMALL 4096
+#define HTTP_BUFFER_LARGE 32768
+
+#define HTTP_BUFFER_SLAB (2 * 1024 * 1024) // one huge page
+#define HTTP_BUFFER_CACHE_MAX 64 // free buffers a thread keeps per tier
+
+extern int http_buffer_huge_pages;
+
+void *http_buffer_get(size_t size);
+void http_buffer_put(void *buffer, size_t size);
+
+#endif
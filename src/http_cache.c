@@ -0,0 +1,421 @@
+// SPDX-License-Identifier: MIT
+
+#include <config.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "http_cache.h"
+#include "http_trace.h"
+#include "wsfs_core.h"
+
+// Response cache
+//
+// Keeps response bodies that are expensive to produce, such as compressed
+// variants of files, in memory. Each entry remembers the ETag of the
+// representation it was derived from and is only returned while that
+// still matches, so a changed file is never served from a stale variant.
+//
+// The cache is bounded by the total size of its bodies and evicts the
+// least recently used entries. Entries are reference counted, a body is
+// freed once the last response sending it is done.
+//
+// http_cache_get() can reserve a missing key for the caller. Other
+// callers then see the key as absent and not reservable until the
+// reserving caller stores a body with http_cache_set(), so each body is
+// produced only once.
+//
+// http_cache_snapshot() writes the hot keys with their access counts,
+// and optionally their bodies, to a file that http_cache_restore() reads
+// back after a restart to refill the cache hottest first.
+
+size_t http_cache_size = HTTP_CACHE_SIZE_DEFAULT;
+
+#define HTTP_CACHE_BUCKETS 4096
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static http_cache_entry_t **buckets;
+static size_t used;
+static http_cache_entry_t *lru_head, *lru_tail; // most recent first
+
+static uint32_t
+http_cache_hash(const char *s)
+{
+  return wsfs_fnv1a32(s, strlen(s), 0);
+}
+
+static void
+http_cache_destroy(http_cache_entry_t *entry)
+{
+  free(entry->body);
+  free(entry->key);
+  free(entry);
+}
+
+static void
+http_cache_unlink(http_cache_entry_t *entry)
+{
+  // Called with the lock held
+  http_cache_entry_t **link = &buckets[entry->hash % HTTP_CACHE_BUCKETS];
+  while (*link != entry)
+    link = &(*link)->next;
+  *link = entry->next;
+
+  if (entry->lru_prev != NULL)
+    entry->lru_prev->lru_next = entry->lru_next;
+  else
+    lru_head = entry->lru_next;
+  if (entry->lru_next != NULL)
+    entry->lru_next->lru_prev = entry->lru_prev;
+  else
+    lru_tail = entry->lru_prev;
+
+  used -= entry->len;
+  entry->cached = 0;
+
+  if (entry->refcount == 0)
+    http_cache_destroy(entry);
+}
+
+static http_cache_entry_t *
+http_cache_find(const char *key, uint32_t hash)
+{
+  // Called with the lock held
+  http_cache_entry_t *entry;
+  for (entry = buckets[hash % HTTP_CACHE_BUCKETS]; entry != NULL; entry = entry->next)
+    if (entry->hash == hash && strcmp(entry->key, key) == 0)
+      return entry;
+  return NULL;
+}
+
+static void
+http_cache_touch(http_cache_entry_t *entry)
+{
+  // Called with the lock held. Move `entry` to the LRU head.
+  if (entry == lru_head)
+    return;
+
+  if (entry->lru_prev != NULL) {
+    entry->lru_prev->lru_next = entry->lru_next;
+    if (entry->lru_next != NULL)
+      entry->lru_next->lru_prev = entry->lru_prev;
+    else
+      lru_tail = entry->lru_prev;
+  }
+
+  entry->lru_prev = NULL;
+  entry->lru_next = lru_head;
+  if (lru_head != NULL)
+    lru_head->lru_prev = entry;
+  else
+    lru_tail = entry;
+  lru_head = entry;
+}
+
+static http_cache_entry_t *
+http_cache_insert(const char *key, uint32_t hash, const char *etag)
+{
+  // Called with the lock held
+  http_cache_entry_t *entry = calloc(1, sizeof(*entry));
+  if (entry == NULL)
+    return NULL;
+
+  if ((entry->key = strdup(key)) == NULL) {
+    free(entry);
+    return NULL;
+  }
+
+  entry->hash = hash;
+  strncpy(entry->etag, etag, sizeof(entry->etag) - 1);
+  entry->cached = 1;
+
+  entry->next = buckets[hash % HTTP_CACHE_BUCKETS];
+  buckets[hash % HTTP_CACHE_BUCKETS] = entry;
+  http_cache_touch(entry);
+
+  return entry;
+}
+
+int
+http_cache_init()
+{
+  if (http_cache_size == 0)
+    return 0;
+
+  if ((buckets = calloc(HTTP_CACHE_BUCKETS, sizeof(*buckets))) == NULL)
+    return -1;
+  return 0;
+}
+
+http_cache_entry_t *
+http_cache_get(const char *key, const char *etag, int *reserved)
+{
+  // http_cache_get():
+  // Look up `key` derived from the representation tagged `etag`.
+  // A returned entry must be given back with http_cache_release().
+  //
+  // If the key is missing and `reserved` is not NULL, the key is reserved
+  // for the caller, who must then call http_cache_set() for it, and
+  // `reserved` is set to 1.
+
+  http_cache_entry_t *entry;
+  uint32_t hash;
+
+  if (reserved != NULL)
+    *reserved = 0;
+
+  if (buckets == NULL)
+    return NULL;
+
+  hash = http_cache_hash(key);
+
+  pthread_mutex_lock(&lock);
+
+  entry = http_cache_find(key, hash);
+  if (entry != NULL && strcmp(entry->etag, etag) != 0) {
+    http_cache_unlink(entry);
+    entry = NULL;
+  }
+
+  if (entry == NULL) {
+    if (reserved != NULL && http_cache_insert(key, hash, etag) != NULL)
+      *reserved = 1;
+  } else if (entry->ready) {
+    entry->refcount++;
+    entry->hits++;
+    http_cache_touch(entry);
+  } else
+    entry = NULL;
+
+  pthread_mutex_unlock(&lock);
+
+  if (entry != NULL)
+    HTTP_TRACE(cache_hit, http_trace_connection, key, entry->len);
+  else
+    HTTP_TRACE(cache_miss, http_trace_connection, key);
+  return entry;
+}
+
+http_cache_entry_t *
+http_cache_set(const char *key, const char *etag, char *body, size_t len)
+{
+  // http_cache_set():
+  // Store `body` (malloc()ed, or NULL to remember that the variant is not
+  // worth having) under `key`. The cache takes ownership of `body`.
+  // Returns the entry already acquired, or NULL if it was not cached and
+  // `body` was freed.
+
+  http_cache_entry_t *entry;
+  uint32_t hash;
+
+  if (buckets == NULL || len > http_cache_size) {
+    free(body);
+    return NULL;
+  }
+
+  hash = http_cache_hash(key);
+
+  pthread_mutex_lock(&lock);
+
+  entry = http_cache_find(key, hash);
+  if (entry != NULL && (entry->ready || strcmp(entry->etag, etag) != 0)) {
+    http_cache_unlink(entry);
+    entry = NULL;
+  }
+  if (entry == NULL && (entry = http_cache_insert(key, hash, etag)) == NULL) {
+    pthread_mutex_unlock(&lock);
+    free(body);
+    return NULL;
+  }
+
+  entry->body = body;
+  entry->len = len;
+  entry->ready = 1;
+  entry->refcount = 1;
+  used += len;
+
+  while (used > http_cache_size && lru_tail != entry)
+    http_cache_unlink(lru_tail);
+
+  pthread_mutex_unlock(&lock);
+  return entry;
+}
+
+void
+http_cache_retain(http_cache_entry_t *entry)
+{
+  // http_cache_retain():
+  // Take another reference to an acquired entry, to be given back with
+  // http_cache_release() as well.
+  pthread_mutex_lock(&lock);
+  entry->refcount++;
+  pthread_mutex_unlock(&lock);
+}
+
+void
+http_cache_release(http_cache_entry_t *entry)
+{
+  pthread_mutex_lock(&lock);
+  if (--entry->refcount == 0 && !entry->cached)
+    http_cache_destroy(entry);
+  pthread_mutex_unlock(&lock);
+}
+
+static int
+http_cache_hits_compare(const void *a, const void *b)
+{
+  uint64_t hits_a = (*(http_cache_entry_t *const *)a)->hits;
+  uint64_t hits_b = (*(http_cache_entry_t *const *)b)->hits;
+  return hits_a < hits_b ? 1 : hits_a > hits_b ? -1 : 0;
+}
+
+int
+http_cache_snapshot(const char *path, int bodies)
+{
+  // http_cache_snapshot():
+  // Write the cached keys to `path`, hottest first, with their bodies if
+  // `bodies` is set. Entries are pinned rather than locked while written,
+  // so requests are only held up while the table is walked. Access counts
+  // are halved afterwards, the next snapshot favours recent traffic.
+
+  char temp[PATH_MAX];
+  http_cache_snapshot_header_t header;
+  http_cache_snapshot_record_t record;
+  http_cache_entry_t **entries, *entry;
+  size_t count = 0, capacity;
+  FILE *file;
+  int fd, result = 0;
+
+  if (buckets == NULL)
+    return 0;
+
+  pthread_mutex_lock(&lock);
+
+  for (capacity = 0, entry = lru_head; entry != NULL; entry = entry->lru_next)
+    capacity++;
+
+  if ((entries = malloc((capacity + 1) * sizeof(*entries))) == NULL) {
+    pthread_mutex_unlock(&lock);
+    return -1;
+  }
+
+  for (entry = lru_head; entry != NULL; entry = entry->lru_next) {
+    if (!entry->ready || entry->body == NULL)
+      continue;
+    entry->refcount++;
+    entries[count++] = entry;
+  }
+
+  pthread_mutex_unlock(&lock);
+
+  qsort(entries, count, sizeof(*entries), http_cache_hits_compare);
+
+  if (snprintf(temp, sizeof(temp), "%s.XXXXXX", path) >= (int)sizeof(temp) || (fd = mkstemp(temp)) == -1) {
+    result = -1;
+    goto release;
+  }
+
+  if ((file = fdopen(fd, "w")) == NULL) {
+    close(fd);
+    unlink(temp);
+    result = -1;
+    goto release;
+  }
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, HTTP_CACHE_SNAPSHOT_MAGIC, sizeof(header.magic));
+  header.version = HTTP_CACHE_SNAPSHOT_VERSION;
+  header.count = count;
+  fwrite(&header, sizeof(header), 1, file);
+
+  for (size_t i = 0; i < count; i++) {
+    entry = entries[i];
+    memset(&record, 0, sizeof(record));
+    record.hits = entry->hits;
+    record.len = entry->len;
+    record.key_len = strlen(entry->key);
+    record.flags = bodies ? HTTP_CACHE_SNAPSHOT_BODY : 0;
+    memcpy(record.etag, entry->etag, sizeof(record.etag));
+
+    fwrite(&record, sizeof(record), 1, file);
+    fwrite(entry->key, 1, record.key_len, file);
+    if (bodies)
+      fwrite(entry->body, 1, entry->len, file);
+  }
+
+  result = ferror(file) ? -1 : 0;
+  if (fclose(file) != 0 || result != 0 || rename(temp, path) != 0) {
+    unlink(temp);
+    result = -1;
+  }
+
+release:
+  pthread_mutex_lock(&lock);
+  for (size_t i = 0; i < count; i++) {
+    entry = entries[i];
+    entry->hits /= 2;
+    if (--entry->refcount == 0 && !entry->cached)
+      http_cache_destroy(entry);
+  }
+  pthread_mutex_unlock(&lock);
+
+  free(entries);
+  return result;
+}
+
+int
+http_cache_restore(const char *path, http_cache_warm_t warm)
+{
+  // http_cache_restore():
+  // Replay the snapshot at `path` through `warm`, hottest first, until
+  // the restored bodies would fill the cache. Meant to run in its own
+  // thread while requests are already being served.
+
+  http_cache_snapshot_header_t header;
+  http_cache_snapshot_record_t record;
+  char key[HTTP_PATH_MAX + 16];
+  char *body;
+  size_t restored = 0;
+  FILE *file;
+
+  if (buckets == NULL)
+    return 0;
+
+  if ((file = fopen(path, "re")) == NULL)
+    return -1;
+
+  if (fread(&header, sizeof(header), 1, file) != 1
+    || memcmp(header.magic, HTTP_CACHE_SNAPSHOT_MAGIC, sizeof(header.magic)) != 0
+    || header.version != HTTP_CACHE_SNAPSHOT_VERSION) {
+    fclose(file);
+    return -1;
+  }
+
+  for (uint32_t i = 0; i < header.count; i++) {
+    if (fread(&record, sizeof(record), 1, file) != 1 || record.key_len >= sizeof(key)
+      || fread(key, 1, record.key_len, file) != record.key_len)
+      break;
+    key[record.key_len] = '\0';
+    record.etag[sizeof(record.etag) - 1] = '\0';
+
+    if (restored + record.len > http_cache_size)
+      break;
+    restored += record.len;
+
+    body = NULL;
+    if (record.flags & HTTP_CACHE_SNAPSHOT_BODY) {
+      if ((body = malloc(record.len)) == NULL || fread(body, 1, record.len, file) != record.len) {
+        free(body);
+        break;
+      }
+    }
+
+    warm(key, record.etag, body, record.len);
+  }
+
+  fclose(file);
+  return 0;
+}
@@ -0,0 +1,70 @@
+// SPDX-License-Identifier: MIT
+
+#ifndef _HTTP_CACHE
+#define _HTTP_CACHE
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "http_core.h"
+
+#define HTTP_CACHE_SIZE_DEFAULT (64 * 1024 * 1024) // bytes
+
+#define HTTP_CACHE_SNAPSHOT_MAGIC "WSFSSNAP"
+#define HTTP_CACHE_SNAPSHOT_VERSION 1
+#define HTTP_CACHE_SNAPSHOT_BODY 1 // record flag, the body follows the key
+
+typedef struct http_cache_entry {
+  // Hash chain and LRU list links, protected by the cache lock
+  struct http_cache_entry     *next;
+  struct http_cache_entry     *lru_prev;
+  struct http_cache_entry     *lru_next;
+
+  char                        *key;
+  uint32_t                    hash;
+
+  // ETag of the source representation the body was derived from
+  char                        etag[HTTP_ETAG_MAX];
+
+  // NULL with `ready` set means the variant is not worth keeping and the
+  // source should be served instead
+  char                        *body;
+  size_t                      len;
+  int                         ready;
+
+  unsigned                    refcount;
+  int                         cached; // still reachable from the table
+  uint64_t                    hits; // halved by every snapshot
+} http_cache_entry_t;
+
+// Snapshot file layout: a header, then records hottest first, each
+// followed by its key and, with HTTP_CACHE_SNAPSHOT_BODY, its body
+typedef struct {
+  char                        magic[8];
+  uint32_t                    version;
+  uint32_t                    count;
+} http_cache_snapshot_header_t;
+
+typedef struct {
+  uint64_t                    hits;
+  uint64_t                    len;
+  uint32_t                    key_len;
+  uint32_t                    flags;
+  char                        etag[HTTP_ETAG_MAX];
+} http_cache_snapshot_record_t;
+
+// Called by http_cache_restore() for every record: `body` is malloc()ed
+// and owned by the callee, or NULL if the snapshot has no bodies
+typedef void (*http_cache_warm_t)(const char *key, const char *etag, char *body, size_t len);
+
+extern size_t http_cache_size;
+
+int http_cache_init();
+http_cache_entry_t *http_cache_get(const char *key, const char *etag, int *reserved);
+http_cache_entry_t *http_cache_set(const char *key, const char *etag, char *body, size_t len);
+void http_cache_retain(http_cache_entry_t *entry);
+void http_cache_release(http_cache_entry_t *entry);
+int http_cache_snapshot(const char *path, int bodies);
+int http_cache_restore(const char *path, http_cache_warm_t warm);
+
+#endif
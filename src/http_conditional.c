@@ -0,0 +1,157 @@
+// SPDX-License-Identifier: MIT
+
+#include <config.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "http_conditional.h"
+#include "http_core.h"
+#include "http_utils.h"
+
+static int
+http_conditional_validators(http_file_meta_t *meta)
+{
+  int len = snprintf(meta->validators, sizeof(meta->validators),
+    "ETag: %s\r\n"
+    "Last-Modified: %s\r\n"
+    "%s",
+    meta->etag, meta->last_modified, meta->vary ? "Vary: Accept-Encoding\r\n" : "");
+  if (len < 0 || (size_t)len >= sizeof(meta->validators))
+    return -1;
+
+  meta->validators_len = len;
+  return 0;
+}
+
+int
+http_conditional_meta_set(http_file_meta_t *out, const struct stat *st, int vary)
+{
+  // http_conditional_meta_set():
+  // Fill `out` from `st` and prebuild its validator header fields.
+  // The ETag is strong: it changes whenever the inode, size or
+  // modification time (with nanoseconds) of the file changes.
+
+  out->ino = st->st_ino;
+  out->size = st->st_size;
+  out->mtime = st->st_mtim;
+  out->vary = vary;
+
+  snprintf(out->etag, sizeof(out->etag), "\"%llx-%llx-%llx%08lx\"",
+    (unsigned long long)st->st_ino, (unsigned long long)st->st_size,
+    (unsigned long long)st->st_mtim.tv_sec, (unsigned long)st->st_mtim.tv_nsec);
+
+  if (http_date_format(out->last_modified, sizeof(out->last_modified), st->st_mtim.tv_sec) != 0)
+    return -1;
+
+  return http_conditional_validators(out);
+}
+
+int
+http_conditional_meta_variant(http_file_meta_t *meta, const char *encoding, off_t size)
+{
+  // http_conditional_meta_variant():
+  // Turn `meta` into the metadata of its `encoding` variant of `size`
+  // bytes. Each variant needs its own strong ETag (RFC 9110 8.8.3.3).
+
+  size_t len = strlen(meta->etag);
+
+  if (len + strlen(encoding) + 1 >= sizeof(meta->etag))
+    return -1;
+
+  // Insert "-<encoding>" before the closing quote
+  snprintf(meta->etag + len - 1, sizeof(meta->etag) - len + 1, "-%s\"", encoding);
+  meta->size = size;
+  meta->vary = 1;
+
+  return http_conditional_validators(meta);
+}
+
+int
+http_conditional_etag_match(const char *list, const char *etag, int weak)
+{
+  // http_conditional_etag_match():
+  // Check whether `etag` (a strong tag, quotes included) is in the
+  // comma separated entity-tag `list` or the list is "*".
+  // With `weak` set, weak tags in the list compare by their opaque part
+  // (RFC 9110 8.8.3.2); otherwise they never match.
+
+  size_t etag_len = strlen(etag);
+  const char *s = list;
+
+  while (*s != '\0') {
+    while (*s == ' ' || *s == '\t' || *s == ',')
+      s++;
+
+    if (*s == '*')
+      return 1;
+
+    int is_weak = strncmp(s, "W/", 2) == 0;
+    if (is_weak)
+      s += 2;
+
+    if (*s != '"')
+      return 0;
+
+    const char *end = strchr(s + 1, '"');
+    if (end == NULL)
+      return 0;
+    end++;
+
+    if ((weak || !is_weak) && (size_t)(end - s) == etag_len && strncmp(s, etag, etag_len) == 0)
+      return 1;
+
+    s = end;
+  }
+
+  return 0;
+}
+
+int
+http_conditional_not_modified(const http_request_t *request, const http_file_meta_t *meta)
+{
+  // http_conditional_not_modified():
+  // Evaluate If-None-Match and If-Modified-Since (RFC 9110 13.2.2) for a
+  // GET or HEAD request. Returns 1 if the answer is 304 Not Modified.
+
+  const char *value;
+  time_t date;
+
+  if (request->method != HTTP_METHOD_GET && request->method != HTTP_METHOD_HEAD)
+    return 0;
+
+  // If-Modified-Since is ignored when If-None-Match is present
+  if ((value = http_header_get(request, "If-None-Match")) != NULL)
+    return http_conditional_etag_match(value, meta->etag, 1);
+
+  if ((value = http_header_get(request, "If-Modified-Since")) != NULL
+    && http_date_parse(value, &date) == 0)
+    return meta->mtime.tv_sec <= date;
+
+  return 0;
+}
+
+int
+http_conditional_send_not_modified(int socketfd, const http_file_meta_t *meta, const http_request_t *request)
+{
+  // http_conditional_send_not_modified():
+  // Send a 304 response made of a constant head, the Date field, the
+  // prebuilt validators of `meta` and the Connection field with a single
+  // writev().
+
+  static const char head[] = HTTP11_STR " 304 " REDIRECT_NOT_MODIFIED_STRING "\r\n"
+                             "Server: " PACKAGE_STRING "\r\n";
+  wsfs_str_t date = http_date_header();
+  const char *connection = http_connection_header(request);
+
+  http_segment_t segments[] = {
+    { .fd = -1, .data = head, .len = sizeof(head) - 1 },
+    { .fd = -1, .data = date.string, .len = date.len },
+    { .fd = -1, .data = meta->validators, .len = meta->validators_len },
+    { .fd = -1, .data = connection, .len = strlen(connection) },
+    { .fd = -1, .data = "\r\n", .len = 2 },
+  };
+
+  return http_send_segments(socketfd, segments, 5);
+}
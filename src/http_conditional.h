@@ -0,0 +1,16 @@
+// SPDX-License-Identifier: MIT
+
+#ifndef _HTTP_CONDITIONAL
+#define _HTTP_CONDITIONAL
+
+#include <sys/stat.h>
+
+#include "http_core.h"
+
+int http_conditional_meta_set(http_file_meta_t *out, const struct stat *st, int vary);
+int http_conditional_meta_variant(http_file_meta_t *meta, const char *encoding, off_t size);
+int http_conditional_etag_match(const char *list, const char *etag, int weak);
+int http_conditional_not_modified(const http_request_t *request, const http_file_meta_t *meta);
+int http_conditional_send_not_modified(int socketfd, const http_file_meta_t *meta, const http_request_t *request);
+
+#endif
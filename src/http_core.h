@@ -5,6 +5,8 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <sys/types.h>
+#include <time.h>
 
 #include "wsfs_core.h"
 
@@ -19,6 +21,22 @@
 #define HTTP20_STR "HTTP/2.0"
 #define HTTP30_STR "HTTP/3.0"
 
+// Request methods
+#define HTTP_METHOD_UNKNOWN 0
+#define HTTP_METHOD_GET 1
+#define HTTP_METHOD_HEAD 2
+#define HTTP_METHOD_POST 3
+#define HTTP_METHOD_PUT 4
+#define HTTP_METHOD_DELETE 5
+#define HTTP_METHOD_OPTIONS 6
+
+#define HTTP_METHOD_GET_STR "GET"
+#define HTTP_METHOD_HEAD_STR "HEAD"
+#define HTTP_METHOD_POST_STR "POST"
+#define HTTP_METHOD_PUT_STR "PUT"
+#define HTTP_METHOD_DELETE_STR "DELETE"
+#define HTTP_METHOD_OPTIONS_STR "OPTIONS"
+
 // Status codes
 #define INFO_CONTINUE 100
 #define INFO_SWITCH_PROTOCOLS 101
@@ -224,6 +242,11 @@
 #define HTTP_HEADERS_LENGTH_MAX 256
 #define HTTP_BODY_LENGTH_MAX 8192
 #define HTTP_STATUS_STRING_LENGTH_MAX 128
+#define HTTP_RESPONSE_HEADERS_MAX 1024
+#define HTTP_SEGMENTS_MAX 64
+#define HTTP_ETAG_MAX 64
+#define HTTP_DATE_MAX 32
+#define HTTP_VALIDATORS_MAX 128
 
 #define CR 13 // Carriage return
 #define LF 10 // Linefeed
@@ -252,11 +275,26 @@ typedef struct {
 typedef struct {
   http_version_t              version;
   http_method_t               method;
+  wsfs_str_t                  method_name; // as received, also for unknown methods
   wsfs_str_t                  path;
+  wsfs_str_t                  query; // without the "?", empty if there is none
 
   http_header_collection_t    headers;
 
   wsfs_str_t                  body;
+
+  // Whether the connection stays open after the response
+  int                         keep_alive;
+
+  // Backing storage. `path` and `headers` point into `raw`.
+  // `raw` may hold more than `header_len` bytes when the client
+  // pipelines requests. It is borrowed from the buffer pool while a
+  // request is in flight, NULL in between.
+  char                        *raw;
+  size_t                      raw_size;
+  size_t                      raw_len;
+  size_t                      header_len;
+  http_header_t               header_list[HTTP_HEADERS_MAX];
 } http_request_t;
 
 // HTTP RESPONSE //
@@ -269,4 +307,34 @@ typedef struct {
   wsfs_str_t                  body;
 } http_response_t;
 
+// HTTP RESPONSE SEGMENT //
+// A piece of a response on the wire: either memory (`fd` is -1) or
+// a byte range of an open file, which is sent with sendfile().
+typedef struct {
+  int                         fd;
+  const char                  *data;
+  off_t                       offset;
+  size_t                      len;
+} http_segment_t;
+
+// HTTP FILE METADATA //
+// Everything needed to answer a request for a file without touching
+// its contents.
+typedef struct {
+  ino_t                       ino;
+  off_t                       size;
+  struct timespec             mtime;
+
+  char                        etag[HTTP_ETAG_MAX];
+  char                        last_modified[HTTP_DATE_MAX];
+
+  // The resource has encoded variants, every response for it
+  // carries "Vary: Accept-Encoding"
+  int                         vary;
+
+  // "ETag: ...\r\nLast-Modified: ...\r\n[Vary: ...\r\n]", ready to be sent
+  char                        validators[HTTP_VALIDATORS_MAX];
+  size_t                      validators_len;
+} http_file_meta_t;
+
 #endif
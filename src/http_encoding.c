@@ -0,0 +1,210 @@
+// SPDX-License-Identifier: MIT
+
+#include <config.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_BROTLI
+#include <brotli/encode.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "http_encoding.h"
+
+static const char *encoding_names[HTTP_ENCODINGS] = {
+  [HTTP_ENCODING_IDENTITY] = HTTP_ENCODING_IDENTITY_STR,
+  [HTTP_ENCODING_GZIP] = HTTP_ENCODING_GZIP_STR,
+  [HTTP_ENCODING_BR] = HTTP_ENCODING_BR_STR,
+  [HTTP_ENCODING_ZSTD] = HTTP_ENCODING_ZSTD_STR,
+};
+
+static const char *encoding_extensions[HTTP_ENCODINGS] = {
+  [HTTP_ENCODING_IDENTITY] = "",
+  [HTTP_ENCODING_GZIP] = ".gz",
+  [HTTP_ENCODING_BR] = ".br",
+  [HTTP_ENCODING_ZSTD] = ".zst",
+};
+
+// Content codings in order of preference, best compression first
+const int http_encoding_preference[HTTP_ENCODINGS - 1] = { HTTP_ENCODING_BR, HTTP_ENCODING_ZSTD, HTTP_ENCODING_GZIP };
+
+const char *
+http_encoding_name(int encoding)
+{
+  return encoding_names[encoding];
+}
+
+const char *
+http_encoding_extension(int encoding)
+{
+  return encoding_extensions[encoding];
+}
+
+int
+http_encoding_accepted(const char *accept_encoding)
+{
+  // http_encoding_accepted():
+  // Parse an Accept-Encoding field value (RFC 9110 12.5.3) into a bit mask
+  // of acceptable HTTP_ENCODING_* values. Codings with q=0 are refused,
+  // "*" stands for every coding not listed explicitly. Identity is
+  // always included: refusing it is not honoured.
+
+  int accepted = 0, refused = 0, wildcard = -1;
+  const char *s = accept_encoding;
+
+  if (s == NULL)
+    return 1 << HTTP_ENCODING_IDENTITY;
+
+  while (*s != '\0') {
+    while (*s == ' ' || *s == '\t' || *s == ',')
+      s++;
+    if (*s == '\0')
+      break;
+
+    const char *token = s;
+    size_t token_len = strcspn(s, " \t;,");
+    s += token_len;
+
+    // Only q=0 matters, any other weight just means acceptable
+    int zero = 0;
+    while (*s != '\0' && *s != ',') {
+      if (*s == ';') {
+        s++;
+        while (*s == ' ' || *s == '\t')
+          s++;
+        if ((*s == 'q' || *s == 'Q') && s[1] == '=') {
+          const char *q = s + 2;
+          zero = q[0] == '0' && (q[1] != '.' || strspn(q + 2, "0") == strcspn(q + 2, " \t;,"));
+        }
+        continue;
+      }
+      s++;
+    }
+
+    if (token_len == 1 && token[0] == '*') {
+      wildcard = !zero;
+      continue;
+    }
+
+    for (int encoding = 0; encoding < HTTP_ENCODINGS; encoding++) {
+      if (strlen(encoding_names[encoding]) == token_len && strncasecmp(token, encoding_names[encoding], token_len) == 0) {
+        if (zero)
+          refused |= 1 << encoding;
+        else
+          accepted |= 1 << encoding;
+      }
+    }
+
+    // "x-gzip" is an alias of gzip (RFC 9110 8.4.1.3)
+    if (token_len == 6 && strncasecmp(token, "x-gzip", 6) == 0 && !zero)
+      accepted |= 1 << HTTP_ENCODING_GZIP;
+  }
+
+  if (wildcard == 1)
+    accepted |= ((1 << HTTP_ENCODINGS) - 1) & ~refused;
+
+  return accepted | 1 << HTTP_ENCODING_IDENTITY;
+}
+
+int
+http_encoding_supported(int encoding)
+{
+  // Whether `encoding` can be produced by http_encoding_compress()
+  switch (encoding) {
+#ifdef HAVE_ZLIB
+  case HTTP_ENCODING_GZIP: return 1;
+#endif
+#ifdef HAVE_BROTLI
+  case HTTP_ENCODING_BR: return 1;
+#endif
+#ifdef HAVE_ZSTD
+  case HTTP_ENCODING_ZSTD: return 1;
+#endif
+  default: return 0;
+  }
+}
+
+#ifdef HAVE_ZLIB
+static int
+http_encoding_gzip(int level, const char *in, size_t in_len, char *out, size_t *out_len)
+{
+  z_stream stream;
+  int result;
+
+  memset(&stream, 0, sizeof(stream));
+  // 15 window bits + 16 selects the gzip wrapper
+  if (deflateInit2(&stream, level == HTTP_ENCODING_LEVEL_BEST ? 9 : 6, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK)
+    return -1;
+
+  stream.next_in = (Bytef *)in;
+  stream.avail_in = in_len;
+  stream.next_out = (Bytef *)out;
+  stream.avail_out = *out_len;
+
+  result = deflate(&stream, Z_FINISH);
+  *out_len = stream.total_out;
+  deflateEnd(&stream);
+
+  return result == Z_STREAM_END ? 0 : -1;
+}
+#endif
+
+int
+http_encoding_compress(int encoding, int level, const char *in, size_t in_len, char **out, size_t *out_len)
+{
+  // http_encoding_compress():
+  // Compress `in` with `encoding` into a newly allocated `out`.
+  // Returns 0 on success, 1 if the result would not be smaller than the
+  // input (`out` is then NULL) and -1 on failure.
+
+  char *buffer;
+  size_t len;
+  int result = -1;
+
+  // Output larger than this is useless
+  len = in_len;
+  if ((buffer = malloc(len)) == NULL)
+    return -1;
+
+  switch (encoding) {
+#ifdef HAVE_ZLIB
+  case HTTP_ENCODING_GZIP:
+    result = http_encoding_gzip(level, in, in_len, buffer, &len);
+    break;
+#endif
+#ifdef HAVE_BROTLI
+  case HTTP_ENCODING_BR:
+    result = BrotliEncoderCompress(level == HTTP_ENCODING_LEVEL_BEST ? BROTLI_MAX_QUALITY : 5,
+               BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT, in_len, (const uint8_t *)in, &len, (uint8_t *)buffer)
+      ? 0
+      : -1;
+    break;
+#endif
+#ifdef HAVE_ZSTD
+  case HTTP_ENCODING_ZSTD:
+    len = ZSTD_compress(buffer, len, in, in_len, level == HTTP_ENCODING_LEVEL_BEST ? 19 : 3);
+    result = ZSTD_isError(len) ? -1 : 0;
+    break;
+#endif
+  default:
+    break;
+  }
+
+  // Every encoder fails when the output does not fit, which here means
+  // the data does not compress
+  if (result != 0 || len >= in_len) {
+    free(buffer);
+    *out = NULL;
+    return http_encoding_supported(encoding) ? 1 : -1;
+  }
+
+  *out = buffer;
+  *out_len = len;
+  return 0;
+}
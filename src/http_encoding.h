@@ -0,0 +1,36 @@
+// SPDX-License-Identifier: MIT
+
+#ifndef _HTTP_ENCODING
+#define _HTTP_ENCODING
+
+#include <stddef.h>
+
+// Content codings, also indexes into per-encoding arrays
+#define HTTP_ENCODING_IDENTITY 0
+#define HTTP_ENCODING_GZIP 1
+#define HTTP_ENCODING_BR 2
+#define HTTP_ENCODING_ZSTD 3
+#define HTTP_ENCODINGS 4
+
+#define HTTP_ENCODING_IDENTITY_STR "identity"
+#define HTTP_ENCODING_GZIP_STR "gzip"
+#define HTTP_ENCODING_BR_STR "br"
+#define HTTP_ENCODING_ZSTD_STR "zstd"
+
+// Files outside of these bounds are not compressed on the fly
+#define HTTP_ENCODING_SIZE_MIN 256
+#define HTTP_ENCODING_SIZE_MAX (8 * 1024 * 1024)
+
+// On the fly and offline compression levels
+#define HTTP_ENCODING_LEVEL_FAST 0
+#define HTTP_ENCODING_LEVEL_BEST 1
+
+extern const int http_encoding_preference[HTTP_ENCODINGS - 1];
+
+const char *http_encoding_name(int encoding);
+const char *http_encoding_extension(int encoding);
+int http_encoding_accepted(const char *accept_encoding);
+int http_encoding_supported(int encoding);
+int http_encoding_compress(int encoding, int level, const char *in, size_t in_len, char **out, size_t *out_len);
+
+#endif
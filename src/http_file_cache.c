@@ -0,0 +1,367 @@
+// SPDX-License-Identifier: MIT
+
+#include <config.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "http_file_cache.h"
+#include "log_levels.h"
+#include "logger.h"
+#include "wsfs_core.h"
+
+// Open file cache
+//
+// Maps request paths to open descriptors and the metadata needed to build
+// a response, so a hot file is served without any path resolution
+// syscalls. Entries are reference counted: eviction only unlinks an
+// entry, its descriptor is closed once the last request using it is done.
+//
+// An entry is trusted for `http_file_cache_ttl` seconds, or the TTL of
+// its virtual host. With `http_file_cache_inotify` set, changes to a
+// cached file drop its entries right away.
+
+size_t http_file_cache_entries = HTTP_FILE_CACHE_ENTRIES_DEFAULT;
+time_t http_file_cache_ttl = HTTP_FILE_CACHE_TTL_DEFAULT;
+int http_file_cache_inotify = 0;
+
+// Entries sharing an inotify watch: several paths may name one inode,
+// and the kernel hands out one watch per inode
+typedef struct http_file_cache_watch {
+  struct http_file_cache_watch *next; // hash chain
+  int                         wd; // -1 once the kernel dropped it
+  http_file_cache_entry_t     *entries; // linked through watch_next
+} http_file_cache_watch_t;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static http_file_cache_entry_t **buckets;
+static size_t bucket_mask;
+static size_t count;
+static http_file_cache_entry_t *lru_head, *lru_tail; // most recent first
+static int inotify_fd = -1;
+static http_file_cache_watch_t **watches; // by watch descriptor
+static size_t watch_mask;
+
+static uint32_t
+http_file_cache_hash(uint32_t root, const char *s)
+{
+  // The root id seeds the hash
+  return wsfs_fnv1a32(s, strlen(s), root);
+}
+
+static time_t
+http_file_cache_now()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+  return now.tv_sec;
+}
+
+static http_file_cache_watch_t **
+http_file_cache_watch_find(int wd)
+{
+  // Called with the lock held. Returns the link to the watch of `wd`, or
+  // to the NULL ending its chain.
+  http_file_cache_watch_t **link = &watches[wd & watch_mask];
+  while (*link != NULL && (*link)->wd != wd)
+    link = &(*link)->next;
+  return link;
+}
+
+static void
+http_file_cache_watch_add(http_file_cache_entry_t *entry, int wd)
+{
+  // Called with the lock held
+  http_file_cache_watch_t **link = http_file_cache_watch_find(wd), *watch = *link;
+
+  if (watch == NULL) {
+    if ((watch = malloc(sizeof(*watch))) == NULL) {
+      inotify_rm_watch(inotify_fd, wd);
+      return;
+    }
+    watch->next = NULL;
+    watch->wd = wd;
+    watch->entries = NULL;
+    *link = watch;
+  }
+
+  entry->watch = watch;
+  entry->watch_next = watch->entries;
+  watch->entries = entry;
+}
+
+static void
+http_file_cache_watch_remove(http_file_cache_entry_t *entry)
+{
+  // Called with the lock held. The watch goes with its last entry.
+  http_file_cache_watch_t *watch = entry->watch;
+  http_file_cache_entry_t **link = &watch->entries;
+
+  while (*link != entry)
+    link = &(*link)->watch_next;
+  *link = entry->watch_next;
+  entry->watch = NULL;
+
+  if (watch->entries != NULL)
+    return;
+  if (watch->wd != -1) {
+    *http_file_cache_watch_find(watch->wd) = watch->next;
+    inotify_rm_watch(inotify_fd, watch->wd);
+  }
+  free(watch);
+}
+
+static void
+http_file_cache_destroy(http_file_cache_entry_t *entry)
+{
+  // Called with the lock held, once the entry is unlinked and unused
+  if (entry->watch != NULL)
+    http_file_cache_watch_remove(entry);
+
+  close(entry->fd);
+  for (int encoding = 0; encoding < HTTP_ENCODINGS; encoding++) {
+    if (entry->encoded_fd[encoding] != -1)
+      close(entry->encoded_fd[encoding]);
+    free(entry->headers[encoding]);
+  }
+  wsfs_string_free(&entry->path);
+  free(entry);
+}
+
+static void
+http_file_cache_unlink(http_file_cache_entry_t *entry)
+{
+  // Called with the lock held
+  http_file_cache_entry_t **link = &buckets[entry->hash & bucket_mask];
+  while (*link != entry)
+    link = &(*link)->next;
+  *link = entry->next;
+
+  if (entry->lru_prev != NULL)
+    entry->lru_prev->lru_next = entry->lru_next;
+  else
+    lru_head = entry->lru_next;
+  if (entry->lru_next != NULL)
+    entry->lru_next->lru_prev = entry->lru_prev;
+  else
+    lru_tail = entry->lru_prev;
+
+  entry->cached = 0;
+  count--;
+
+  if (entry->refcount == 0)
+    http_file_cache_destroy(entry);
+}
+
+static void *
+http_file_cache_watch(void *arg)
+{
+  // Invalidate entries whose file was modified, replaced or removed
+  char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  http_file_cache_watch_t **link, *watch;
+  http_file_cache_entry_t *entry, *next;
+  ssize_t len;
+
+  (void)arg;
+
+  while ((len = read(inotify_fd, buffer, sizeof(buffer))) > 0) {
+    pthread_mutex_lock(&lock);
+    for (char *p = buffer; p < buffer + len;) {
+      const struct inotify_event *event = (const struct inotify_event *)p;
+
+      link = http_file_cache_watch_find(event->wd);
+      if ((watch = *link) != NULL) {
+        // The kernel already dropped the watch, its number may come back
+        if (event->mask & IN_IGNORED) {
+          *link = watch->next;
+          watch->wd = -1;
+        }
+        // Entries still in use after an earlier eviction keep the watch
+        // until they are destroyed
+        for (entry = watch->entries; entry != NULL; entry = next) {
+          next = entry->watch_next;
+          if (entry->cached)
+            http_file_cache_unlink(entry);
+        }
+      }
+
+      p += sizeof(struct inotify_event) + event->len;
+    }
+    pthread_mutex_unlock(&lock);
+  }
+
+  logger(LOGL_ERROR, NULL, "file cache: inotify read failed, relying on TTL");
+  return NULL;
+}
+
+int
+http_file_cache_init()
+{
+  size_t bucket_count = 1;
+  pthread_t thread;
+
+  if (http_file_cache_entries == 0)
+    return 0;
+
+  // Keep chains short: at least two buckets per entry
+  while (bucket_count < http_file_cache_entries * 2)
+    bucket_count <<= 1;
+
+  if ((buckets = calloc(bucket_count, sizeof(*buckets))) == NULL)
+    return -1;
+  bucket_mask = bucket_count - 1;
+
+  if (!http_file_cache_inotify)
+    return 0;
+
+  if ((watches = calloc(bucket_count, sizeof(*watches))) == NULL)
+    return -1;
+  watch_mask = bucket_mask;
+  if ((inotify_fd = inotify_init1(IN_CLOEXEC)) == -1)
+    return -1;
+
+  if (pthread_create(&thread, NULL, http_file_cache_watch, NULL) != 0)
+    return -1;
+  pthread_detach(thread);
+
+  return 0;
+}
+
+http_file_cache_entry_t *
+http_file_cache_get(uint32_t root, const char *path)
+{
+  // http_file_cache_get():
+  // Look up `path` below document root `root`. A returned entry must be given back with
+  // http_file_cache_release().
+
+  http_file_cache_entry_t *entry;
+  wsfs_str_t key = wsfs_str_from(path);
+  uint32_t hash;
+
+  if (buckets == NULL)
+    return NULL;
+
+  hash = http_file_cache_hash(root, path);
+
+  pthread_mutex_lock(&lock);
+
+  for (entry = buckets[hash & bucket_mask]; entry != NULL; entry = entry->next)
+    if (entry->hash == hash && entry->root == root && wsfs_str_eq(wsfs_string_view(&entry->path), key))
+      break;
+
+  if (entry != NULL && entry->expires <= http_file_cache_now()) {
+    http_file_cache_unlink(entry);
+    entry = NULL;
+  }
+
+  if (entry != NULL) {
+    entry->refcount++;
+
+    // Move to the LRU head
+    if (entry != lru_head) {
+      entry->lru_prev->lru_next = entry->lru_next;
+      if (entry->lru_next != NULL)
+        entry->lru_next->lru_prev = entry->lru_prev;
+      else
+        lru_tail = entry->lru_prev;
+      entry->lru_prev = NULL;
+      entry->lru_next = lru_head;
+      lru_head->lru_prev = entry;
+      lru_head = entry;
+    }
+  }
+
+  pthread_mutex_unlock(&lock);
+  return entry;
+}
+
+http_file_cache_entry_t *
+http_file_cache_put(uint32_t root, const char *path, const http_file_cache_entry_t *entry, time_t ttl)
+{
+  // http_file_cache_put():
+  // Insert a copy of `entry` (descriptors, metadata, content_type and
+  // header blocks are used) under `path` below `root`, trusted for `ttl`
+  // seconds. On success the cache owns the descriptors and header blocks
+  // and the new entry is returned already acquired. Returns NULL if the
+  // entry was not cached; they then stay with the caller.
+
+  http_file_cache_entry_t *new, *old;
+  char fd_path[32];
+  int wd;
+
+  if (buckets == NULL)
+    return NULL;
+
+  if ((new = malloc(sizeof(*new))) == NULL)
+    return NULL;
+
+  if (wsfs_string_set(&new->path, wsfs_str_from(path)) != 0) {
+    free(new);
+    return NULL;
+  }
+
+  new->root = root;
+  new->hash = http_file_cache_hash(root, path);
+  new->fd = entry->fd;
+  new->meta = entry->meta;
+  new->content_type = entry->content_type;
+  memcpy(new->encoded_fd, entry->encoded_fd, sizeof(new->encoded_fd));
+  memcpy(new->encoded_meta, entry->encoded_meta, sizeof(new->encoded_meta));
+  memcpy(new->headers, entry->headers, sizeof(new->headers));
+  memcpy(new->headers_len, entry->headers_len, sizeof(new->headers_len));
+  new->expires = http_file_cache_now() + ttl;
+  new->refcount = 1;
+  new->cached = 1;
+  new->watch = NULL;
+
+  pthread_mutex_lock(&lock);
+
+  // Added under the lock so a concurrent eviction of an entry sharing
+  // the watch cannot remove it. The descriptor's magic link names the
+  // file without resolving its path again.
+  if (inotify_fd != -1) {
+    snprintf(fd_path, sizeof(fd_path), "/proc/self/fd/%d", new->fd);
+    wd = inotify_add_watch(inotify_fd, fd_path, IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF);
+    if (wd != -1)
+      http_file_cache_watch_add(new, wd);
+  }
+
+  // Another thread may have cached the same path meanwhile
+  for (old = buckets[new->hash & bucket_mask]; old != NULL; old = old->next)
+    if (old->hash == new->hash && old->root == new->root && wsfs_str_eq(wsfs_string_view(&old->path), wsfs_string_view(&new->path)))
+      break;
+  if (old != NULL)
+    http_file_cache_unlink(old);
+
+  if (count == http_file_cache_entries)
+    http_file_cache_unlink(lru_tail);
+
+  new->next = buckets[new->hash & bucket_mask];
+  buckets[new->hash & bucket_mask] = new;
+
+  new->lru_prev = NULL;
+  new->lru_next = lru_head;
+  if (lru_head != NULL)
+    lru_head->lru_prev = new;
+  else
+    lru_tail = new;
+  lru_head = new;
+
+  count++;
+
+  pthread_mutex_unlock(&lock);
+  return new;
+}
+
+void
+http_file_cache_release(http_file_cache_entry_t *entry)
+{
+  pthread_mutex_lock(&lock);
+  if (--entry->refcount == 0 && !entry->cached)
+    http_file_cache_destroy(entry);
+  pthread_mutex_unlock(&lock);
+}
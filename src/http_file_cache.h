@@ -0,0 +1,58 @@
+// SPDX-License-Identifier: MIT
+
+#ifndef _HTTP_FILE_CACHE
+#define _HTTP_FILE_CACHE
+
+#include <stdint.h>
+#include <time.h>
+
+#include "http_core.h"
+#include "http_encoding.h"
+
+#define HTTP_FILE_CACHE_ENTRIES_DEFAULT 1024
+#define HTTP_FILE_CACHE_TTL_DEFAULT 10 // seconds
+
+typedef struct http_file_cache_entry {
+  // Hash chain and LRU list links, protected by the cache lock
+  struct http_file_cache_entry *next;
+  struct http_file_cache_entry *lru_prev;
+  struct http_file_cache_entry *lru_next;
+
+  wsfs_string_t               path; // request path, the key with `root`
+  uint32_t                    root; // document root id, see http_static_root_t
+  uint32_t                    hash;
+
+  int                         fd;
+  http_file_meta_t            meta;
+  const char                  *content_type;
+
+  // Precompressed siblings of the file (".gz", ".br", ".zst") indexed
+  // by HTTP_ENCODING_*, -1 if missing or older than the file. The
+  // identity slot is unused.
+  int                         encoded_fd[HTTP_ENCODINGS];
+  http_file_meta_t            encoded_meta[HTTP_ENCODINGS];
+
+  // Header fields of a 200 response for each representation, from
+  // Server to the validators, built when the file is opened. NULL where
+  // there is no representation or the block could not be built.
+  char                        *headers[HTTP_ENCODINGS];
+  size_t                      headers_len[HTTP_ENCODINGS];
+
+  time_t                      expires; // CLOCK_MONOTONIC_COARSE seconds
+  struct http_file_cache_watch *watch; // inotify watch, NULL if none
+  struct http_file_cache_entry *watch_next; // other entries sharing it
+
+  unsigned                    refcount;
+  int                         cached; // still reachable from the table
+} http_file_cache_entry_t;
+
+extern size_t http_file_cache_entries;
+extern time_t http_file_cache_ttl;
+extern int http_file_cache_inotify;
+
+int http_file_cache_init();
+http_file_cache_entry_t *http_file_cache_get(uint32_t root, const char *path);
+http_file_cache_entry_t *http_file_cache_put(uint32_t root, const char *path, const http_file_cache_entry_t *entry, time_t ttl);
+void http_file_cache_release(http_file_cache_entry_t *entry);
+
+#endif
@@ -0,0 +1,186 @@
+// SPDX-License-Identifier: MIT
+
+#include <config.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "http_io.h"
+#include "http_profile.h"
+
+// Disk I/O offload
+//
+// A worker serves one connection at a time, so a response waiting for
+// the disk keeps it from accepting anything else. Before sending file
+// data a worker checks whether it is in the page cache, by reading a
+// byte with RWF_NOWAIT, which fails instead of going to the disk. If it
+// is not, the connection is queued for a small pool of I/O threads and
+// the worker goes back to the hot requests.
+//
+// An I/O thread sends the response, waiting for the disk as long as it
+// takes, and hands the connection back through a queue whose eventfd
+// the workers poll next to the listening socket. Idle keep-alive
+// connections never tie up an I/O thread.
+//
+// Every connection away from the workers holds one of
+// HTTP_IO_QUEUE_MAX slots, taken by http_io_cold(). Without a free slot
+// the data is sent right away, cold or not.
+
+// Files smaller than this are checked at their first byte only
+#define HTTP_IO_SAMPLE (64 * 1024)
+
+long http_io_threads = HTTP_IO_THREADS_DEFAULT;
+int http_io_completion_fd = -1;
+
+static __thread int pool_thread; // never defers, it is the pool
+static http_io_job_t pool_job;
+static atomic_size_t slots;
+
+// Queues, each guarded by its lock and counted by its eventfd
+static pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+static void *jobs[HTTP_IO_QUEUE_MAX];
+static size_t job_head, job_count;
+static int job_fd = -1;
+
+static pthread_mutex_t completion_lock = PTHREAD_MUTEX_INITIALIZER;
+static void *completions[HTTP_IO_QUEUE_MAX];
+static size_t completion_head, completion_count;
+
+static void
+http_io_push(pthread_mutex_t *lock, void **queue, size_t *head, size_t *count, int fd, void *arg)
+{
+  uint64_t one = 1;
+
+  pthread_mutex_lock(lock);
+  queue[(*head + (*count)++) % HTTP_IO_QUEUE_MAX] = arg;
+  pthread_mutex_unlock(lock);
+  write(fd, &one, sizeof(one));
+}
+
+static void *
+http_io_pop(pthread_mutex_t *lock, void **queue, size_t *head, size_t *count)
+{
+  void *arg = NULL;
+
+  pthread_mutex_lock(lock);
+  if (*count > 0) {
+    arg = queue[*head];
+    *head = (*head + 1) % HTTP_IO_QUEUE_MAX;
+    (*count)--;
+  }
+  pthread_mutex_unlock(lock);
+  return arg;
+}
+
+static void *
+http_io_thread(void *arg)
+{
+  uint64_t value;
+  (void)arg;
+
+  pool_thread = 1;
+  http_profile_thread();
+
+  while (1) {
+    // Semaphore mode: every read takes one job
+    if (read(job_fd, &value, sizeof(value)) != sizeof(value))
+      continue;
+    if ((arg = http_io_pop(&job_lock, jobs, &job_head, &job_count)) == NULL)
+      continue;
+
+    if (pool_job(arg))
+      http_io_push(&completion_lock, completions, &completion_head, &completion_count, http_io_completion_fd, arg);
+    else
+      atomic_fetch_sub(&slots, 1);
+  }
+
+  return NULL;
+}
+
+int
+http_io_init(http_io_job_t job)
+{
+  // http_io_init():
+  // Start the I/O threads, which run `job` for every submitted
+  // connection. Returns 0 or -1.
+
+  pthread_t thread;
+
+  if (http_io_threads == 0)
+    return 0;
+
+  pool_job = job;
+  if ((job_fd = eventfd(0, EFD_SEMAPHORE | EFD_CLOEXEC)) == -1)
+    return -1;
+  if ((http_io_completion_fd = eventfd(0, EFD_SEMAPHORE | EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+    return -1;
+
+  for (long i = 0; i < http_io_threads; i++) {
+    if (pthread_create(&thread, NULL, http_io_thread, NULL) != 0)
+      return -1;
+    pthread_detach(thread);
+  }
+  return 0;
+}
+
+static int
+http_io_resident(int fd, off_t offset)
+{
+  char byte;
+  struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+
+  if (preadv2(fd, &iov, 1, offset, RWF_NOWAIT) != -1)
+    return 1;
+  // Anything but EAGAIN means the file system cannot tell
+  return errno != EAGAIN;
+}
+
+int
+http_io_cold(int fd, off_t offset, size_t len)
+{
+  // http_io_cold():
+  // Whether sending `len` bytes at `offset` of `fd` would wait for the
+  // disk. Returns 1 with a slot taken for the http_io_submit() that must
+  // follow, 0 if the data should be sent right away.
+
+  size_t taken;
+
+  if (job_fd == -1 || pool_thread || len == 0)
+    return 0;
+  if (http_io_resident(fd, offset) && (len <= HTTP_IO_SAMPLE || http_io_resident(fd, offset + len - 1)))
+    return 0;
+
+  taken = atomic_load(&slots);
+  do {
+    if (taken == HTTP_IO_QUEUE_MAX)
+      return 0;
+  } while (!atomic_compare_exchange_weak(&slots, &taken, taken + 1));
+  return 1;
+}
+
+void
+http_io_submit(void *arg)
+{
+  http_io_push(&job_lock, jobs, &job_head, &job_count, job_fd, arg);
+}
+
+void *
+http_io_completed()
+{
+  // http_io_completed():
+  // Take back something the pool is done with, or NULL if another worker
+  // was faster.
+
+  uint64_t value;
+  void *arg;
+
+  if (read(http_io_completion_fd, &value, sizeof(value)) != sizeof(value))
+    return NULL;
+  if ((arg = http_io_pop(&completion_lock, completions, &completion_head, &completion_count)) != NULL)
+    atomic_fetch_sub(&slots, 1);
+  return arg;
+}
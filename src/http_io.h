@@ -0,0 +1,28 @@
+// SPDX-License-Identifier: MIT
+
+#ifndef _HTTP_IO
+#define _HTTP_IO
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#define HTTP_IO_THREADS_DEFAULT 4
+#define HTTP_IO_QUEUE_MAX 1024 // connections in the pool or handed back
+
+// Returned instead of sending a response that would wait for the disk,
+// the connection is to be continued with http_io_submit()
+#define HTTP_IO_COLD 1
+
+// Runs on a pool thread. Returns 1 to hand `arg` back to the workers
+// through http_io_completed(), 0 if it is done with it.
+typedef int (*http_io_job_t)(void *arg);
+
+extern long http_io_threads; // 0 disables the pool
+extern int http_io_completion_fd; // readable while work is handed back
+
+int http_io_init(http_io_job_t job);
+int http_io_cold(int fd, off_t offset, size_t len);
+void http_io_submit(void *arg);
+void *http_io_completed();
+
+#endif
@@ -0,0 +1,196 @@
+// SPDX-License-Identifier: MIT
+
+#include <config.h>
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/random.h>
+#include <time.h>
+
+#include "http_limit.h"
+
+// Per client rate and connection limits
+//
+// Clients are IPv4 addresses and IPv6 /64 prefixes, a single host
+// usually owns a whole /64. Their state lives in a fixed-size open
+// addressing table shared by all workers and updated with atomics only.
+//
+// The token bucket of a client is kept as a single timestamp, the
+// theoretical arrival time of its next request (GCRA): a request is
+// allowed unless that time lies more than `burst - 1` intervals ahead,
+// and moves it one interval further. A bucket that has refilled
+// completely has its timestamp in the past, and looks exactly like a
+// fresh one.
+//
+// That is what makes eviction cheap: a client with a full bucket and no
+// open connections carries no state worth keeping, so its slot may be
+// taken over by another client probing for one. Clients that find no
+// slot are not limited rather than turned away.
+
+#define HTTP_LIMIT_PROBES 8
+#define NSEC 1000000000ull
+
+long http_limit_rate = 0;
+long http_limit_burst = 0;
+long http_limit_connections = 0;
+size_t http_limit_clients = HTTP_LIMIT_CLIENTS_DEFAULT;
+
+static http_limit_entry_t *table;
+static size_t table_mask;
+static uint64_t seed;
+static uint64_t interval; // ns between requests at the sustained rate
+static uint64_t tolerance; // how far ahead the arrival time may run
+
+static uint64_t
+http_limit_now()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * NSEC + now.tv_nsec;
+}
+
+static uint64_t
+http_limit_key(const struct sockaddr *address)
+{
+  // Seeded, so nobody picks addresses that collide on purpose
+  uint64_t key;
+
+  if (address->sa_family == AF_INET)
+    key = ((const struct sockaddr_in *)address)->sin_addr.s_addr;
+  else if (address->sa_family == AF_INET6)
+    memcpy(&key, &((const struct sockaddr_in6 *)address)->sin6_addr, sizeof(key));
+  else
+    return 0;
+
+  // MurmurHash3 finalizer
+  key ^= seed + address->sa_family;
+  key ^= key >> 33;
+  key *= 0xff51afd7ed558ccdull;
+  key ^= key >> 33;
+  key *= 0xc4ceb9fe1a85ec53ull;
+  key ^= key >> 33;
+  return key != 0 ? key : 1;
+}
+
+int
+http_limit_init()
+{
+  // http_limit_init():
+  // Allocate the client table if any limit is set. Returns 0 or -1.
+
+  size_t size = 1;
+
+  if (http_limit_rate == 0 && http_limit_connections == 0)
+    return 0;
+
+  while (size < http_limit_clients)
+    size <<= 1;
+  if ((table = calloc(size, sizeof(*table))) == NULL)
+    return -1;
+  table_mask = size - 1;
+
+  if (getrandom(&seed, sizeof(seed), 0) != sizeof(seed))
+    seed = http_limit_now();
+
+  if (http_limit_rate > 0) {
+    interval = NSEC / http_limit_rate;
+    tolerance = interval * ((http_limit_burst > 0 ? http_limit_burst : http_limit_rate) - 1);
+  }
+  return 0;
+}
+
+static http_limit_entry_t *
+http_limit_find(uint64_t key)
+{
+  // The client's entry, a free one claimed for it, or a stale one taken
+  // over. NULL if the neighbourhood is full of active clients.
+
+  http_limit_entry_t *entry, *stale = NULL;
+  uint64_t now = http_limit_now();
+  uint64_t current;
+
+  for (size_t probe = 0; probe < HTTP_LIMIT_PROBES; probe++) {
+    entry = &table[(key + probe) & table_mask];
+    current = atomic_load(&entry->key);
+    if (current == key)
+      return entry;
+    if (current == 0) {
+      if (atomic_compare_exchange_strong(&entry->key, &current, key) || current == key)
+        return entry;
+      continue;
+    }
+    if (stale == NULL && atomic_load(&entry->tat) <= now && atomic_load(&entry->connections) == 0)
+      stale = entry;
+  }
+
+  if (stale != NULL) {
+    current = atomic_load(&stale->key);
+    if (atomic_load(&stale->connections) == 0 && atomic_compare_exchange_strong(&stale->key, &current, key))
+      return stale;
+  }
+  return NULL;
+}
+
+int
+http_limit_acquire(http_limit_entry_t **out, const struct sockaddr *address)
+{
+  // http_limit_acquire():
+  // Account for a new connection from `address`, right after accept().
+  // Returns -1 if the client is at its connection limit. Otherwise `out`
+  // is set to the client's entry, or NULL if it is not limited, which
+  // must be passed to http_limit_release() when the connection closes.
+
+  http_limit_entry_t *entry;
+  uint64_t key;
+
+  *out = NULL;
+  if (table == NULL || (key = http_limit_key(address)) == 0 || (entry = http_limit_find(key)) == NULL)
+    return 0;
+
+  if (atomic_fetch_add(&entry->connections, 1) >= http_limit_connections && http_limit_connections > 0) {
+    atomic_fetch_sub(&entry->connections, 1);
+    return -1;
+  }
+
+  // Taken over by another client since it was found
+  if (atomic_load(&entry->key) != key) {
+    atomic_fetch_sub(&entry->connections, 1);
+    return 0;
+  }
+
+  *out = entry;
+  return 0;
+}
+
+void
+http_limit_release(http_limit_entry_t *entry)
+{
+  if (entry != NULL)
+    atomic_fetch_sub(&entry->connections, 1);
+}
+
+int
+http_limit_request(http_limit_entry_t *entry, time_t *retry_after)
+{
+  // http_limit_request():
+  // Take a token for a request of the client owning `entry`. Returns 0,
+  // or -1 with `retry_after` set to the seconds until the next token if
+  // the bucket is empty.
+
+  uint64_t now, tat, base;
+
+  if (entry == NULL || interval == 0)
+    return 0;
+
+  now = http_limit_now();
+  tat = atomic_load(&entry->tat);
+  do {
+    base = tat > now ? tat : now;
+    if (base - now > tolerance) {
+      *retry_after = (base - now - tolerance + NSEC - 1) / NSEC;
+      return -1;
+    }
+  } while (!atomic_compare_exchange_weak(&entry->tat, &tat, base + interval));
+
+  return 0;
+}
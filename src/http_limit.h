@@ -0,0 +1,29 @@
+// SPDX-License-Identifier: MIT
+
+#ifndef _HTTP_LIMIT
+#define _HTTP_LIMIT
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#define HTTP_LIMIT_CLIENTS_DEFAULT 65536
+
+typedef struct {
+  _Atomic uint64_t            key; // client address hash, 0 if free
+  _Atomic uint64_t            tat; // theoretical arrival time, CLOCK_MONOTONIC ns
+  atomic_int                  connections; // open, counted even without a limit
+} http_limit_entry_t;
+
+extern long http_limit_rate; // requests per second, 0 disables
+extern long http_limit_burst; // 0: same as the rate
+extern long http_limit_connections; // per client, 0 disables
+extern size_t http_limit_clients;
+
+int http_limit_init();
+int http_limit_acquire(http_limit_entry_t **out, const struct sockaddr *address);
+void http_limit_release(http_limit_entry_t *entry);
+int http_limit_request(http_limit_entry_t *entry, time_t *retry_after);
+
+#endif
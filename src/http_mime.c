@@ -0,0 +1,82 @@
+// SPDX-License-Identifier: MIT
+
+#include <config.h>
+#include <stddef.h>
+#include <string.h>
+#include <strings.h>
+
+#include "http_mime.h"
+
+// Extension to Content-Type, laid out by http_mime_hash(), which maps
+// every extension below to a slot of its own. A lookup is one hash and
+// one comparison. Adding an extension means finding it a free slot, or
+// new multipliers if it has none.
+#define HTTP_MIME_SLOTS 32
+
+static const struct {
+  const char *extension;
+  const char *type;
+} mime_types[HTTP_MIME_SLOTS] = {
+  [0] = { "html", "text/html; charset=utf-8" },
+  [1] = { "pdf", "application/pdf" },
+  [4] = { "webm", "video/webm" },
+  [5] = { "xml", "application/xml" },
+  [7] = { "webp", "image/webp" },
+  [9] = { "jpeg", "image/jpeg" },
+  [12] = { "wasm", "application/wasm" },
+  [13] = { "mp3", "audio/mpeg" },
+  [14] = { "mp4", "video/mp4" },
+  [16] = { "htm", "text/html; charset=utf-8" },
+  [17] = { "css", "text/css; charset=utf-8" },
+  [18] = { "json", "application/json" },
+  [19] = { "txt", "text/plain; charset=utf-8" },
+  [20] = { "gif", "image/gif" },
+  [21] = { "js", "text/javascript; charset=utf-8" },
+  [22] = { "woff2", "font/woff2" },
+  [23] = { "svg", "image/svg+xml" },
+  [24] = { "jpg", "image/jpeg" },
+  [25] = { "woff", "font/woff" },
+  [30] = { "png", "image/png" },
+  [31] = { "ico", "image/x-icon" },
+};
+
+static unsigned
+http_mime_hash(const char *extension, size_t len)
+{
+  // Case-insensitive for letters, digits are left alone by the 0x20 bit
+  return (len * 17 + (extension[0] | 0x20) * 3 + (extension[1] | 0x20) * 22 + (extension[len - 1] | 0x20))
+    % HTTP_MIME_SLOTS;
+}
+
+const char *
+http_mime_type(const char *path)
+{
+  const char *extension = strrchr(path, '.');
+  size_t len;
+  unsigned slot;
+
+  if (extension == NULL || strchr(extension, '/') != NULL)
+    return HTTP_MIME_DEFAULT;
+  extension++;
+
+  if ((len = strlen(extension)) == 0)
+    return HTTP_MIME_DEFAULT;
+
+  slot = http_mime_hash(extension, len);
+  if (mime_types[slot].extension != NULL && strcasecmp(extension, mime_types[slot].extension) == 0)
+    return mime_types[slot].type;
+
+  return HTTP_MIME_DEFAULT;
+}
+
+int
+http_mime_compressible(const char *type)
+{
+  // Text based types gain from Content-Encoding, media and fonts
+  // are compressed already
+  return strncmp(type, "text/", 5) == 0
+    || strncmp(type, "application/json", 16) == 0
+    || strncmp(type, "application/xml", 15) == 0
+    || strncmp(type, "application/wasm", 16) == 0
+    || strncmp(type, "image/svg+xml", 13) == 0;
+}
@@ -0,0 +1,11 @@
+// SPDX-License-Identifier: MIT
+
+#ifndef _HTTP_MIME
+#define _HTTP_MIME
+
+#define HTTP_MIME_DEFAULT "application/octet-stream"
+
+const char *http_mime_type(const char *path);
+int http_mime_compressible(const char *type);
+
+#endif
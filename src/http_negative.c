@@ -0,0 +1,519 @@
+// SPDX-License-Identifier: MIT
+
+#include <config.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "http_negative.h"
+#include "http_static.h"
+#include "http_trace.h"
+#include "http_utils.h"
+#include "log_levels.h"
+#include "logger.h"
+#include "wsfs_core.h"
+
+// Negative lookup cache
+//
+// Requests for paths that do not exist below --target are answered
+// with a prebuilt 404 without touching the file system.
+//
+// A thread walks the tree once and puts every path into a blocked Bloom
+// filter: all bits of a path are in one cache line, so a lookup reads
+// one line and takes no lock. The walk watches every directory with
+// inotify first and lists it second, paths created afterwards are added
+// as they appear. Removed paths stay in the filter, like its false
+// positives they cost one lookup on disk.
+//
+// Paths below a symlink or an unreadable directory cannot be listed.
+// Such directories are put into the filter a second time under a
+// different seed as opaque, and a path with an opaque ancestor is never
+// declared absent.
+//
+// Misses the filter lets through are remembered for `http_negative_ttl`
+// seconds in a small direct-mapped table, keyed by the hash of the path.
+// A path created meanwhile is dropped from the table by its inotify
+// event.
+//
+// The filter is rebuilt from a new walk when inotify lost events or it
+// holds more paths than it was sized for. Until then no path is
+// declared absent. Lookups run in epoch read sections (wsfs_core.h), a
+// replaced filter is freed once every lookup that may have seen it has
+// ended.
+
+#define HTTP_NEGATIVE_SEED_PATH 0
+#define HTTP_NEGATIVE_SEED_OPAQUE 0x9e3779b97f4a7c15ull
+#define HTTP_NEGATIVE_BITS 10 // per path at capacity, about 1% false positives
+#define HTTP_NEGATIVE_PROBES 7 // bits per path, 9 bits of hash each
+
+typedef struct {
+  _Atomic uint64_t            *blocks; // 8 words, 512 bits per block
+  uint64_t                    block_mask;
+  size_t                      capacity; // paths at HTTP_NEGATIVE_BITS bits each
+} http_negative_filter_t;
+
+typedef struct {
+  uint64_t                    hash;
+  time_t                      expires; // CLOCK_MONOTONIC_COARSE seconds
+} http_negative_slot_t;
+
+// Hashes found by a walk
+typedef struct {
+  uint64_t                    *hashes;
+  size_t                      count;
+  size_t                      size;
+} http_negative_walk_t;
+
+int http_negative_enabled = 0;
+time_t http_negative_ttl = HTTP_NEGATIVE_TTL_DEFAULT;
+
+// NULL while paths cannot be declared absent
+static _Atomic(http_negative_filter_t *) filter;
+static wsfs_epoch_t epoch = WSFS_EPOCH_INIT;
+static __thread wsfs_epoch_reader_t *reader;
+
+// Owned by the watching thread
+static http_negative_filter_t *current;
+static size_t inserted;
+static int inotify_fd = -1;
+static char **watched; // relative directory path by watch descriptor
+static size_t watched_size;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static http_negative_slot_t slots[HTTP_NEGATIVE_SLOTS];
+
+static const char not_found_line[] = HTTP11_STR " 404 " ERROR_NOT_FOUND_STRING "\r\n";
+static const char not_found_body[] = "404 " ERROR_NOT_FOUND_STRING "\n";
+static char not_found_fields[256];
+static int not_found_fields_len;
+
+static uint64_t
+http_negative_mix(uint64_t h)
+{
+  // splitmix64 finalizer
+  h ^= h >> 30;
+  h *= 0xbf58476d1ce4e5b9ull;
+  h ^= h >> 27;
+  h *= 0x94d049bb133111ebull;
+  return h ^ (h >> 31);
+}
+
+static uint64_t
+http_negative_hash(const char *path, size_t len, uint64_t seed)
+{
+  // FNV-1a, mixed. Trailing slashes do not count, "dir/" and "dir" lead
+  // to the same file.
+  while (len > 0 && path[len - 1] == '/')
+    len--;
+  return http_negative_mix(wsfs_fnv1a64(path, len, seed));
+}
+
+static void
+http_negative_filter_add(http_negative_filter_t *f, uint64_t hash)
+{
+  _Atomic uint64_t *block = &f->blocks[(hash & f->block_mask) * 8];
+  uint64_t probes = http_negative_mix(hash);
+
+  for (int i = 0; i < HTTP_NEGATIVE_PROBES; i++, probes >>= 9)
+    atomic_fetch_or_explicit(&block[probes >> 6 & 7], 1ull << (probes & 63), memory_order_relaxed);
+}
+
+static int
+http_negative_filter_has(const http_negative_filter_t *f, uint64_t hash)
+{
+  _Atomic uint64_t *block = &f->blocks[(hash & f->block_mask) * 8];
+  uint64_t probes = http_negative_mix(hash);
+
+  for (int i = 0; i < HTTP_NEGATIVE_PROBES; i++, probes >>= 9)
+    if (!(atomic_load_explicit(&block[probes >> 6 & 7], memory_order_relaxed) & 1ull << (probes & 63)))
+      return 0;
+  return 1;
+}
+
+static http_negative_filter_t *
+http_negative_filter_new(size_t paths)
+{
+  // A filter for `paths` paths with room to grow
+  http_negative_filter_t *f;
+  size_t blocks = 1;
+
+  if (paths < HTTP_NEGATIVE_ENTRIES_MIN)
+    paths = HTTP_NEGATIVE_ENTRIES_MIN;
+  while (blocks * 512 < paths * HTTP_NEGATIVE_HEADROOM * HTTP_NEGATIVE_BITS)
+    blocks <<= 1;
+
+  if ((f = malloc(sizeof(*f))) == NULL)
+    return NULL;
+  if ((f->blocks = calloc(blocks * 8, sizeof(*f->blocks))) == NULL) {
+    free(f);
+    return NULL;
+  }
+  f->block_mask = blocks - 1;
+  f->capacity = blocks * 512 / HTTP_NEGATIVE_BITS;
+  return f;
+}
+
+static void
+http_negative_filter_free(http_negative_filter_t *f)
+{
+  if (f == NULL)
+    return;
+  free(f->blocks);
+  free(f);
+}
+
+static time_t
+http_negative_now()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+  return now.tv_sec;
+}
+
+static void
+http_negative_forget(const char *path, size_t len)
+{
+  // `path` exists now, and so may the index file of its directory
+  uint64_t hash = http_negative_hash(path, len, HTTP_NEGATIVE_SEED_PATH);
+  const char *slash = memrchr(path, '/', len);
+  uint64_t parent = http_negative_hash(path, slash != NULL ? (size_t)(slash - path) : 0, HTTP_NEGATIVE_SEED_PATH);
+
+  pthread_mutex_lock(&lock);
+  if (slots[hash & (HTTP_NEGATIVE_SLOTS - 1)].hash == hash)
+    slots[hash & (HTTP_NEGATIVE_SLOTS - 1)].expires = 0;
+  if (slots[parent & (HTTP_NEGATIVE_SLOTS - 1)].hash == parent)
+    slots[parent & (HTTP_NEGATIVE_SLOTS - 1)].expires = 0;
+  pthread_mutex_unlock(&lock);
+}
+
+static int
+http_negative_collect(http_negative_walk_t *walk, const char *path, size_t len, uint64_t seed)
+{
+  uint64_t *hashes;
+
+  if (walk->count == walk->size) {
+    if ((hashes = realloc(walk->hashes, (walk->size * 2 + 1024) * sizeof(*hashes))) == NULL)
+      return -1;
+    walk->hashes = hashes;
+    walk->size = walk->size * 2 + 1024;
+  }
+  walk->hashes[walk->count++] = http_negative_hash(path, len, seed);
+  return 0;
+}
+
+static int
+http_negative_walk(http_negative_walk_t *walk, char *path, size_t len)
+{
+  // Watch directory `path` (relative to --target, `len` long, in a
+  // PATH_MAX buffer) and collect everything below it. A directory that
+  // cannot be listed is collected as opaque. Returns -1 if a watch or
+  // memory is missing, the filter cannot be trusted then.
+
+  char fd_path[32];
+  struct dirent *dirent;
+  struct stat st;
+  size_t name_len;
+  DIR *dir;
+  int fd, wd, is_dir, is_link, result = 0;
+  char **grown;
+
+  fd = openat(http_static_target.fd, len == 0 ? "." : path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+  if (fd == -1 && len == 0)
+    return -1;
+  if (fd == -1)
+    return errno == ENOENT ? 0 : http_negative_collect(walk, path, len, HTTP_NEGATIVE_SEED_OPAQUE);
+
+  // The descriptor's magic link names the directory without resolving
+  // its path again
+  snprintf(fd_path, sizeof(fd_path), "/proc/self/fd/%d", fd);
+  if ((wd = inotify_add_watch(inotify_fd, fd_path, IN_CREATE | IN_MOVED_TO | IN_ONLYDIR)) == -1) {
+    close(fd);
+    return -1;
+  }
+
+  if ((size_t)wd >= watched_size) {
+    if ((grown = realloc(watched, (wd * 2 + 64) * sizeof(*watched))) == NULL) {
+      close(fd);
+      return -1;
+    }
+    memset(grown + watched_size, 0, (wd * 2 + 64 - watched_size) * sizeof(*watched));
+    watched = grown;
+    watched_size = wd * 2 + 64;
+  }
+  free(watched[wd]);
+  if ((watched[wd] = strndup(path, len)) == NULL || (dir = fdopendir(fd)) == NULL) {
+    close(fd);
+    return -1;
+  }
+
+  while (result == 0 && (dirent = readdir(dir)) != NULL) {
+    if (strcmp(dirent->d_name, ".") == 0 || strcmp(dirent->d_name, "..") == 0)
+      continue;
+
+    name_len = strlen(dirent->d_name);
+    if (len + name_len + 2 > PATH_MAX) {
+      result = http_negative_collect(walk, path, len, HTTP_NEGATIVE_SEED_OPAQUE);
+      break;
+    }
+    if (len > 0)
+      path[len] = '/';
+    memcpy(path + len + (len > 0), dirent->d_name, name_len + 1);
+    name_len += len + (len > 0);
+
+    is_dir = dirent->d_type == DT_DIR;
+    is_link = dirent->d_type == DT_LNK;
+    if (dirent->d_type == DT_UNKNOWN && fstatat(dirfd(dir), dirent->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+      is_dir = S_ISDIR(st.st_mode);
+      is_link = S_ISLNK(st.st_mode);
+    }
+
+    result = http_negative_collect(walk, path, name_len, HTTP_NEGATIVE_SEED_PATH);
+    if (result == 0 && is_link)
+      result = http_negative_collect(walk, path, name_len, HTTP_NEGATIVE_SEED_OPAQUE);
+    if (result == 0 && is_dir)
+      result = http_negative_walk(walk, path, name_len);
+  }
+
+  path[len] = '\0';
+  closedir(dir);
+  return result;
+}
+
+static int
+http_negative_build()
+{
+  // Walk the whole tree into a new filter and publish it. Returns 0 or
+  // -1.
+
+  char path[PATH_MAX] = "";
+  http_negative_walk_t walk = { 0 };
+  http_negative_filter_t *f;
+
+  atomic_store(&filter, NULL);
+
+  if (http_negative_walk(&walk, path, 0) != 0 || (f = http_negative_filter_new(walk.count)) == NULL) {
+    free(walk.hashes);
+    return -1;
+  }
+  for (size_t i = 0; i < walk.count; i++)
+    http_negative_filter_add(f, walk.hashes[i]);
+
+  // Unpublished since the walk started
+  wsfs_epoch_synchronize(&epoch);
+  http_negative_filter_free(current);
+  current = f;
+  inserted = walk.count;
+  free(walk.hashes);
+
+  atomic_store(&filter, f);
+  return 0;
+}
+
+static int
+http_negative_event(const struct inotify_event *event)
+{
+  // Add what `event` created. Returns 1 if the filter has to be
+  // rebuilt, -1 if it cannot be kept.
+
+  char path[PATH_MAX];
+  http_negative_walk_t walk = { 0 };
+  size_t dir_len, len;
+  struct stat st;
+  int result = 0;
+
+  if (event->mask & IN_Q_OVERFLOW)
+    return 1;
+  if ((size_t)event->wd >= watched_size || watched[event->wd] == NULL)
+    return 0;
+  if (event->mask & IN_IGNORED) {
+    free(watched[event->wd]);
+    watched[event->wd] = NULL;
+    return 0;
+  }
+  if (event->len == 0)
+    return 0;
+
+  dir_len = strlen(watched[event->wd]);
+  if (dir_len + strlen(event->name) + 2 > sizeof(path))
+    return 0;
+  len = snprintf(path, sizeof(path), "%s%s%s", watched[event->wd], dir_len > 0 ? "/" : "", event->name);
+
+  if (http_negative_collect(&walk, path, len, HTTP_NEGATIVE_SEED_PATH) != 0)
+    result = -1;
+  else if (event->mask & IN_ISDIR)
+    result = http_negative_walk(&walk, path, len);
+  else if (fstatat(http_static_target.fd, path, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISLNK(st.st_mode))
+    result = http_negative_collect(&walk, path, len, HTTP_NEGATIVE_SEED_OPAQUE);
+
+  for (size_t i = 0; i < walk.count; i++)
+    http_negative_filter_add(current, walk.hashes[i]);
+  inserted += walk.count;
+  free(walk.hashes);
+
+  http_negative_forget(path, len);
+
+  if (result != 0)
+    return -1;
+  return inserted > current->capacity;
+}
+
+static void *
+http_negative_watch(void *arg)
+{
+  char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  const struct inotify_event *event;
+  int rebuild = 1, result;
+  ssize_t len;
+  (void)arg;
+
+  while (1) {
+    if (rebuild) {
+      if (http_negative_build() != 0)
+        break;
+      rebuild = 0;
+    }
+
+    if ((len = read(inotify_fd, buffer, sizeof(buffer))) <= 0) {
+      if (len == -1 && errno == EINTR)
+        continue;
+      break;
+    }
+
+    for (char *p = buffer; p < buffer + len; p += sizeof(struct inotify_event) + event->len) {
+      event = (const struct inotify_event *)p;
+      if ((result = http_negative_event(event)) == -1)
+        goto fail;
+      rebuild |= result;
+    }
+  }
+
+fail:
+  atomic_store(&filter, NULL);
+  close(inotify_fd);
+  logger(LOGL_ERROR, NULL, "negative cache: the tree cannot be watched, looking up every path");
+  return NULL;
+}
+
+int
+http_negative_init()
+{
+  // http_negative_init():
+  // Start watching --target if `http_negative_enabled` is set. Returns 0
+  // or -1.
+
+  pthread_t thread;
+
+  not_found_fields_len = snprintf(not_found_fields, sizeof(not_found_fields),
+    "Server: " PACKAGE_STRING "\r\n"
+    "Content-Type: text/plain\r\n"
+    "Content-Length: %zu\r\n",
+    sizeof(not_found_body) - 1);
+
+  // A site pack is looked up in memory anyway
+  if (!http_negative_enabled || http_static_target.fd == -1)
+    return 0;
+
+  if ((inotify_fd = inotify_init1(IN_CLOEXEC)) == -1)
+    return -1;
+
+  if (pthread_create(&thread, NULL, http_negative_watch, NULL) != 0)
+    return -1;
+  pthread_detach(thread);
+  return 0;
+}
+
+int
+http_negative_absent(const char *path, size_t len)
+{
+  // http_negative_absent():
+  // Returns 1 if normalized `path` below --target is known not to exist.
+
+  http_negative_filter_t *f;
+  http_negative_slot_t *slot;
+  uint64_t hash;
+  int absent = 0;
+
+  if (!http_negative_enabled || len == 0)
+    return 0;
+
+  hash = http_negative_hash(path, len, HTTP_NEGATIVE_SEED_PATH);
+
+  if (wsfs_epoch_enter(&epoch, &reader) == 0) {
+    if ((f = atomic_load(&filter)) != NULL && !http_negative_filter_has(f, hash)) {
+      // Nothing below an opaque directory is known
+      absent = 1;
+      for (size_t i = 1; i < len && absent; i++)
+        if (path[i] == '/' && http_negative_filter_has(f, http_negative_hash(path, i, HTTP_NEGATIVE_SEED_OPAQUE)))
+          absent = 0;
+    }
+    wsfs_epoch_exit(reader);
+    if (absent)
+      return 1;
+  }
+
+  if (http_negative_ttl == 0)
+    return 0;
+
+  slot = &slots[hash & (HTTP_NEGATIVE_SLOTS - 1)];
+  pthread_mutex_lock(&lock);
+  absent = slot->hash == hash && slot->expires > http_negative_now();
+  pthread_mutex_unlock(&lock);
+  return absent;
+}
+
+void
+http_negative_put(const char *path, size_t len)
+{
+  // http_negative_put():
+  // Remember that normalized `path` below --target was not found.
+
+  uint64_t hash;
+  http_negative_slot_t *slot;
+
+  if (!http_negative_enabled || http_negative_ttl == 0 || len == 0)
+    return;
+
+  hash = http_negative_hash(path, len, HTTP_NEGATIVE_SEED_PATH);
+  slot = &slots[hash & (HTTP_NEGATIVE_SLOTS - 1)];
+
+  pthread_mutex_lock(&lock);
+  slot->hash = hash;
+  slot->expires = http_negative_now() + http_negative_ttl;
+  pthread_mutex_unlock(&lock);
+}
+
+int
+http_negative_send(int socketfd, const http_request_t *request)
+{
+  // http_negative_send():
+  // Send the same 404 as http_send_error(), from constant pieces.
+
+  wsfs_str_t date = http_date_header();
+  const char *connection = http_connection_header(request);
+  int head_only = request->method == HTTP_METHOD_HEAD;
+
+  if (not_found_fields_len <= 0 || (size_t)not_found_fields_len >= sizeof(not_found_fields))
+    return http_send_error(socketfd, ERROR_NOT_FOUND, NULL, request);
+
+  http_segment_t segments[] = {
+    { .fd = -1, .data = not_found_line, .len = sizeof(not_found_line) - 1 },
+    { .fd = -1, .data = date.string, .len = date.len },
+    { .fd = -1, .data = not_found_fields, .len = not_found_fields_len },
+    { .fd = -1, .data = connection, .len = strlen(connection) },
+    { .fd = -1, .data = "\r\n", .len = 2 },
+    { .fd = -1, .data = not_found_body, .len = sizeof(not_found_body) - 1 },
+  };
+
+  HTTP_TRACE(response, http_trace_connection, ERROR_NOT_FOUND, head_only ? 0 : segments[5].len);
+  return http_send_segments(socketfd, segments, head_only ? 5 : 6);
+}
@@ -0,0 +1,24 @@
+// SPDX-License-Identifier: MIT
+
+#ifndef _HTTP_NEGATIVE
+#define _HTTP_NEGATIVE
+
+#include <stddef.h>
+#include <time.h>
+
+#include "http_core.h"
+
+#define HTTP_NEGATIVE_TTL_DEFAULT 2 // seconds
+#define HTTP_NEGATIVE_SLOTS 4096 // remembered misses, a power of two
+#define HTTP_NEGATIVE_ENTRIES_MIN 16384 // paths the smallest filter is sized for
+#define HTTP_NEGATIVE_HEADROOM 4 // filters are sized for this many times the paths found
+
+extern int http_negative_enabled;
+extern time_t http_negative_ttl;
+
+int http_negative_init();
+int http_negative_absent(const char *path, size_t len);
+void http_negative_put(const char *path, size_t len);
+int http_negative_send(int socketfd, const http_request_t *request);
+
+#endif
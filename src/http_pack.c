@@ -0,0 +1,142 @@
+// SPDX-License-Identifier: MIT
+
+#include <config.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "http_core.h"
+#include "http_pack.h"
+#include "wsfs_core.h"
+
+uint32_t
+http_pack_hash(const char *key, size_t len, uint32_t seed)
+{
+  // FNV-1a over `key` with a final avalanche, so the low bits are usable
+  // as is
+  uint32_t hash = wsfs_fnv1a32(key, len, seed);
+
+  hash ^= hash >> 16;
+  hash *= 0x85ebca6bu;
+  hash ^= hash >> 13;
+  hash *= 0xc2b2ae35u;
+  hash ^= hash >> 16;
+  return hash;
+}
+
+static int
+http_pack_string(const http_pack_t *pack, uint64_t offset, size_t max)
+{
+  // A string must end inside the pack and fit into `max` bytes with its NUL
+  return offset < pack->size && memchr(pack->map + offset, '\0', pack->size - offset < max ? pack->size - offset : max) != NULL;
+}
+
+static int
+http_pack_check(const http_pack_t *pack)
+{
+  // http_pack_check():
+  // Validate every offset of the pack once, so serving can trust them.
+
+  const http_pack_header_t *header = pack->header;
+  const http_pack_entry_t *entry;
+  const http_pack_variant_t *variant;
+
+  if (pack->size < sizeof(*header) || memcmp(header->magic, HTTP_PACK_MAGIC, sizeof(header->magic)) != 0
+    || header->version != HTTP_PACK_VERSION || header->size != pack->size
+    || header->bucket_count == 0 || header->slot_count == 0
+    || header->seeds_offset > pack->size || header->slots_offset > pack->size
+    || (pack->size - header->seeds_offset) / sizeof(uint32_t) < header->bucket_count
+    || (pack->size - header->slots_offset) / sizeof(http_pack_entry_t) < header->slot_count
+    || header->seeds_offset % sizeof(uint32_t) != 0 || header->slots_offset % sizeof(uint64_t) != 0)
+    return -1;
+
+  for (uint32_t slot = 0; slot < header->slot_count; slot++) {
+    entry = &pack->slots[slot];
+    if (!(entry->flags & HTTP_PACK_ENTRY_USED))
+      continue;
+
+    if (entry->path_offset >= pack->size || pack->size - entry->path_offset <= entry->path_len
+      || pack->map[entry->path_offset + entry->path_len] != '\0'
+      || !http_pack_string(pack, entry->content_type_offset, HTTP_PATH_MAX)
+      || !http_pack_string(pack, entry->last_modified_offset, HTTP_DATE_MAX)
+      || entry->variants[HTTP_ENCODING_IDENTITY].headers_len == 0)
+      return -1;
+
+    for (int encoding = 0; encoding < HTTP_ENCODINGS; encoding++) {
+      variant = &entry->variants[encoding];
+      if (variant->headers_len == 0)
+        continue;
+      if (variant->body_offset > pack->size || pack->size - variant->body_offset < variant->body_len
+        || variant->headers_offset > pack->size || pack->size - variant->headers_offset < variant->headers_len
+        || variant->validators_len > variant->headers_len || variant->validators_len >= HTTP_VALIDATORS_MAX
+        || !http_pack_string(pack, variant->etag_offset, HTTP_ETAG_MAX))
+        return -1;
+    }
+  }
+
+  return 0;
+}
+
+int
+http_pack_open(http_pack_t *out, const char *path)
+{
+  // http_pack_open():
+  // Map the pack at `path` and check it. The descriptor stays open for
+  // sendfile(). A pack replaced with rename() while wsfs runs is not
+  // noticed, the old one keeps being served until restart.
+
+  struct stat st;
+  void *map;
+
+  if ((out->fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+    return -1;
+
+  if (fstat(out->fd, &st) == -1 || st.st_size < (off_t)sizeof(http_pack_header_t)) {
+    close(out->fd);
+    return -1;
+  }
+
+  if ((map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, out->fd, 0)) == MAP_FAILED) {
+    close(out->fd);
+    return -1;
+  }
+
+  out->map = map;
+  out->size = st.st_size;
+  out->header = map;
+  out->seeds = (const uint32_t *)(out->map + out->header->seeds_offset);
+  out->slots = (const http_pack_entry_t *)(out->map + out->header->slots_offset);
+
+  if (http_pack_check(out) != 0) {
+    munmap(map, st.st_size);
+    close(out->fd);
+    errno = EINVAL;
+    return -1;
+  }
+
+  // The index is touched by every request
+  madvise(map, out->header->slots_offset + (size_t)out->header->slot_count * sizeof(http_pack_entry_t), MADV_WILLNEED);
+
+  return 0;
+}
+
+const http_pack_entry_t *
+http_pack_lookup(const http_pack_t *pack, const char *path, size_t len)
+{
+  // http_pack_lookup():
+  // Find normalized `path` in the pack with two hash probes and one
+  // comparison. Returns NULL if the site has no such path.
+
+  uint32_t bucket = http_pack_hash(path, len, 0) % pack->header->bucket_count;
+  uint32_t slot = http_pack_hash(path, len, pack->seeds[bucket]) % pack->header->slot_count;
+  const http_pack_entry_t *entry = &pack->slots[slot];
+
+  if (!(entry->flags & HTTP_PACK_ENTRY_USED) || entry->path_len != len
+    || memcmp(pack->map + entry->path_offset, path, len) != 0)
+    return NULL;
+
+  return entry;
+}
@@ -0,0 +1,75 @@
+// SPDX-License-Identifier: MIT
+
+#ifndef _HTTP_PACK
+#define _HTTP_PACK
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "http_encoding.h"
+
+// Site pack
+//
+// A whole site compiled by wsfs-pack into one read-only file:
+//
+//   header | bucket seeds | slots | strings | bodies
+//
+// Paths are found with a two level perfect hash (hash and displace): a
+// path's bucket seed picks its slot, the path stored in the slot confirms
+// the hit. Every slot carries, per content coding, a prebuilt block of
+// response header fields and the position of a page aligned body.
+// Integers are in host byte order, strings are NUL terminated.
+
+#define HTTP_PACK_MAGIC "WSFSPACK"
+#define HTTP_PACK_VERSION 1
+#define HTTP_PACK_ALIGN 4096
+
+// http_pack_entry_t flags
+#define HTTP_PACK_ENTRY_USED 1
+#define HTTP_PACK_ENTRY_VARY 2
+
+typedef struct {
+  char                        magic[8];
+  uint32_t                    version;
+  uint32_t                    bucket_count;
+  uint32_t                    slot_count;
+  uint32_t                    entry_count;
+  uint64_t                    seeds_offset; // uint32_t[bucket_count]
+  uint64_t                    slots_offset; // http_pack_entry_t[slot_count]
+  uint64_t                    size; // of the whole pack
+} http_pack_header_t;
+
+typedef struct {
+  uint64_t                    body_offset;
+  uint64_t                    body_len;
+  uint64_t                    headers_offset;
+  uint32_t                    headers_len; // 0 if there is no such variant
+  uint32_t                    validators_len; // trailing part of the headers
+  uint64_t                    etag_offset;
+} http_pack_variant_t;
+
+typedef struct {
+  uint64_t                    path_offset;
+  uint32_t                    path_len;
+  uint32_t                    flags;
+  int64_t                     mtime_sec;
+  int64_t                     mtime_nsec;
+  uint64_t                    content_type_offset;
+  uint64_t                    last_modified_offset;
+  http_pack_variant_t         variants[HTTP_ENCODINGS];
+} http_pack_entry_t;
+
+typedef struct {
+  const char                 *map;
+  size_t                      size;
+  int                         fd;
+  const http_pack_header_t   *header;
+  const uint32_t             *seeds;
+  const http_pack_entry_t    *slots;
+} http_pack_t;
+
+uint32_t http_pack_hash(const char *key, size_t len, uint32_t seed);
+int http_pack_open(http_pack_t *out, const char *path);
+const http_pack_entry_t *http_pack_lookup(const http_pack_t *pack, const char *path, size_t len);
+
+#endif
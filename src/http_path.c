@@ -0,0 +1,108 @@
+// SPDX-License-Identifier: MIT
+
+#include <config.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#ifdef HAVE_LINUX_OPENAT2_H
+#include <linux/openat2.h>
+#endif
+
+#include "http_path.h"
+
+static int
+http_path_hex(char c)
+{
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
+
+int
+http_path_normalize(char *out, size_t size, const char *path)
+{
+  // http_path_normalize():
+  // Percent-decode `path` and resolve "." and ".." segments and repeated
+  // slashes in one pass. The result is written to `out` relative to the
+  // served root (no leading slash, empty for the root itself) and keeps a
+  // trailing slash if `path` had one.
+  //
+  // Returns the length of `out`, HTTP_PATH_MALFORMED for bad escapes,
+  // NUL bytes, encoded slashes or ".." above the root, and
+  // HTTP_PATH_TOO_LONG if `out` is too small.
+
+  size_t len = 0, segment;
+  int high, low;
+  char c;
+
+  while (*path != '\0') {
+    if (*path == '/') {
+      path++;
+      continue;
+    }
+
+    segment = len;
+    while (*path != '\0' && *path != '/') {
+      c = *path++;
+      if (c == '%') {
+        if ((high = http_path_hex(path[0])) == -1 || (low = http_path_hex(path[1])) == -1)
+          return HTTP_PATH_MALFORMED;
+        c = high << 4 | low;
+        if (c == '\0' || c == '/')
+          return HTTP_PATH_MALFORMED;
+        path += 2;
+      }
+      if (len + 2 >= size)
+        return HTTP_PATH_TOO_LONG;
+      out[len++] = c;
+    }
+
+    if (len - segment == 1 && out[segment] == '.')
+      len = segment;
+    else if (len - segment == 2 && out[segment] == '.' && out[segment + 1] == '.') {
+      if (segment == 0)
+        return HTTP_PATH_MALFORMED;
+      // Drop the previous segment together with its slash
+      len = segment - 1;
+      while (len > 0 && out[len - 1] != '/')
+        len--;
+    } else if (*path == '/')
+      out[len++] = '/';
+  }
+
+  out[len] = '\0';
+  return len;
+}
+
+int
+http_path_open(int dirfd, const char *path)
+{
+  // http_path_open():
+  // Open normalized `path` read-only relative to `dirfd` in one syscall,
+  // refusing to resolve anything outside of `dirfd`, including through
+  // symlinks and procfs magic links. The descriptor is non-blocking, a
+  // FIFO would otherwise block open() until a writer appears.
+  //
+  // Returns a descriptor, -1 with errno set on failure, or -1 with errno
+  // set to ENOSYS if the kernel has no openat2(). Escape attempts fail
+  // with EXDEV or ELOOP.
+
+#if defined(HAVE_LINUX_OPENAT2_H) && defined(SYS_openat2)
+  struct open_how how = {
+    .flags = O_RDONLY | O_NONBLOCK | O_CLOEXEC,
+    .resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS,
+  };
+
+  return syscall(SYS_openat2, dirfd, path[0] == '\0' ? "." : path, &how, sizeof(how));
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
@@ -0,0 +1,15 @@
+// SPDX-License-Identifier: MIT
+
+#ifndef _HTTP_PATH
+#define _HTTP_PATH
+
+#include <stddef.h>
+
+// http_path_normalize() errors
+#define HTTP_PATH_MALFORMED -1
+#define HTTP_PATH_TOO_LONG -2
+
+int http_path_normalize(char *out, size_t size, const char *path);
+int http_path_open(int dirfd, const char *path);
+
+#endif
@@ -0,0 +1,476 @@
+// SPDX-License-Identifier: MIT
+
+#include <config.h>
+#include <dlfcn.h>
+#include <elf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <link.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/auxv.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#include "http_profile.h"
+#include "log_levels.h"
+#include "logger.h"
+#include "wsfs_core.h"
+
+// Sampling profiler
+//
+// Every thread serving requests gets a timer on its own CPU time clock,
+// which sends it SIGPROF `http_profile_frequency` times per second of
+// CPU it uses. Idle threads are not sampled. The handler walks the frame
+// pointer chain from the interrupted context and appends the stack to a
+// ring buffer of the thread, nothing else.
+//
+// A writer thread drains the rings every second, counts identical
+// stacks and every HTTP_PROFILE_WRITE_INTERVAL seconds replaces
+// `http_profile_file` with the counts so far as folded stacks, one
+// "outer;...;inner count" line per stack, ready for flamegraph.pl.
+// Symbols come from the symbol table of the executable itself, so no
+// tools are needed on the host.
+//
+// http_profile_toggle(), which is async-signal-safe, pauses and resumes
+// sampling. Stacks are only complete with -fno-omit-frame-pointer, a
+// library built without it ends the stack at its frame.
+
+#define HTTP_PROFILE_STACKS_MIN 1024
+
+typedef struct {
+  size_t                      depth;
+  uintptr_t                   pcs[HTTP_PROFILE_DEPTH]; // innermost first
+} http_profile_sample_t;
+
+// A sampled thread. `head` is only written by its signal handler, `tail`
+// only by the writer.
+typedef struct http_profile_thread {
+  struct http_profile_thread  *next;
+  timer_t                     timer;
+  uintptr_t                   stack_low;
+  uintptr_t                   stack_high;
+  _Atomic size_t              head;
+  _Atomic size_t              tail;
+  atomic_size_t               dropped;
+  http_profile_sample_t       samples[HTTP_PROFILE_RING];
+} http_profile_thread_t;
+
+// A distinct stack and how often it was seen
+typedef struct {
+  uint64_t                    hash; // 0 if the slot is free
+  size_t                      depth;
+  uintptr_t                   *pcs;
+  uint64_t                    count;
+} http_profile_stack_t;
+
+typedef struct {
+  uintptr_t                   address;
+  size_t                      size;
+  const char                  *name;
+} http_profile_symbol_t;
+
+char http_profile_file[PATH_MAX];
+long http_profile_frequency = HTTP_PROFILE_FREQUENCY_DEFAULT;
+
+static __thread http_profile_thread_t *self;
+static atomic_int wanted = 1; // sampling on, as asked for
+static int armed; // sampling on, as the timers are set
+
+// Registered threads, and the counted stacks
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static http_profile_thread_t *threads;
+static http_profile_stack_t *stacks;
+static size_t stack_count, stack_mask;
+static uint64_t dropped;
+
+static http_profile_symbol_t *symbols;
+static size_t symbol_count;
+
+static void
+http_profile_signal(int signum, siginfo_t *info, void *context)
+{
+  // SIGPROF: record the stack of the interrupted code. Async-signal-safe.
+  http_profile_thread_t *thread = self;
+  const ucontext_t *uc = context;
+  http_profile_sample_t *sample;
+  uintptr_t fp, next;
+  size_t head;
+  int saved_errno = errno;
+  (void)signum;
+  (void)info;
+
+  if (thread == NULL)
+    return;
+
+  head = atomic_load_explicit(&thread->head, memory_order_relaxed);
+  if (head - atomic_load_explicit(&thread->tail, memory_order_acquire) == HTTP_PROFILE_RING) {
+    atomic_fetch_add_explicit(&thread->dropped, 1, memory_order_relaxed);
+    return;
+  }
+  sample = &thread->samples[head % HTTP_PROFILE_RING];
+
+#if defined(__x86_64__)
+  sample->pcs[0] = uc->uc_mcontext.gregs[REG_RIP];
+  fp = uc->uc_mcontext.gregs[REG_RBP];
+#elif defined(__aarch64__)
+  sample->pcs[0] = uc->uc_mcontext.pc;
+  fp = uc->uc_mcontext.regs[29];
+#else
+  sample->pcs[0] = 0;
+  fp = 0;
+  (void)uc;
+#endif
+  sample->depth = 1;
+
+  // Each frame starts with the caller's frame pointer and return
+  // address. Frames only lead outwards, towards the top of the stack.
+  while (sample->depth < HTTP_PROFILE_DEPTH && fp % sizeof(uintptr_t) == 0
+    && fp >= thread->stack_low && fp + 2 * sizeof(uintptr_t) <= thread->stack_high) {
+    if ((sample->pcs[sample->depth] = ((uintptr_t *)fp)[1]) == 0)
+      break;
+    sample->depth++;
+    if ((next = ((uintptr_t *)fp)[0]) <= fp)
+      break;
+    fp = next;
+  }
+
+  atomic_store_explicit(&thread->head, head + 1, memory_order_release);
+  errno = saved_errno;
+}
+
+static void
+http_profile_arm(http_profile_thread_t *thread, int on)
+{
+  long interval = 1000000000L / http_profile_frequency;
+  struct itimerspec spec = {
+    .it_interval = { .tv_sec = interval / 1000000000L, .tv_nsec = interval % 1000000000L },
+    .it_value = { .tv_sec = interval / 1000000000L, .tv_nsec = interval % 1000000000L },
+  };
+
+  if (!on)
+    memset(&spec, 0, sizeof(spec));
+  timer_settime(thread->timer, 0, &spec, NULL);
+}
+
+void
+http_profile_thread()
+{
+  // http_profile_thread():
+  // Sample the calling thread from now on, if profiling is enabled.
+
+  http_profile_thread_t *thread;
+  struct sigevent event = { .sigev_notify = SIGEV_THREAD_ID, .sigev_signo = SIGPROF };
+  pthread_attr_t attr;
+  void *stack;
+  size_t size;
+
+  if (http_profile_file[0] == '\0' || self != NULL)
+    return;
+
+  if ((thread = calloc(1, sizeof(*thread))) == NULL)
+    return;
+
+  if (pthread_getattr_np(pthread_self(), &attr) == 0) {
+    if (pthread_attr_getstack(&attr, &stack, &size) == 0) {
+      thread->stack_low = (uintptr_t)stack;
+      thread->stack_high = (uintptr_t)stack + size;
+    }
+    pthread_attr_destroy(&attr);
+  }
+
+  event._sigev_un._tid = gettid();
+  if (timer_create(CLOCK_THREAD_CPUTIME_ID, &event, &thread->timer) != 0) {
+    free(thread);
+    return;
+  }
+  self = thread;
+
+  pthread_mutex_lock(&lock);
+  thread->next = threads;
+  threads = thread;
+  http_profile_arm(thread, armed);
+  pthread_mutex_unlock(&lock);
+}
+
+void
+http_profile_toggle()
+{
+  // http_profile_toggle():
+  // Pause sampling, or resume it. Async-signal-safe, takes effect within
+  // a second.
+  atomic_fetch_xor(&wanted, 1);
+}
+
+static uint64_t
+http_profile_hash(const uintptr_t *pcs, size_t depth)
+{
+  // Over the addresses, never 0
+  uint64_t hash = wsfs_fnv1a64(pcs, depth * sizeof(*pcs), 0);
+  return hash != 0 ? hash : 1;
+}
+
+static int
+http_profile_count(const http_profile_sample_t *sample)
+{
+  // Count `sample`, called with the lock held. Returns 0 or -1.
+  http_profile_stack_t *old = stacks, *stack;
+  size_t old_size = stack_mask + 1;
+  uint64_t hash = http_profile_hash(sample->pcs, sample->depth);
+
+  // At most half full
+  if (stacks == NULL || (stack_count + 1) * 2 > stack_mask + 1) {
+    size_t size = stacks == NULL ? HTTP_PROFILE_STACKS_MIN : old_size * 2;
+    if ((stacks = calloc(size, sizeof(*stacks))) == NULL) {
+      stacks = old;
+      return -1;
+    }
+    stack_mask = size - 1;
+    for (size_t i = 0; old != NULL && i < old_size; i++) {
+      if (old[i].hash == 0)
+        continue;
+      for (stack = &stacks[old[i].hash & stack_mask]; stack->hash != 0; stack = &stacks[(stack - stacks + 1) & stack_mask])
+        ;
+      *stack = old[i];
+    }
+    free(old);
+  }
+
+  for (stack = &stacks[hash & stack_mask]; stack->hash != 0; stack = &stacks[(stack - stacks + 1) & stack_mask]) {
+    if (stack->hash == hash && stack->depth == sample->depth
+      && memcmp(stack->pcs, sample->pcs, sample->depth * sizeof(uintptr_t)) == 0) {
+      stack->count++;
+      return 0;
+    }
+  }
+
+  if ((stack->pcs = malloc(sample->depth * sizeof(uintptr_t))) == NULL)
+    return -1;
+  memcpy(stack->pcs, sample->pcs, sample->depth * sizeof(uintptr_t));
+  stack->depth = sample->depth;
+  stack->hash = hash;
+  stack->count = 1;
+  stack_count++;
+  return 0;
+}
+
+static void
+http_profile_drain()
+{
+  // Move the samples of every thread into the counts, and follow
+  // http_profile_toggle()
+  int on = atomic_load(&wanted);
+  size_t head, tail;
+
+  pthread_mutex_lock(&lock);
+  for (http_profile_thread_t *thread = threads; thread != NULL; thread = thread->next) {
+    if (on != armed)
+      http_profile_arm(thread, on);
+
+    head = atomic_load_explicit(&thread->head, memory_order_acquire);
+    for (tail = atomic_load_explicit(&thread->tail, memory_order_relaxed); tail != head; tail++)
+      if (http_profile_count(&thread->samples[tail % HTTP_PROFILE_RING]) != 0)
+        dropped++;
+    atomic_store_explicit(&thread->tail, tail, memory_order_release);
+    dropped += atomic_exchange(&thread->dropped, 0);
+  }
+  armed = on;
+  pthread_mutex_unlock(&lock);
+}
+
+static int
+http_profile_symbol_compare(const void *a, const void *b)
+{
+  const http_profile_symbol_t *x = a, *y = b;
+  return x->address < y->address ? -1 : x->address > y->address;
+}
+
+static void
+http_profile_symbols()
+{
+  // Load the function symbols of the executable, relocated to where it
+  // is mapped. Nothing is loaded from a stripped executable.
+
+  const ElfW(Ehdr) *ehdr;
+  const ElfW(Phdr) *phdr;
+  const ElfW(Shdr) *shdr, *strtab;
+  const ElfW(Sym) *sym;
+  uintptr_t bias = 0;
+  struct stat st;
+  char *map;
+  int fd;
+
+  if ((fd = open("/proc/self/exe", O_RDONLY | O_CLOEXEC)) == -1)
+    return;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(*ehdr)
+    || (map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+    close(fd);
+    return;
+  }
+  close(fd);
+
+  ehdr = (const ElfW(Ehdr) *)map;
+  if (memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0 || ehdr->e_shoff + ehdr->e_shnum * sizeof(*shdr) > (size_t)st.st_size)
+    goto fail;
+
+  // Where the program headers are mapped tells where everything is
+  phdr = (const ElfW(Phdr) *)(map + ehdr->e_phoff);
+  bias = getauxval(AT_PHDR) - ehdr->e_phoff;
+  for (size_t i = 0; i < ehdr->e_phnum; i++)
+    if (phdr[i].p_type == PT_PHDR)
+      bias = getauxval(AT_PHDR) - phdr[i].p_vaddr;
+
+  shdr = (const ElfW(Shdr) *)(map + ehdr->e_shoff);
+  for (size_t i = 0; i < ehdr->e_shnum; i++) {
+    if (shdr[i].sh_type != SHT_SYMTAB || shdr[i].sh_link >= ehdr->e_shnum)
+      continue;
+    strtab = &shdr[shdr[i].sh_link];
+    sym = (const ElfW(Sym) *)(map + shdr[i].sh_offset);
+
+    if ((symbols = calloc(shdr[i].sh_size / sizeof(*sym), sizeof(*symbols))) == NULL)
+      goto fail;
+    for (size_t j = 0; j < shdr[i].sh_size / sizeof(*sym); j++) {
+      if (ELF64_ST_TYPE(sym[j].st_info) != STT_FUNC || sym[j].st_value == 0 || sym[j].st_name >= strtab->sh_size)
+        continue;
+      symbols[symbol_count++] = (http_profile_symbol_t) {
+        .address = sym[j].st_value + bias,
+        .size = sym[j].st_size,
+        .name = map + strtab->sh_offset + sym[j].st_name,
+      };
+    }
+    qsort(symbols, symbol_count, sizeof(*symbols), http_profile_symbol_compare);
+    return;
+  }
+
+fail:
+  munmap(map, st.st_size);
+}
+
+static void
+http_profile_name(char *out, size_t size, uintptr_t pc)
+{
+  // Name of the function containing `pc`, "module+0xoffset" if unknown
+  size_t low = 0, high = symbol_count;
+  const char *module;
+  Dl_info info = { 0 };
+  int found;
+
+  while (low < high) {
+    size_t middle = (low + high) / 2;
+    if (symbols[middle].address <= pc)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+  if (low > 0 && pc < symbols[low - 1].address + symbols[low - 1].size) {
+    snprintf(out, size, "%s", symbols[low - 1].name);
+    return;
+  }
+
+  // dladdr() leaves `info` alone when it finds nothing
+  found = dladdr((void *)pc, &info) != 0;
+  if (found && info.dli_sname != NULL) {
+    snprintf(out, size, "%s", info.dli_sname);
+  } else if (found && info.dli_fname != NULL) {
+    module = strrchr(info.dli_fname, '/');
+    snprintf(out, size, "%s+0x%lx", module != NULL ? module + 1 : info.dli_fname,
+      (unsigned long)(pc - (uintptr_t)info.dli_fbase));
+  } else
+    snprintf(out, size, "0x%lx", (unsigned long)pc);
+}
+
+int
+http_profile_write()
+{
+  // http_profile_write():
+  // Replace `http_profile_file` with the stacks counted so far. Returns 0
+  // or -1.
+
+  char temporary[PATH_MAX + 8];
+  char name[256];
+  FILE *file;
+  uintptr_t pc;
+  int result;
+
+  if (snprintf(temporary, sizeof(temporary), "%s.tmp", http_profile_file) >= (int)sizeof(temporary))
+    return -1;
+
+  http_profile_drain();
+
+  if ((file = fopen(temporary, "we")) == NULL)
+    return -1;
+
+  pthread_mutex_lock(&lock);
+  for (size_t i = 0; stacks != NULL && i <= stack_mask; i++) {
+    if (stacks[i].hash == 0)
+      continue;
+    // Outermost frame first. Return addresses point after the call,
+    // which may already be the next function.
+    for (size_t j = stacks[i].depth; j-- > 0;) {
+      pc = j == 0 ? stacks[i].pcs[j] : stacks[i].pcs[j] - 1;
+      http_profile_name(name, sizeof(name), pc);
+      fprintf(file, "%s%s", name, j > 0 ? ";" : "");
+    }
+    fprintf(file, " %llu\n", (unsigned long long)stacks[i].count);
+  }
+  if (dropped > 0)
+    fprintf(file, "[dropped] %llu\n", (unsigned long long)dropped);
+  pthread_mutex_unlock(&lock);
+
+  result = ferror(file) ? -1 : 0;
+  if (fclose(file) != 0 || result != 0 || rename(temporary, http_profile_file) != 0) {
+    unlink(temporary);
+    return -1;
+  }
+  return 0;
+}
+
+static void *
+http_profile_writer(void *arg)
+{
+  (void)arg;
+
+  for (unsigned long seconds = 1;; seconds++) {
+    sleep(1);
+    http_profile_drain();
+    if (seconds % HTTP_PROFILE_WRITE_INTERVAL == 0 && http_profile_write() != 0)
+      logger(LOGL_WARN, NULL, "profile: writing folded stacks failed");
+  }
+
+  return NULL;
+}
+
+int
+http_profile_init()
+{
+  // http_profile_init():
+  // Install the SIGPROF handler and start the writer, after fork() like
+  // every other thread. Threads opt in with http_profile_thread().
+  // Returns 0 or -1.
+
+  struct sigaction action = { .sa_sigaction = http_profile_signal, .sa_flags = SA_SIGINFO | SA_RESTART };
+  pthread_t thread;
+
+  if (http_profile_file[0] == '\0')
+    return 0;
+
+  http_profile_symbols();
+  armed = atomic_load(&wanted);
+
+  sigemptyset(&action.sa_mask);
+  if (sigaction(SIGPROF, &action, NULL) != 0)
+    return -1;
+
+  if (pthread_create(&thread, NULL, http_profile_writer, NULL) != 0)
+    return -1;
+  pthread_detach(thread);
+  return 0;
+}
@@ -0,0 +1,21 @@
+// SPDX-License-Identifier: MIT
+
+#ifndef _HTTP_PROFILE
+#define _HTTP_PROFILE
+
+#include <linux/limits.h>
+
+#define HTTP_PROFILE_FREQUENCY_DEFAULT 99 // Hz, off the beat of periodic work
+#define HTTP_PROFILE_DEPTH 64 // frames per sample
+#define HTTP_PROFILE_RING 256 // samples a thread buffers between drains
+#define HTTP_PROFILE_WRITE_INTERVAL 10 // seconds
+
+extern char http_profile_file[PATH_MAX];
+extern long http_profile_frequency;
+
+int http_profile_init();
+void http_profile_thread();
+void http_profile_toggle();
+int http_profile_write();
+
+#endif
@@ -0,0 +1,883 @@
+// SPDX-License-Identifier: MIT
+
+#include <config.h>
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "http_buffer.h"
+#include "http_core.h"
+#include "http_path.h"
+#include "http_proxy.h"
+#include "http_tls.h"
+#include "http_trace.h"
+#include "http_utils.h"
+#include "log_levels.h"
+#include "logger.h"
+
+// Reverse proxy
+//
+// Requests whose normalized path starts with the prefix of a route of
+// their virtual host (see http_vhost.c) are forwarded to one of the
+// route's upstream HTTP/1.1 servers, over TCP or a Unix socket. The upstream with the fewest requests in flight,
+// counted over all workers, is picked among the healthy ones. The
+// upstream is sent that normalized path, escaped again, so what it
+// serves is what the route matched.
+//
+// Every worker keeps idle upstream connections in its own pool, so a
+// request normally reuses a warm connection without any locking. A
+// pooled connection the upstream closed meanwhile is noticed before
+// reuse; a request failing on one before any response byte arrived is
+// retried once on a newly opened connection.
+//
+// Response bodies are moved from the upstream to the client socket with
+// splice() through a per-worker pipe when the client socket takes
+// plaintext, and through user space otherwise. Chunked bodies are
+// relayed as they are, only their chunk size lines pass through user
+// space.
+//
+// A health check thread probes every upstream with a HEAD request. A
+// failed request marks its upstream down right away, a successful
+// probe brings it back.
+
+long http_proxy_timeout = HTTP_PROXY_TIMEOUT_DEFAULT;
+long http_proxy_health_interval = HTTP_PROXY_HEALTH_INTERVAL_DEFAULT;
+char http_proxy_health_path[HTTP_PROXY_PREFIX_MAX] = HTTP_PROXY_HEALTH_PATH_DEFAULT;
+
+#define HTTP_PROXY_SPLICE_MAX (64 * 1024)
+
+// Every upstream ever configured. Only the thread loading the
+// configuration adds to it, `upstream_count` is published after the
+// new slot is filled.
+static http_proxy_upstream_t upstreams[HTTP_PROXY_POOLS];
+static atomic_size_t upstream_count;
+
+// Per worker state
+static __thread int pools[HTTP_PROXY_POOLS][HTTP_PROXY_IDLE_MAX];
+static __thread size_t pool_counts[HTTP_PROXY_POOLS];
+static __thread int relay_pipe[2] = { -1, -1 };
+
+// Upstream bytes read but not consumed yet
+typedef struct {
+  char                        *data; // HTTP_BUFFER_LARGE bytes, pooled
+  size_t                      start;
+  size_t                      end;
+} http_proxy_buffer_t;
+
+// Framing of an upstream response body
+#define HTTP_PROXY_BODY_NONE 0
+#define HTTP_PROXY_BODY_LENGTH 1
+#define HTTP_PROXY_BODY_CHUNKED 2
+#define HTTP_PROXY_BODY_CLOSE 3 // until the upstream closes
+
+static const wsfs_str_t hop_by_hop[] = {
+  WSFS_STR("Connection"), WSFS_STR("Keep-Alive"), WSFS_STR("Proxy-Connection"),
+  WSFS_STR("Proxy-Authenticate"), WSFS_STR("Proxy-Authorization"), WSFS_STR("TE"),
+  WSFS_STR("Trailer"), WSFS_STR("Transfer-Encoding"), WSFS_STR("Upgrade"),
+};
+
+static const wsfs_str_t content_length_header = WSFS_STR("Content-Length");
+static const wsfs_str_t transfer_encoding_header = WSFS_STR("Transfer-Encoding");
+static const wsfs_str_t connection_header = WSFS_STR("Connection");
+
+static int
+http_proxy_hop_by_hop(wsfs_str_t name)
+{
+  for (size_t i = 0; i < sizeof(hop_by_hop) / sizeof(hop_by_hop[0]); i++)
+    if (wsfs_str_case_eq(name, hop_by_hop[i]))
+      return 1;
+  return 0;
+}
+
+static int
+http_proxy_address(http_proxy_upstream_t *upstream, const char *spec, size_t len)
+{
+  // http_proxy_address():
+  // Resolve "HOST:PORT", "[IPV6]:PORT" or "unix:PATH" into `upstream`.
+
+  struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM, .ai_flags = AI_NUMERICSERV };
+  struct addrinfo *result;
+  struct sockaddr_un *un;
+  char host[HTTP_PROXY_NAME_MAX];
+  const char *port;
+
+  if (len == 0 || len >= sizeof(upstream->name))
+    return -1;
+  memcpy(upstream->name, spec, len);
+  upstream->name[len] = '\0';
+
+  if (strncmp(upstream->name, "unix:", 5) == 0) {
+    un = (struct sockaddr_un *)&upstream->address;
+    if (strlen(upstream->name + 5) >= sizeof(un->sun_path))
+      return -1;
+    un->sun_family = AF_UNIX;
+    strcpy(un->sun_path, upstream->name + 5);
+    upstream->address_len = sizeof(*un);
+    return 0;
+  }
+
+  if ((port = strrchr(upstream->name, ':')) == NULL || (size_t)(port - upstream->name) >= sizeof(host))
+    return -1;
+  memcpy(host, upstream->name, port - upstream->name);
+  host[port - upstream->name] = '\0';
+  port++;
+
+  // Brackets around IPv6 addresses
+  if (host[0] == '[' && host[strlen(host) - 1] == ']') {
+    memmove(host, host + 1, strlen(host) - 2);
+    host[strlen(host) - 2] = '\0';
+  }
+
+  if (getaddrinfo(host, port, &hints, &result) != 0)
+    return -1;
+  memcpy(&upstream->address, result->ai_addr, result->ai_addrlen);
+  upstream->address_len = result->ai_addrlen;
+  freeaddrinfo(result);
+  return 0;
+}
+
+static http_proxy_upstream_t *
+http_proxy_upstream(const char *spec, size_t len)
+{
+  // http_proxy_upstream():
+  // Find the upstream named by `len` bytes at `spec`, or add it.
+
+  http_proxy_upstream_t *upstream;
+  size_t count = atomic_load(&upstream_count);
+
+  for (size_t i = 0; i < count; i++)
+    if (strlen(upstreams[i].name) == len && strncmp(upstreams[i].name, spec, len) == 0)
+      return &upstreams[i];
+
+  if (count == HTTP_PROXY_POOLS)
+    return NULL;
+
+  upstream = &upstreams[count];
+  memset(upstream, 0, sizeof(*upstream));
+  if (http_proxy_address(upstream, spec, len) != 0)
+    return NULL;
+  upstream->index = count;
+  atomic_init(&upstream->outstanding, 0);
+  atomic_init(&upstream->healthy, 1);
+
+  atomic_store(&upstream_count, count + 1);
+  return upstream;
+}
+
+int
+http_proxy_route_parse(http_proxy_route_t *route, const char *spec)
+{
+  // http_proxy_route_parse():
+  // Fill `route` from "PREFIX=UPSTREAM[,UPSTREAM]...", as given to
+  // --proxy or in a virtual host. Returns 0, or -1 if `spec` is
+  // malformed or there are too many upstreams.
+
+  const char *targets = strchr(spec, '=');
+  const char *end;
+  char prefix[HTTP_PROXY_PREFIX_MAX];
+  int len;
+
+  if (targets == NULL || spec[0] != '/' || (size_t)(targets - spec) >= sizeof(prefix))
+    return -1;
+
+  memcpy(prefix, spec, targets - spec);
+  prefix[targets - spec] = '\0';
+  if ((len = http_path_normalize(route->prefix, sizeof(route->prefix), prefix)) < 0)
+    return -1;
+  route->prefix_len = len;
+  route->upstream_count = 0;
+  atomic_init(&route->next, 0);
+
+  for (targets++; *targets != '\0'; targets = *end == ',' ? end + 1 : end) {
+    if (route->upstream_count == HTTP_PROXY_UPSTREAMS_MAX)
+      return -1;
+    end = targets + strcspn(targets, ",");
+    if ((route->upstreams[route->upstream_count] = http_proxy_upstream(targets, end - targets)) == NULL)
+      return -1;
+    route->upstream_count++;
+  }
+
+  return route->upstream_count == 0 ? -1 : 0;
+}
+
+static int
+http_proxy_open(http_proxy_upstream_t *upstream)
+{
+  // http_proxy_open():
+  // Connect to `upstream` within `http_proxy_timeout` seconds. Returns
+  // the blocking socket, or -1 with errno set (ETIMEDOUT on timeout).
+
+  struct timeval timeout = { .tv_sec = http_proxy_timeout };
+  struct pollfd pollfd;
+  socklen_t error_len = sizeof(int);
+  int fd, error = 0, opt = 1;
+
+  if ((fd = socket(upstream->address.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1)
+    return -1;
+
+  if (connect(fd, (struct sockaddr *)&upstream->address, upstream->address_len) == -1) {
+    if (errno != EINPROGRESS && errno != EAGAIN) {
+      error = errno;
+      goto fail;
+    }
+
+    pollfd = (struct pollfd) { .fd = fd, .events = POLLOUT };
+    if (poll(&pollfd, 1, http_proxy_timeout * 1000) != 1) {
+      error = ETIMEDOUT;
+      goto fail;
+    }
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &error_len) == -1 || error != 0)
+      goto fail;
+  }
+
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+  if (upstream->address.ss_family != AF_UNIX)
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+  return fd;
+
+fail:
+  close(fd);
+  errno = error != 0 ? error : ECONNREFUSED;
+  return -1;
+}
+
+static int
+http_proxy_acquire(http_proxy_upstream_t *upstream, int *reused)
+{
+  // Take an idle connection from this worker's pool, or open a new one.
+  // An idle connection must not be readable: that would be the upstream
+  // closing it or sending something nobody asked for.
+
+  struct pollfd pollfd = { .events = POLLIN };
+  size_t *count = &pool_counts[upstream->index];
+
+  while (*count > 0) {
+    pollfd.fd = pools[upstream->index][--*count];
+    if (poll(&pollfd, 1, 0) == 0) {
+      *reused = 1;
+      return pollfd.fd;
+    }
+    close(pollfd.fd);
+  }
+
+  *reused = 0;
+  return http_proxy_open(upstream);
+}
+
+static void
+http_proxy_recycle(http_proxy_upstream_t *upstream, int fd)
+{
+  size_t *count = &pool_counts[upstream->index];
+
+  if (*count == HTTP_PROXY_IDLE_MAX) {
+    close(fd);
+    return;
+  }
+  pools[upstream->index][(*count)++] = fd;
+}
+
+static http_proxy_upstream_t *
+http_proxy_pick(http_proxy_route_t *route, const http_proxy_upstream_t *exclude)
+{
+  // Least outstanding requests among the healthy upstreams, starting at a
+  // rotating position so ties are spread. If every upstream is down, all
+  // of them are candidates rather than failing outright.
+
+  http_proxy_upstream_t *best = NULL, *upstream;
+  unsigned start = atomic_fetch_add(&route->next, 1);
+  int any_healthy = 0;
+
+  for (size_t i = 0; i < route->upstream_count; i++)
+    if (route->upstreams[i] != exclude && atomic_load(&route->upstreams[i]->healthy))
+      any_healthy = 1;
+
+  for (size_t i = 0; i < route->upstream_count; i++) {
+    upstream = route->upstreams[(start + i) % route->upstream_count];
+    if (upstream == exclude && route->upstream_count > 1)
+      continue;
+    if (any_healthy && !atomic_load(&upstream->healthy))
+      continue;
+    if (best == NULL || atomic_load(&upstream->outstanding) < atomic_load(&best->outstanding))
+      best = upstream;
+  }
+
+  return best;
+}
+
+static void
+http_proxy_health_set(http_proxy_upstream_t *upstream, int healthy)
+{
+  char message[HTTP_PROXY_NAME_MAX + 32];
+
+  if (atomic_exchange(&upstream->healthy, healthy) == healthy)
+    return;
+  snprintf(message, sizeof(message), "proxy: upstream %.*s is %s", (int)sizeof(upstream->name), upstream->name, healthy ? "up" : "down");
+  logger(healthy ? LOGL_NOTICE : LOGL_WARN, NULL, message);
+}
+
+static int
+http_proxy_write(int socketfd, const char *data, size_t len)
+{
+  http_segment_t segment = { .fd = -1, .data = data, .len = len };
+  return http_send_segments(socketfd, &segment, 1);
+}
+
+static ssize_t
+http_proxy_fill(int fd, http_proxy_buffer_t *buffer)
+{
+  // Read more upstream bytes behind the unconsumed ones
+  ssize_t bytes_read;
+
+  if (buffer->start > 0) {
+    memmove(buffer->data, buffer->data + buffer->start, buffer->end - buffer->start);
+    buffer->end -= buffer->start;
+    buffer->start = 0;
+  }
+  if (buffer->end == HTTP_BUFFER_LARGE)
+    return -1;
+
+  do
+    bytes_read = read(fd, buffer->data + buffer->end, HTTP_BUFFER_LARGE - buffer->end);
+  while (bytes_read == -1 && errno == EINTR);
+
+  if (bytes_read > 0)
+    buffer->end += bytes_read;
+  return bytes_read;
+}
+
+static const char *
+http_proxy_line(int fd, http_proxy_buffer_t *buffer, size_t *len)
+{
+  // Next CRLF terminated line, `len` includes the CRLF
+  char *end;
+
+  while ((end = memmem(buffer->data + buffer->start, buffer->end - buffer->start, "\r\n", 2)) == NULL)
+    if (http_proxy_fill(fd, buffer) <= 0)
+      return NULL;
+
+  *len = end + 2 - (buffer->data + buffer->start);
+  return buffer->data + buffer->start;
+}
+
+static int
+http_proxy_splice(int from, int to, off_t len)
+{
+  // http_proxy_splice():
+  // Move `len` bytes (-1: until end of file) from socket `from` to `to`.
+  // Plaintext client sockets get them through the worker's pipe without
+  // a copy to user space.
+
+  char buffer[HTTP_TLS_RECORD_MAX];
+  ssize_t moved, sent;
+  size_t chunk;
+
+  if (relay_pipe[0] == -1 && pipe2(relay_pipe, O_CLOEXEC) == -1)
+    relay_pipe[0] = relay_pipe[1] = -1;
+
+  while (len != 0) {
+    chunk = len < 0 || len > HTTP_PROXY_SPLICE_MAX ? HTTP_PROXY_SPLICE_MAX : len;
+
+    if (relay_pipe[0] != -1 && http_tls_kernel(to)) {
+      moved = splice(from, NULL, relay_pipe[1], NULL, chunk, SPLICE_F_MOVE | SPLICE_F_MORE);
+      if (moved == -1 && errno == EINTR)
+        continue;
+      if (moved <= 0)
+        return moved == 0 && len < 0 ? 0 : -1;
+
+      for (ssize_t pending = moved; pending > 0; pending -= sent) {
+        sent = splice(relay_pipe[0], NULL, to, NULL, pending, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (sent == -1 && errno == EINTR) {
+          sent = 0;
+          continue;
+        }
+        if (sent <= 0) {
+          // Whatever is left in the pipe belongs to no one
+          close(relay_pipe[0]);
+          close(relay_pipe[1]);
+          relay_pipe[0] = relay_pipe[1] = -1;
+          return -1;
+        }
+      }
+    } else {
+      moved = read(from, buffer, chunk < sizeof(buffer) ? chunk : sizeof(buffer));
+      if (moved == -1 && errno == EINTR)
+        continue;
+      if (moved <= 0)
+        return moved == 0 && len < 0 ? 0 : -1;
+      if (http_proxy_write(to, buffer, moved) != 0)
+        return -1;
+    }
+
+    if (len > 0)
+      len -= moved;
+  }
+
+  return 0;
+}
+
+static int
+http_proxy_body(int from, int to, http_proxy_buffer_t *buffer, off_t len)
+{
+  // Relay `len` body bytes (-1: until end of file), the buffered ones first
+  size_t buffered = buffer->end - buffer->start;
+
+  if (len >= 0 && (off_t)buffered > len)
+    buffered = len;
+  if (buffered > 0 && http_proxy_write(to, buffer->data + buffer->start, buffered) != 0)
+    return -1;
+  buffer->start += buffered;
+
+  return http_proxy_splice(from, to, len < 0 ? -1 : len - (off_t)buffered);
+}
+
+static int
+http_proxy_chunked(int from, int to, http_proxy_buffer_t *buffer, int dechunk)
+{
+  // http_proxy_chunked():
+  // Relay a chunked body (RFC 9112 7.1). Chunk data is relayed like any
+  // other body. With `dechunk` only the data is sent, for HTTP/1.0
+  // clients that read until the connection closes.
+
+  unsigned long long size;
+  const char *line;
+  char *end;
+  size_t len;
+
+  while (1) {
+    if ((line = http_proxy_line(from, buffer, &len)) == NULL)
+      return -1;
+    size = strtoull(line, &end, 16);
+    if (end == line || (*end != '\r' && *end != ';' && *end != ' ' && *end != '\t'))
+      return -1;
+    if (!dechunk && http_proxy_write(to, line, len) != 0)
+      return -1;
+    buffer->start += len;
+
+    if (size == 0)
+      break;
+
+    if (http_proxy_body(from, to, buffer, size) != 0)
+      return -1;
+
+    if ((line = http_proxy_line(from, buffer, &len)) == NULL || len != 2)
+      return -1;
+    if (!dechunk && http_proxy_write(to, line, len) != 0)
+      return -1;
+    buffer->start += len;
+  }
+
+  // Trailer section up to the empty line
+  do {
+    if ((line = http_proxy_line(from, buffer, &len)) == NULL)
+      return -1;
+    if (!dechunk && http_proxy_write(to, line, len) != 0)
+      return -1;
+    buffer->start += len;
+  } while (len != 2);
+
+  return 0;
+}
+
+static int
+http_proxy_target(char *out, size_t size, const char *path)
+{
+  // Write `path` normalized as a request target: with its leading slash,
+  // and with the bytes a path segment cannot carry percent-encoded.
+  // Returns the length of `out` or -1.
+  static const char hex[] = "0123456789ABCDEF";
+  char normalized[HTTP_PATH_MAX];
+  size_t len = 0;
+  int normalized_len;
+  unsigned char c;
+
+  if ((normalized_len = http_path_normalize(normalized, sizeof(normalized), path)) < 0 || size < 2)
+    return -1;
+
+  out[len++] = '/';
+  for (int i = 0; i < normalized_len; i++) {
+    if (len + 4 > size)
+      return -1;
+    c = normalized[i];
+    if (c < 0x80 && (isalnum(c) || strchr("/-._~!$&'()*+,;=:@", c) != NULL))
+      out[len++] = c;
+    else {
+      out[len++] = '%';
+      out[len++] = hex[c >> 4];
+      out[len++] = hex[c & 15];
+    }
+  }
+  out[len] = '\0';
+
+  return len;
+}
+
+static int
+http_proxy_request_head(char *out, size_t size, const http_request_t *request, int socketfd)
+{
+  // Rebuild the request head for the upstream: the path is normalized,
+  // hop-by-hop fields are dropped, the client is appended to
+  // X-Forwarded-For
+  char target[HTTP_PATH_MAX * 3];
+  char client[INET6_ADDRSTRLEN] = "unknown";
+  struct sockaddr_storage address;
+  socklen_t address_len = sizeof(address);
+  const char *forwarded_for = http_header_get(request, "X-Forwarded-For");
+  const http_header_t *header;
+  int len;
+
+  if (getpeername(socketfd, (struct sockaddr *)&address, &address_len) == 0) {
+    if (address.ss_family == AF_INET)
+      inet_ntop(AF_INET, &((struct sockaddr_in *)&address)->sin_addr, client, sizeof(client));
+    else if (address.ss_family == AF_INET6)
+      inet_ntop(AF_INET6, &((struct sockaddr_in6 *)&address)->sin6_addr, client, sizeof(client));
+  }
+
+  if (http_proxy_target(target, sizeof(target), request->path.string) < 0)
+    return -1;
+  len = snprintf(out, size, "%s %s%s%s HTTP/1.1\r\n", request->method_name.string, target,
+    request->query.len > 0 ? "?" : "", request->query.string);
+
+  for (size_t i = 0; i < request->headers.header_count && len > 0 && (size_t)len < size; i++) {
+    header = &request->headers.headers[i];
+    if (http_proxy_hop_by_hop(header->name)
+      || wsfs_str_case_eq(header->name, (wsfs_str_t)WSFS_STR("Expect"))
+      || wsfs_str_case_eq(header->name, (wsfs_str_t)WSFS_STR("X-Forwarded-For"))
+      || wsfs_str_case_eq(header->name, (wsfs_str_t)WSFS_STR("X-Forwarded-Proto")))
+      continue;
+    len += snprintf(out + len, size - len, "%s: %s\r\n", header->name.string, header->value.string);
+  }
+
+  if (len > 0 && (size_t)len < size && http_header_get(request, "Host") == NULL)
+    len += snprintf(out + len, size - len, "Host: localhost\r\n");
+
+  if (len > 0 && (size_t)len < size)
+    len += snprintf(out + len, size - len,
+      "X-Forwarded-For: %s%s%s\r\n"
+      "X-Forwarded-Proto: %s\r\n"
+      "Connection: keep-alive\r\n"
+      "\r\n",
+      forwarded_for != NULL ? forwarded_for : "", forwarded_for != NULL ? ", " : "", client,
+      http_tls_enabled() ? "https" : "http");
+
+  if (len < 0 || (size_t)len >= size)
+    return -1;
+  return len;
+}
+
+static int
+http_proxy_response_head(char *out, size_t size, const char *head, size_t head_len,
+  http_request_t *request, int *framing, off_t *content_length, int *reusable)
+{
+  // http_proxy_response_head():
+  // Parse the upstream response head and rewrite it for the client. Sets
+  // how the body is framed and whether the upstream connection can be
+  // reused afterwards. Returns the length of `out`, or -1 if the head is
+  // not valid HTTP/1.x.
+
+  const char *line = head, *line_end, *colon, *value;
+  const char *connection_close = NULL;
+  int status, len, chunked = 0, length = 0, http11;
+  wsfs_str_t name;
+  size_t value_len;
+
+  if (head_len < 12 || strncmp(head, "HTTP/1.", 7) != 0 || (head[7] != '0' && head[7] != '1') || head[8] != ' ')
+    return -1;
+  http11 = head[7] == '1';
+  status = atoi(head + 9);
+  if (status < 100 || status > 999)
+    return -1;
+
+  line_end = memmem(line, head_len, "\r\n", 2);
+  len = snprintf(out, size, "HTTP/1.1%.*s\r\n", (int)(line_end - line - 8), line + 8);
+
+  for (line = line_end + 2; line < head + head_len - 2 && len > 0 && (size_t)len < size; line = line_end + 2) {
+    line_end = memmem(line, head + head_len - line, "\r\n", 2);
+    if ((colon = memchr(line, ':', line_end - line)) == NULL)
+      return -1;
+    name = (wsfs_str_t) { .len = colon - line, .string = line };
+    for (value = colon + 1; value < line_end && (*value == ' ' || *value == '\t'); value++)
+      ;
+    value_len = line_end - value;
+
+    if (wsfs_str_case_eq(name, content_length_header)) {
+      length = 1;
+      *content_length = strtoll(value, NULL, 10);
+    } else if (wsfs_str_case_eq(name, transfer_encoding_header))
+      chunked = value_len >= 7 && strncasecmp(value + value_len - 7, "chunked", 7) == 0;
+    else if (wsfs_str_case_eq(name, connection_header) && memmem(value, value_len, "close", 5) != NULL)
+      connection_close = value;
+
+    // Chunked coding passes through to HTTP/1.1 clients
+    if (http_proxy_hop_by_hop(name)
+      && !(chunked && request->version == HTTP11 && wsfs_str_case_eq(name, transfer_encoding_header)))
+      continue;
+    len += snprintf(out + len, size - len, "%.*s\r\n", (int)(line_end - line), line);
+  }
+
+  if (request->method == HTTP_METHOD_HEAD || status < 200 || status == 204 || status == 304)
+    *framing = HTTP_PROXY_BODY_NONE;
+  else if (chunked)
+    *framing = HTTP_PROXY_BODY_CHUNKED;
+  else if (length && *content_length >= 0)
+    *framing = HTTP_PROXY_BODY_LENGTH;
+  else
+    *framing = HTTP_PROXY_BODY_CLOSE;
+
+  // A body that ends when the connection closes, or a chunked one for a
+  // client that does not know chunked coding, leaves no room for another
+  // request on the client connection
+  if (*framing == HTTP_PROXY_BODY_CLOSE || (*framing == HTTP_PROXY_BODY_CHUNKED && request->version != HTTP11))
+    request->keep_alive = 0;
+
+  *reusable = http11 && connection_close == NULL && *framing != HTTP_PROXY_BODY_CLOSE && !(chunked && length);
+
+  if (len > 0 && (size_t)len < size)
+    len += snprintf(out + len, size - len, "%s\r\n", http_connection_header(request));
+  if (len < 0 || (size_t)len >= size)
+    return -1;
+  return len;
+}
+
+static int
+http_proxy_exchange(int fd, const char *head, size_t head_len, http_request_t *request, int socketfd,
+  off_t body_buffered, off_t body_remaining, http_proxy_buffer_t *buffer)
+{
+  // Send the request and read the response head into `buffer`. Returns
+  // the head length, 0 if the upstream closed without answering, -1 on
+  // other errors (errno EAGAIN for a timeout).
+
+  char body[HTTP_TLS_RECORD_MAX];
+  const char *end;
+  char *head_start;
+  ssize_t bytes_read;
+
+  http_segment_t segments[] = {
+    { .fd = -1, .data = head, .len = head_len },
+    { .fd = -1, .data = request->raw + request->header_len, .len = body_buffered },
+  };
+  if (http_send_segments(fd, segments, 2) != 0)
+    return 0;
+
+  // The rest of the request body comes straight from the client
+  while (body_remaining > 0) {
+    bytes_read = http_tls_read(socketfd, body, body_remaining < (off_t)sizeof(body) ? body_remaining : (off_t)sizeof(body));
+    if (bytes_read == -1 && errno == EINTR)
+      continue;
+    if (bytes_read <= 0 || http_proxy_write(fd, body, bytes_read) != 0)
+      return -1;
+    body_remaining -= bytes_read;
+  }
+
+  // Interim 1xx responses are dropped: nothing is upgraded and the
+  // client's 100-continue was answered already
+  buffer->start = buffer->end = 0;
+  while (1) {
+    head_start = buffer->data + buffer->start;
+    if ((end = memmem(head_start, buffer->end - buffer->start, "\r\n\r\n", 4)) == NULL) {
+      bytes_read = http_proxy_fill(fd, buffer);
+      if (bytes_read <= 0)
+        return bytes_read == 0 && buffer->end == 0 ? 0 : -1;
+      continue;
+    }
+    if (end - head_start < 10 || memcmp(head_start + 8, " 1", 2) != 0)
+      return end + 4 - head_start;
+    buffer->start += end + 4 - head_start;
+  }
+}
+
+int
+http_proxy_serve(http_request_t *request, int socketfd, http_proxy_route_t *route)
+{
+  // http_proxy_serve():
+  // Forward `request` along `route` and relay the response. Answers 502
+  // if no upstream can be reached or it sends garbage, 504 if it does not
+  // answer in time. Once the response head is relayed, errors can only
+  // close the connection.
+
+  char head[HTTP_PROXY_HEADERS_MAX];
+  char response_head[HTTP_PROXY_HEADERS_MAX];
+  http_proxy_buffer_t pending, *buffer = &pending;
+  http_proxy_upstream_t *upstream = NULL;
+  const char *content_length_value = http_header_get(request, "Content-Length");
+  const char *expect = http_header_get(request, "Expect");
+  off_t body_len = 0, body_buffered, content_length = 0;
+  int head_len, response_head_len, framing, reusable;
+  int fd = -1, reused = 0, result = 0, status = CRIT_BAD_GATEWAY;
+  char *end;
+
+  if (http_header_get(request, "Transfer-Encoding") != NULL)
+    return http_send_error(socketfd, ERROR_LENGTH_REQUIRED, NULL, NULL);
+
+  if (content_length_value != NULL) {
+    body_len = strtoll(content_length_value, &end, 10);
+    if (end == content_length_value || *end != '\0' || body_len < 0)
+      return http_send_error(socketfd, ERROR_BAD_REQUEST, NULL, NULL);
+  }
+
+  // Body bytes that came with the head are no pipelined request
+  body_buffered = request->raw_len - request->header_len;
+  if (body_buffered > body_len)
+    body_buffered = body_len;
+
+  if ((head_len = http_proxy_request_head(head, sizeof(head), request, socketfd)) < 0)
+    return http_send_error(socketfd, ERROR_REQUEST_HEADER_FIELDS_TOO_LARGE, NULL, request);
+
+  if (expect != NULL && strcasecmp(expect, "100-continue") == 0 && body_buffered < body_len
+    && http_proxy_write(socketfd, "HTTP/1.1 100 Continue\r\n\r\n", 25) != 0)
+    return -1;
+
+  if ((buffer->data = http_buffer_get(HTTP_BUFFER_LARGE)) == NULL)
+    return http_send_error(socketfd, CRIT_INTERNAL_SERVER_ERROR, NULL, request);
+
+  // One retry: on a newly opened connection if a pooled one was closed
+  // without an answer, since the rest of the pool is no younger, or on
+  // another upstream if the first could not be reached. A request whose
+  // body was partly streamed from the client cannot be replayed.
+  for (int attempt = 0; attempt < 2; attempt++) {
+    upstream = http_proxy_pick(route, attempt > 0 && !reused ? upstream : NULL);
+    atomic_fetch_add(&upstream->outstanding, 1);
+
+    if (attempt > 0 && reused) {
+      reused = 0;
+      fd = http_proxy_open(upstream);
+    } else
+      fd = http_proxy_acquire(upstream, &reused);
+    if (fd == -1) {
+      status = errno == ETIMEDOUT ? CRIT_GATEWAY_TIMEOUT : CRIT_BAD_GATEWAY;
+      http_proxy_health_set(upstream, 0);
+      atomic_fetch_sub(&upstream->outstanding, 1);
+      reused = 0;
+      continue;
+    }
+
+    result = http_proxy_exchange(fd, head, head_len, request, socketfd, body_buffered, body_len - body_buffered, buffer);
+    if (result > 0)
+      break;
+
+    status = result == -1 && (errno == EAGAIN || errno == EWOULDBLOCK) ? CRIT_GATEWAY_TIMEOUT : CRIT_BAD_GATEWAY;
+    close(fd);
+    fd = -1;
+    atomic_fetch_sub(&upstream->outstanding, 1);
+    if (!reused || result != 0 || body_buffered < body_len)
+      break;
+  }
+
+  request->header_len += body_buffered;
+
+  if (fd == -1) {
+    http_buffer_put(buffer->data, HTTP_BUFFER_LARGE);
+    request->keep_alive = 0;
+    return http_send_error(socketfd, status, NULL, request);
+  }
+
+  response_head_len = http_proxy_response_head(response_head, sizeof(response_head), buffer->data + buffer->start, result,
+    request, &framing, &content_length, &reusable);
+  buffer->start += result;
+
+  if (response_head_len < 0) {
+    close(fd);
+    atomic_fetch_sub(&upstream->outstanding, 1);
+    http_buffer_put(buffer->data, HTTP_BUFFER_LARGE);
+    return http_send_error(socketfd, CRIT_BAD_GATEWAY, NULL, request);
+  }
+
+  HTTP_TRACE(response, http_trace_connection, atoi(response_head + 9),
+    framing == HTTP_PROXY_BODY_LENGTH ? content_length : framing == HTTP_PROXY_BODY_NONE ? 0 : -1);
+  result = http_proxy_write(socketfd, response_head, response_head_len);
+  if (result == 0 && framing == HTTP_PROXY_BODY_LENGTH)
+    result = http_proxy_body(fd, socketfd, buffer, content_length);
+  else if (result == 0 && framing == HTTP_PROXY_BODY_CHUNKED)
+    result = http_proxy_chunked(fd, socketfd, buffer, request->version != HTTP11);
+  else if (result == 0 && framing == HTTP_PROXY_BODY_CLOSE)
+    result = http_proxy_body(fd, socketfd, buffer, -1);
+
+  atomic_fetch_sub(&upstream->outstanding, 1);
+  if (result == 0 && reusable && buffer->start == buffer->end)
+    http_proxy_recycle(upstream, fd);
+  else
+    close(fd);
+
+  http_buffer_put(buffer->data, HTTP_BUFFER_LARGE);
+  return result;
+}
+
+static int
+http_proxy_probe(http_proxy_upstream_t *upstream)
+{
+  // A HEAD request for the health path, any status below 500 is healthy
+  char request[HTTP_PROXY_PREFIX_MAX + HTTP_PROXY_NAME_MAX + 128];
+  char response[32];
+  ssize_t len = 0, bytes_read;
+  int fd, status;
+
+  if ((fd = http_proxy_open(upstream)) == -1)
+    return 0;
+
+  len = snprintf(request, sizeof(request),
+    "HEAD %s HTTP/1.1\r\n"
+    "Host: %s\r\n"
+    "User-Agent: " PACKAGE_STRING "\r\n"
+    "Connection: close\r\n"
+    "\r\n",
+    http_proxy_health_path, upstream->address.ss_family == AF_UNIX ? "localhost" : upstream->name);
+  if (http_proxy_write(fd, request, len) != 0) {
+    close(fd);
+    return 0;
+  }
+
+  len = 0;
+  while ((size_t)len < sizeof(response) - 1 && (bytes_read = read(fd, response + len, sizeof(response) - 1 - len)) > 0)
+    len += bytes_read;
+  response[len] = '\0';
+  close(fd);
+
+  if (len < 12 || strncmp(response, "HTTP/1.", 7) != 0)
+    return 0;
+  status = atoi(response + 9);
+  return status >= 100 && status < 500;
+}
+
+static void *
+http_proxy_health(void *arg)
+{
+  (void)arg;
+
+  while (1) {
+    for (size_t i = 0; i < atomic_load(&upstream_count); i++)
+      http_proxy_health_set(&upstreams[i], http_proxy_probe(&upstreams[i]));
+    sleep(http_proxy_health_interval);
+  }
+
+  return NULL;
+}
+
+int
+http_proxy_init()
+{
+  // Start the health checks, after fork() like every other thread. Also
+  // without upstreams, a configuration reload may bring some.
+  pthread_t thread;
+
+  if (http_proxy_health_interval == 0)
+    return 0;
+
+  if (pthread_create(&thread, NULL, http_proxy_health, NULL) != 0)
+    return -1;
+  pthread_detach(thread);
+  return 0;
+}
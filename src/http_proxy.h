@@ -0,0 +1,55 @@
+// SPDX-License-Identifier: MIT
+
+#ifndef _HTTP_PROXY
+#define _HTTP_PROXY
+
+#include <stdatomic.h>
+#include <sys/socket.h>
+
+#include "http_core.h"
+
+#define HTTP_PROXY_ROUTES_MAX 16 // per virtual host
+#define HTTP_PROXY_UPSTREAMS_MAX 8 // per route
+#define HTTP_PROXY_POOLS 128 // distinct upstreams over all routes
+#define HTTP_PROXY_PREFIX_MAX 256
+#define HTTP_PROXY_NAME_MAX 128
+
+// Idle upstream connections each worker keeps per upstream
+#define HTTP_PROXY_IDLE_MAX 16
+
+// Upstream request and response header sections
+#define HTTP_PROXY_HEADERS_MAX 8192
+
+#define HTTP_PROXY_TIMEOUT_DEFAULT 30 // seconds
+#define HTTP_PROXY_HEALTH_INTERVAL_DEFAULT 5 // seconds
+#define HTTP_PROXY_HEALTH_PATH_DEFAULT "/"
+
+typedef struct {
+  char                        name[HTTP_PROXY_NAME_MAX]; // as configured
+  struct sockaddr_storage     address;
+  socklen_t                   address_len;
+  size_t                      index; // into per-worker connection pools
+
+  atomic_int                  outstanding; // requests in flight, all workers
+  atomic_int                  healthy;
+} http_proxy_upstream_t;
+
+// Upstreams are shared by every route naming them and live as long as
+// the process, routes come and go with the configuration
+typedef struct {
+  char                        prefix[HTTP_PROXY_PREFIX_MAX]; // normalized, no leading slash
+  size_t                      prefix_len;
+  http_proxy_upstream_t       *upstreams[HTTP_PROXY_UPSTREAMS_MAX];
+  size_t                      upstream_count;
+  atomic_uint                 next; // breaks ties between upstreams
+} http_proxy_route_t;
+
+extern long http_proxy_timeout;
+extern long http_proxy_health_interval;
+extern char http_proxy_health_path[HTTP_PROXY_PREFIX_MAX];
+
+int http_proxy_route_parse(http_proxy_route_t *route, const char *spec);
+int http_proxy_init();
+int http_proxy_serve(http_request_t *request, int socketfd, http_proxy_route_t *route);
+
+#endif
@@ -0,0 +1,189 @@
+// SPDX-License-Identifier: MIT
+
+#include <config.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "http_conditional.h"
+#include "http_core.h"
+#include "http_range.h"
+#include "http_utils.h"
+
+static const char *
+http_range_number(const char *s, off_t *out)
+{
+  // Parse 1*DIGIT. Returns pointer past the digits, NULL if there are none
+  // or the value does not fit into off_t.
+  off_t value = 0;
+  const char *start = s;
+
+  while (*s >= '0' && *s <= '9') {
+    if (value > (INT64_MAX - (*s - '0')) / 10)
+      return NULL;
+    value = value * 10 + (*s - '0');
+    s++;
+  }
+
+  if (s == start)
+    return NULL;
+
+  *out = value;
+  return s;
+}
+
+static int
+http_range_compare(const void *a, const void *b)
+{
+  const http_range_t *ra = a, *rb = b;
+  return (ra->first > rb->first) - (ra->first < rb->first);
+}
+
+int
+http_range_parse(http_range_set_t *out, const char *value, off_t size)
+{
+  // http_range_parse():
+  // Parse a Range header field value (RFC 9110 14.2) against a
+  // representation of `size` bytes. Satisfiable ranges are clamped to the
+  // representation, sorted and coalesced into `out`.
+
+  const char *s = value;
+  off_t first, last;
+
+  out->count = 0;
+
+  if (strncasecmp(s, "bytes=", 6) != 0)
+    return HTTP_RANGE_IGNORE;
+  s += 6;
+
+  while (1) {
+    while (*s == ' ' || *s == '\t')
+      s++;
+
+    if (*s == ',') {
+      s++;
+      continue;
+    }
+    if (*s == '\0')
+      break;
+
+    if (*s == '-') {
+      // suffix-range: last N bytes
+      if ((s = http_range_number(s + 1, &last)) == NULL)
+        return HTTP_RANGE_IGNORE;
+      first = last >= size ? 0 : size - last;
+      last = size - 1;
+      if (first > last)
+        first = -1; // zero-length suffix, unsatisfiable
+    } else {
+      if ((s = http_range_number(s, &first)) == NULL || *s++ != '-')
+        return HTTP_RANGE_IGNORE;
+      if (*s >= '0' && *s <= '9') {
+        if ((s = http_range_number(s, &last)) == NULL || last < first)
+          return HTTP_RANGE_IGNORE;
+        if (last >= size)
+          last = size - 1;
+      } else
+        last = size - 1;
+      if (first >= size)
+        first = -1;
+    }
+
+    while (*s == ' ' || *s == '\t')
+      s++;
+    if (*s != ',' && *s != '\0')
+      return HTTP_RANGE_IGNORE;
+
+    if (first == -1)
+      continue;
+
+    if (out->count == HTTP_RANGES_MAX)
+      return HTTP_RANGE_IGNORE;
+
+    out->ranges[out->count].first = first;
+    out->ranges[out->count].last = last;
+    out->count++;
+  }
+
+  if (out->count == 0)
+    return HTTP_RANGE_UNSATISFIABLE;
+
+  // Overlapping and adjacent ranges are merged so a client cannot make us
+  // send the same bytes many times over.
+  if (out->count > 1) {
+    size_t merged = 0;
+    qsort(out->ranges, out->count, sizeof(http_range_t), http_range_compare);
+    for (size_t i = 1; i < out->count; i++) {
+      if (out->ranges[i].first <= out->ranges[merged].last + 1) {
+        if (out->ranges[i].last > out->ranges[merged].last)
+          out->ranges[merged].last = out->ranges[i].last;
+      } else
+        out->ranges[++merged] = out->ranges[i];
+    }
+    out->count = merged + 1;
+  }
+
+  return HTTP_RANGE_SATISFIABLE;
+}
+
+int
+http_range_if_range(const char *value, const http_file_meta_t *meta)
+{
+  // http_range_if_range():
+  // Evaluate an If-Range field value. Returns 1 if the Range header should
+  // be honoured and 0 if the full representation must be sent.
+
+  time_t date;
+
+  // Entity tags use the strong comparison
+  if (value[0] == '"' || strncmp(value, "W/", 2) == 0)
+    return strchr(value, ',') == NULL && http_conditional_etag_match(value, meta->etag, 0);
+
+  if (http_date_parse(value, &date) != 0)
+    return 0;
+
+  return date == meta->mtime.tv_sec;
+}
+
+ssize_t
+http_range_multipart(char *buffer, size_t size, http_segment_t *segments, size_t *segment_count, const http_range_set_t *set, int fd, const char *content_type, off_t file_size)
+{
+  // http_range_multipart():
+  // Lay out a multipart/byteranges body (RFC 9110 14.6). Part headers are
+  // written to `buffer` and the body is described as alternating memory and
+  // file segments appended to `segments`. Returns the body length.
+
+  size_t used = 0;
+  ssize_t body_len = 0;
+  int len;
+
+  for (size_t i = 0; i < set->count; i++) {
+    const http_range_t *range = &set->ranges[i];
+
+    len = snprintf(buffer + used, size - used,
+      "\r\n--" HTTP_RANGE_BOUNDARY "\r\n"
+      "Content-Type: %s\r\n"
+      "Content-Range: bytes %lld-%lld/%lld\r\n"
+      "\r\n",
+      content_type, (long long)range->first, (long long)range->last, (long long)file_size);
+    if (len < 0 || (size_t)len >= size - used)
+      return -1;
+
+    segments[(*segment_count)++] = (http_segment_t) { .fd = -1, .data = buffer + used, .len = len };
+    segments[(*segment_count)++] = (http_segment_t) { .fd = fd, .offset = range->first, .len = range->last - range->first + 1 };
+
+    used += len;
+    body_len += len + range->last - range->first + 1;
+  }
+
+  len = snprintf(buffer + used, size - used, "\r\n--" HTTP_RANGE_BOUNDARY "--\r\n");
+  if (len < 0 || (size_t)len >= size - used)
+    return -1;
+
+  segments[(*segment_count)++] = (http_segment_t) { .fd = -1, .data = buffer + used, .len = len };
+  body_len += len;
+
+  return body_len;
+}
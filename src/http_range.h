@@ -0,0 +1,38 @@
+// SPDX-License-Identifier: MIT
+
+#ifndef _HTTP_RANGE
+#define _HTTP_RANGE
+
+#include <sys/types.h>
+
+#include "http_core.h"
+
+// More ranges than this in one request are ignored and the full
+// representation is sent instead.
+#define HTTP_RANGES_MAX 16
+
+#define HTTP_RANGE_BOUNDARY "wsfs-3d6f0a1c9b2e7458"
+
+// http_range_parse() results
+#define HTTP_RANGE_IGNORE 0 // No usable Range header, send 200
+#define HTTP_RANGE_SATISFIABLE 1 // Send 206
+#define HTTP_RANGE_UNSATISFIABLE 2 // Send 416
+
+typedef struct {
+  off_t                       first;
+  off_t                       last; // inclusive
+} http_range_t;
+
+typedef struct {
+  http_range_t                ranges[HTTP_RANGES_MAX];
+  size_t                      count;
+} http_range_set_t;
+
+// Size of the buffer http_range_multipart() needs for part headers
+#define HTTP_RANGE_MULTIPART_BUFFER_MAX (HTTP_RANGES_MAX * 256 + 64)
+
+int http_range_parse(http_range_set_t *out, const char *value, off_t size);
+int http_range_if_range(const char *value, const http_file_meta_t *meta);
+ssize_t http_range_multipart(char *buffer, size_t size, http_segment_t *segments, size_t *segment_count, const http_range_set_t *set, int fd, const char *content_type, off_t file_size);
+
+#endif
@@ -0,0 +1,728 @@
+// SPDX-License-Identifier: MIT
+
+#include <config.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "http_cache.h"
+#include "http_conditional.h"
+#include "http_core.h"
+#include "http_encoding.h"
+#include "http_file_cache.h"
+#include "http_io.h"
+#include "http_mime.h"
+#include "http_negative.h"
+#include "http_pack.h"
+#include "http_path.h"
+#include "http_range.h"
+#include "http_static.h"
+#include "http_trace.h"
+#include "http_utils.h"
+#include "http_zerocopy.h"
+#include "log_levels.h"
+#include "logger.h"
+
+char target[PATH_MAX];
+char pack[PATH_MAX];
+http_static_root_t http_static_target = { .fd = -1 };
+
+static http_pack_t site;
+static int openat2_supported = 1;
+
+int
+http_static_init()
+{
+  // A site pack replaces the target directory
+  if (pack[0] != '\0')
+    return http_pack_open(&site, pack);
+
+  return http_static_root_open(&http_static_target, target, 0, http_file_cache_ttl);
+}
+
+int
+http_static_root_open(http_static_root_t *root, const char *path, uint32_t id, time_t file_cache_ttl)
+{
+  // http_static_root_open():
+  // Open directory `path` as a document root. It is opened once, every
+  // lookup is relative to it. Returns 0, or -1 with errno set.
+
+  if (realpath(path, root->path) == NULL)
+    return -1;
+  if ((root->fd = open(root->path, O_PATH | O_DIRECTORY | O_CLOEXEC)) == -1)
+    return -1;
+  root->id = id;
+  root->file_cache_ttl = file_cache_ttl;
+  return 0;
+}
+
+void
+http_static_root_close(http_static_root_t *root)
+{
+  if (root->fd != -1)
+    close(root->fd);
+  root->fd = -1;
+}
+
+static http_status_code_t
+http_static_errno_status(int error)
+{
+  switch (error) {
+  case ENOENT:
+  case ENOTDIR:
+  case EXDEV:
+  case ENAMETOOLONG:
+  case ELOOP:
+    return ERROR_NOT_FOUND;
+  case EACCES:
+  case EPERM:
+    return ERROR_FORBIDDEN;
+  default:
+    return CRIT_INTERNAL_SERVER_ERROR;
+  }
+}
+
+static int
+http_static_open(const http_static_root_t *root, const char *path)
+{
+  // http_static_open():
+  // Open normalized `path` below `root`, non-blocking like
+  // http_path_open(). Uses openat2() on the root directory descriptor,
+  // and realpath() plus a prefix check on kernels without it.
+
+  char full[PATH_MAX], resolved[PATH_MAX];
+  size_t root_len = strlen(root->path);
+  int fd;
+
+  if (openat2_supported) {
+    if ((fd = http_path_open(root->fd, path)) != -1 || errno != ENOSYS)
+      return fd;
+    openat2_supported = 0;
+    logger(LOGL_NOTICE, NULL, "openat2() is not available, falling back to realpath()");
+  }
+
+  if (snprintf(full, sizeof(full), "%s/%s", root->path, path) >= (int)sizeof(full)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+
+  if (realpath(full, resolved) == NULL)
+    return -1;
+
+  // Symlinks must not lead outside of the root directory
+  if (strncmp(resolved, root->path, root_len) != 0
+    || (resolved[root_len] != '/' && resolved[root_len] != '\0')) {
+    errno = EXDEV;
+    return -1;
+  }
+
+  return open(resolved, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+}
+
+static int
+http_static_blocking(int fd)
+{
+  // Clear the O_NONBLOCK of a regular file from http_static_open(), the
+  // only file status flag it sets. Returns 0 or -1.
+  return fcntl(fd, F_SETFL, 0);
+}
+
+static int
+http_static_resolve(const http_static_root_t *root, char *path, size_t size, http_file_cache_entry_t *out, http_status_code_t *status)
+{
+  // http_static_resolve():
+  // Open normalized `path` into `out` and fill its metadata and content
+  // type from the open descriptor. Directories are served through their
+  // index file, whose name is then appended to `path`. Precompressed
+  // siblings are not looked up.
+  //
+  // Returns 0, or -1 with `status` set.
+
+  size_t len = strlen(path);
+  struct stat st;
+  int file;
+
+  out->fd = -1;
+  for (int encoding = 0; encoding < HTTP_ENCODINGS; encoding++) {
+    out->encoded_fd[encoding] = -1;
+    out->headers[encoding] = NULL;
+    out->headers_len[encoding] = 0;
+  }
+
+  if (len == 0 || path[len - 1] == '/') {
+    if (len + sizeof(HTTP_STATIC_INDEX) > size) {
+      *status = ERROR_URI_TOO_LONG;
+      return -1;
+    }
+    memcpy(path + len, HTTP_STATIC_INDEX, sizeof(HTTP_STATIC_INDEX));
+  }
+
+  for (int attempt = 0; attempt < 2; attempt++) {
+    if ((file = http_static_open(root, path)) == -1) {
+      *status = http_static_errno_status(errno);
+      return -1;
+    }
+
+    if (fstat(file, &st) == -1) {
+      close(file);
+      *status = CRIT_INTERNAL_SERVER_ERROR;
+      return -1;
+    }
+
+    if (S_ISREG(st.st_mode)) {
+      out->content_type = http_mime_type(path);
+      if (http_static_blocking(file) != 0
+        || http_conditional_meta_set(&out->meta, &st, http_mime_compressible(out->content_type)) != 0) {
+        close(file);
+        *status = CRIT_INTERNAL_SERVER_ERROR;
+        return -1;
+      }
+      out->fd = file;
+      return 0;
+    }
+
+    close(file);
+
+    len = strlen(path);
+    if (!S_ISDIR(st.st_mode) || attempt > 0 || len + sizeof("/" HTTP_STATIC_INDEX) > size)
+      break;
+    memcpy(path + len, "/" HTTP_STATIC_INDEX, sizeof("/" HTTP_STATIC_INDEX));
+  }
+
+  *status = ERROR_NOT_FOUND;
+  return -1;
+}
+
+static void
+http_static_sidecars(const http_static_root_t *root, const char *path, http_file_cache_entry_t *file)
+{
+  // http_static_sidecars():
+  // Open the precompressed siblings of `path` ("style.css.br" for
+  // "style.css"). A sibling older than the file is stale and ignored.
+
+  char name[PATH_MAX];
+  struct stat st;
+  int fd;
+
+  for (int encoding = HTTP_ENCODING_IDENTITY + 1; encoding < HTTP_ENCODINGS; encoding++) {
+    if (snprintf(name, sizeof(name), "%s%s", path, http_encoding_extension(encoding)) >= (int)sizeof(name))
+      continue;
+    if ((fd = http_static_open(root, name)) == -1)
+      continue;
+
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && http_static_blocking(fd) == 0
+      && (st.st_mtim.tv_sec > file->meta.mtime.tv_sec
+        || (st.st_mtim.tv_sec == file->meta.mtime.tv_sec && st.st_mtim.tv_nsec >= file->meta.mtime.tv_nsec))
+      && http_conditional_meta_set(&file->encoded_meta[encoding], &st, 1) == 0
+      && http_conditional_meta_variant(&file->encoded_meta[encoding], http_encoding_name(encoding), st.st_size) == 0) {
+      file->encoded_fd[encoding] = fd;
+      continue;
+    }
+
+    close(fd);
+  }
+}
+
+static void
+http_static_headers(http_file_cache_entry_t *file)
+{
+  // http_static_headers():
+  // Build the header blocks of `file`, one for every representation
+  // with a descriptor. Same fields and order as http_static_send().
+
+  char block[HTTP_RESPONSE_HEADERS_MAX];
+  char content_encoding[64];
+  const http_file_meta_t *meta;
+  int block_len;
+
+  for (int encoding = 0; encoding < HTTP_ENCODINGS; encoding++) {
+    if (encoding == HTTP_ENCODING_IDENTITY)
+      meta = &file->meta;
+    else if (file->encoded_fd[encoding] != -1)
+      meta = &file->encoded_meta[encoding];
+    else
+      continue;
+
+    content_encoding[0] = '\0';
+    if (encoding != HTTP_ENCODING_IDENTITY)
+      snprintf(content_encoding, sizeof(content_encoding), "Content-Encoding: %s\r\n", http_encoding_name(encoding));
+
+    block_len = snprintf(block, sizeof(block),
+      "Server: " PACKAGE_STRING "\r\n"
+      "Content-Type: %s\r\n"
+      "%s"
+      "Content-Length: %lld\r\n"
+      "Accept-Ranges: bytes\r\n"
+      "%s",
+      file->content_type, content_encoding, (long long)meta->size, meta->validators);
+    if (block_len < 0 || (size_t)block_len >= sizeof(block))
+      continue;
+
+    if ((file->headers[encoding] = malloc(block_len)) == NULL)
+      continue;
+    memcpy(file->headers[encoding], block, block_len);
+    file->headers_len[encoding] = block_len;
+  }
+}
+
+static http_file_cache_entry_t *
+http_static_file_get(const http_static_root_t *root, const char *path, size_t path_len, http_file_cache_entry_t *local,
+  http_status_code_t *status)
+{
+  // http_static_file_get():
+  // Get the file for normalized `path` below `root` from the open file
+  // cache, or open it with its precompressed siblings and cache it.
+  // Returns `local` if the file could not be cached, or NULL with
+  // `status` set. Paths of --target known to be missing are not looked
+  // up.
+
+  char name[HTTP_PATH_MAX];
+  http_file_cache_entry_t *file;
+
+  if (root->file_cache_ttl > 0 && (file = http_file_cache_get(root->id, path)) != NULL)
+    return file;
+
+  if (root->id == 0 && http_negative_absent(path, path_len)) {
+    *status = ERROR_NOT_FOUND;
+    return NULL;
+  }
+
+  memcpy(name, path, path_len + 1);
+  if (http_static_resolve(root, name, sizeof(name), local, status) != 0) {
+    if (root->id == 0 && *status == ERROR_NOT_FOUND)
+      http_negative_put(path, path_len);
+    return NULL;
+  }
+  if (local->meta.vary)
+    http_static_sidecars(root, name, local);
+  http_static_headers(local);
+
+  if (root->file_cache_ttl == 0 || (file = http_file_cache_put(root->id, path, local, root->file_cache_ttl)) == NULL)
+    file = local;
+  return file;
+}
+
+static void
+http_static_release(http_file_cache_entry_t *file, http_file_cache_entry_t *local)
+{
+  if (file != local) {
+    http_file_cache_release(file);
+    return;
+  }
+
+  if (local->fd != -1)
+    close(local->fd);
+  for (int encoding = 0; encoding < HTTP_ENCODINGS; encoding++) {
+    if (local->encoded_fd[encoding] != -1)
+      close(local->encoded_fd[encoding]);
+    free(local->headers[encoding]);
+  }
+}
+
+static http_cache_entry_t *
+http_static_compress(const http_static_root_t *root, const char *path, const http_file_cache_entry_t *file, int encoding)
+{
+  // http_static_compress():
+  // Get the `encoding` variant of `file` from the response cache,
+  // compressing it first if this is the first request for it. Returns
+  // NULL if the identity representation should be served instead:
+  // the variant is not smaller, another request is producing it right
+  // now or it cannot be cached.
+
+  char key[HTTP_PATH_MAX + 8];
+  char *data, *body = NULL;
+  size_t len = 0;
+  ssize_t bytes_read;
+  off_t done = 0;
+  http_cache_entry_t *entry;
+  int reserved;
+
+  // Files of --target keep "encoding:path" keys, which snapshots restore.
+  // Other roots get new ids on every start, their keys are not restored.
+  if (root->id == 0)
+    snprintf(key, sizeof(key), "%s:%s", http_encoding_name(encoding), path);
+  else
+    snprintf(key, sizeof(key), "%s#%u:%s", http_encoding_name(encoding), (unsigned)root->id, path);
+
+  if ((entry = http_cache_get(key, file->meta.etag, &reserved)) != NULL) {
+    if (entry->body != NULL)
+      return entry;
+    http_cache_release(entry);
+    return NULL;
+  }
+
+  if (!reserved)
+    return NULL;
+
+  if ((data = malloc(file->meta.size)) == NULL) {
+    http_cache_release(http_cache_set(key, file->meta.etag, NULL, 0));
+    return NULL;
+  }
+
+  while (done < file->meta.size
+    && (bytes_read = pread(file->fd, data + done, file->meta.size - done, done)) > 0)
+    done += bytes_read;
+
+  if (done == file->meta.size
+    && http_encoding_compress(encoding, HTTP_ENCODING_LEVEL_FAST, data, done, &body, &len) == -1)
+    body = NULL;
+  free(data);
+
+  if ((entry = http_cache_set(key, file->meta.etag, body, len)) != NULL && entry->body == NULL) {
+    http_cache_release(entry);
+    entry = NULL;
+  }
+
+  return entry;
+}
+
+int
+http_static_send(http_request_t *request, int socketfd, const http_static_body_t *body)
+{
+  // http_static_send():
+  // Answer a GET or HEAD `request` with `body`: 304 if the client's copy
+  // is still valid, 206 or 416 for Range requests on the identity coding
+  // and 200 otherwise. A 200 with a prebuilt header block is sent as
+  // constant pieces, the cached Date field and that block.
+
+  char headers[HTTP_RESPONSE_HEADERS_MAX];
+  char content_range[128];
+  char content_encoding[64];
+  char multipart[HTTP_RANGE_MULTIPART_BUFFER_MAX];
+  static const char ok[] = HTTP11_STR " 200 " SUCCESS_OK_STRING "\r\n";
+  wsfs_str_t date;
+  const char *connection;
+  http_segment_t segments[HTTP_SEGMENTS_MAX];
+  size_t segment_count = 1;
+  http_status_code_t status = SUCCESS_OK;
+  http_range_set_t ranges;
+  const http_file_meta_t *meta = body->meta;
+  const char *content_type = body->content_type;
+  const char *range, *if_range;
+  off_t content_length = meta->size;
+  int head_only = request->method == HTTP_METHOD_HEAD;
+  int headers_len, range_result = HTTP_RANGE_IGNORE;
+
+  if (http_conditional_not_modified(request, meta))
+    return http_conditional_send_not_modified(socketfd, meta, request);
+
+  content_range[0] = '\0';
+  content_encoding[0] = '\0';
+
+  // Ranges always refer to the identity representation
+  range = http_header_get(request, "Range");
+  if (range != NULL && request->method == HTTP_METHOD_GET && body->encoding == HTTP_ENCODING_IDENTITY) {
+    if_range = http_header_get(request, "If-Range");
+    if (if_range == NULL || http_range_if_range(if_range, meta))
+      range_result = http_range_parse(&ranges, range, meta->size);
+  }
+
+  if (range_result == HTTP_RANGE_UNSATISFIABLE) {
+    snprintf(content_range, sizeof(content_range), "Content-Range: bytes */%lld\r\n", (long long)meta->size);
+    return http_send_error(socketfd, ERROR_RANGE_NOT_SATISFIABLE, content_range, request);
+  }
+
+  if (body->encoding != HTTP_ENCODING_IDENTITY)
+    snprintf(content_encoding, sizeof(content_encoding), "Content-Encoding: %s\r\n", http_encoding_name(body->encoding));
+
+  if (range_result == HTTP_RANGE_SATISFIABLE && ranges.count == 1) {
+    status = SUCCESS_PARTIAL_CONTENT;
+    content_length = ranges.ranges[0].last - ranges.ranges[0].first + 1;
+    snprintf(content_range, sizeof(content_range), "Content-Range: bytes %lld-%lld/%lld\r\n",
+      (long long)ranges.ranges[0].first, (long long)ranges.ranges[0].last, (long long)meta->size);
+    segments[segment_count++] = (http_segment_t) { .fd = body->fd, .offset = ranges.ranges[0].first, .len = content_length };
+  } else if (range_result == HTTP_RANGE_SATISFIABLE) {
+    status = SUCCESS_PARTIAL_CONTENT;
+    content_length = http_range_multipart(multipart, sizeof(multipart), segments, &segment_count, &ranges, body->fd, content_type, meta->size);
+    if (content_length == -1)
+      return http_send_error(socketfd, CRIT_INTERNAL_SERVER_ERROR, NULL, request);
+    content_type = "multipart/byteranges; boundary=" HTTP_RANGE_BOUNDARY;
+  } else if (body->fd == -1)
+    segments[segment_count++] = (http_segment_t) { .fd = -1, .data = body->data, .len = meta->size };
+  else
+    segments[segment_count++] = (http_segment_t) { .fd = body->fd, .offset = 0, .len = meta->size };
+
+  // Bodies inside a bigger file (a pack) start at `offset`
+  for (size_t i = 1; i < segment_count; i++)
+    if (segments[i].fd != -1)
+      segments[i].offset += body->offset;
+
+  // Left to the I/O pool if the first file data is not in memory
+  for (size_t i = 1; i < segment_count && !head_only; i++) {
+    if (segments[i].fd == -1)
+      continue;
+    if (http_io_cold(segments[i].fd, segments[i].offset, segments[i].len))
+      return HTTP_IO_COLD;
+    break;
+  }
+
+  date = http_date_header();
+
+  if (status == SUCCESS_OK && body->headers != NULL) {
+    connection = http_connection_header(request);
+
+    http_segment_t hot[] = {
+      { .fd = -1, .data = ok, .len = sizeof(ok) - 1 },
+      { .fd = -1, .data = date.string, .len = date.len },
+      { .fd = -1, .data = body->headers, .len = body->headers_len },
+      { .fd = -1, .data = connection, .len = strlen(connection) },
+      { .fd = -1, .data = "\r\n", .len = 2 },
+      segments[1],
+    };
+
+    HTTP_TRACE(response, http_trace_connection, status, head_only ? 0 : content_length);
+    return http_send_segments(socketfd, hot, head_only ? 5 : 6);
+  }
+
+  headers_len = http_status_line_format(headers, sizeof(headers), status);
+  if (headers_len < 0)
+    return -1;
+
+  headers_len += snprintf(headers + headers_len, sizeof(headers) - headers_len,
+    "%.*s"
+    "Server: " PACKAGE_STRING "\r\n"
+    "Content-Type: %s\r\n"
+    "%s"
+    "Content-Length: %lld\r\n"
+    "%s"
+    "%s"
+    "Accept-Ranges: bytes\r\n"
+    "%s"
+    "\r\n",
+    (int)date.len, date.string, content_type, content_encoding, (long long)content_length, content_range, meta->validators, http_connection_header(request));
+  if ((size_t)headers_len >= sizeof(headers))
+    return http_send_error(socketfd, CRIT_INTERNAL_SERVER_ERROR, NULL, request);
+
+  segments[0] = (http_segment_t) { .fd = -1, .data = headers, .len = headers_len };
+
+  HTTP_TRACE(response, http_trace_connection, status, head_only ? 0 : content_length);
+  if (body->pin != NULL && !head_only && segment_count == 2 && segments[1].fd == -1)
+    return http_zerocopy_send(socketfd, segments, segment_count, body->pin);
+  return http_send_segments(socketfd, segments, head_only ? 1 : segment_count);
+}
+
+static int
+http_static_serve_pack(http_request_t *request, int socketfd, const char *path, size_t path_len)
+{
+  // http_static_serve_pack():
+  // Answer `request` from the site pack. A plain GET or HEAD is sent as
+  // the status line and Date, the prebuilt header block and the body
+  // straight from the pack; everything else goes through
+  // http_static_send().
+
+  char head[256];
+  char tail[64];
+  wsfs_str_t date;
+  const http_pack_entry_t *entry;
+  const http_pack_variant_t *variant;
+  http_file_meta_t meta;
+  http_static_body_t body;
+  const char *range;
+  int head_len, tail_len, accepted;
+  int encoding = HTTP_ENCODING_IDENTITY;
+
+  if ((entry = http_pack_lookup(&site, path, path_len)) == NULL)
+    return http_send_error(socketfd, ERROR_NOT_FOUND, NULL, request);
+
+  range = http_header_get(request, "Range");
+  if ((entry->flags & HTTP_PACK_ENTRY_VARY) && (range == NULL || request->method != HTTP_METHOD_GET)) {
+    accepted = http_encoding_accepted(http_header_get(request, "Accept-Encoding"));
+    for (int i = 0; i < HTTP_ENCODINGS - 1; i++) {
+      if ((accepted & 1 << http_encoding_preference[i]) && entry->variants[http_encoding_preference[i]].headers_len != 0) {
+        encoding = http_encoding_preference[i];
+        break;
+      }
+    }
+  }
+
+  variant = &entry->variants[encoding];
+
+  if (range == NULL && http_header_get(request, "If-None-Match") == NULL
+    && http_header_get(request, "If-Modified-Since") == NULL) {
+    if (request->method == HTTP_METHOD_GET && http_io_cold(site.fd, variant->body_offset, variant->body_len))
+      return HTTP_IO_COLD;
+    if ((head_len = http_status_line_format(head, sizeof(head), SUCCESS_OK)) < 0)
+      return -1;
+    date = http_date_header();
+    head_len += snprintf(head + head_len, sizeof(head) - head_len, "%.*sServer: " PACKAGE_STRING "\r\n", (int)date.len, date.string);
+    tail_len = snprintf(tail, sizeof(tail), "%s\r\n", http_connection_header(request));
+
+    http_segment_t segments[] = {
+      { .fd = -1, .data = head, .len = head_len },
+      { .fd = -1, .data = site.map + variant->headers_offset, .len = variant->headers_len },
+      { .fd = -1, .data = tail, .len = tail_len },
+      { .fd = site.fd, .offset = variant->body_offset, .len = variant->body_len },
+    };
+
+    HTTP_TRACE(response, http_trace_connection, SUCCESS_OK, request->method == HTTP_METHOD_HEAD ? 0 : variant->body_len);
+    return http_send_segments(socketfd, segments, request->method == HTTP_METHOD_HEAD ? 3 : 4);
+  }
+
+  // The prebuilt header block ends with the validator fields
+  memset(&meta, 0, sizeof(meta));
+  meta.size = variant->body_len;
+  meta.mtime.tv_sec = entry->mtime_sec;
+  meta.mtime.tv_nsec = entry->mtime_nsec;
+  meta.vary = (entry->flags & HTTP_PACK_ENTRY_VARY) != 0;
+  strcpy(meta.etag, site.map + variant->etag_offset);
+  strcpy(meta.last_modified, site.map + entry->last_modified_offset);
+  memcpy(meta.validators, site.map + variant->headers_offset + variant->headers_len - variant->validators_len, variant->validators_len);
+  meta.validators[variant->validators_len] = '\0';
+  meta.validators_len = variant->validators_len;
+
+  body = (http_static_body_t) {
+    .meta = &meta,
+    .content_type = site.map + entry->content_type_offset,
+    .encoding = encoding,
+    .fd = site.fd,
+    .offset = variant->body_offset,
+  };
+
+  return http_static_send(request, socketfd, &body);
+}
+
+int
+http_static_serve(http_request_t *request, int socketfd, const http_static_root_t *root)
+{
+  // http_static_serve():
+  // Answer `request` with a file from `root`, or from the site pack if
+  // one is loaded and `root` is the target.
+  //
+  // Files are looked up in the open file cache by their normalized path
+  // first. On a miss the file is opened and cached, so following requests
+  // for it, conditional or not, need no path resolution at all.
+  //
+  // Compressible files are sent with the best content coding the client
+  // accepts: from a precompressed sibling if there is one, otherwise from
+  // a variant compressed once and kept in the response cache.
+  //
+  // Returns HTTP_IO_COLD without sending anything if the file data is not
+  // in the page cache, for the request to be served again on an I/O
+  // thread.
+
+  char path[HTTP_PATH_MAX];
+  http_status_code_t status = SUCCESS_OK;
+  http_file_cache_entry_t local, *file;
+  http_file_meta_t variant;
+  http_cache_entry_t *compressed = NULL;
+  http_static_body_t body;
+  int result, path_len, accepted;
+
+  if (request->method != HTTP_METHOD_GET && request->method != HTTP_METHOD_HEAD)
+    return http_send_error(socketfd, ERROR_METHOD_NOT_ALLOWED, "Allow: GET, HEAD\r\n", request);
+
+  path_len = http_path_normalize(path, sizeof(path), request->path.string);
+  if (path_len == HTTP_PATH_MALFORMED)
+    return http_send_error(socketfd, ERROR_BAD_REQUEST, NULL, request);
+  if (path_len == HTTP_PATH_TOO_LONG)
+    return http_send_error(socketfd, ERROR_URI_TOO_LONG, NULL, request);
+
+  if (site.map != NULL && root->id == 0)
+    return http_static_serve_pack(request, socketfd, path, path_len);
+
+  if ((file = http_static_file_get(root, path, path_len, &local, &status)) == NULL) {
+    if (status == ERROR_NOT_FOUND)
+      return http_negative_send(socketfd, request);
+    return http_send_error(socketfd, status, NULL, request);
+  }
+
+  body = (http_static_body_t) {
+    .meta = &file->meta,
+    .content_type = file->content_type,
+    .encoding = HTTP_ENCODING_IDENTITY,
+    .fd = file->fd,
+    .headers = file->headers[HTTP_ENCODING_IDENTITY],
+    .headers_len = file->headers_len[HTTP_ENCODING_IDENTITY],
+  };
+
+  if (file->meta.vary && (http_header_get(request, "Range") == NULL || request->method != HTTP_METHOD_GET)) {
+    accepted = http_encoding_accepted(http_header_get(request, "Accept-Encoding"));
+
+    for (int i = 0; i < HTTP_ENCODINGS - 1; i++) {
+      int candidate = http_encoding_preference[i];
+      if (!(accepted & 1 << candidate))
+        continue;
+
+      if (file->encoded_fd[candidate] != -1) {
+        body.encoding = candidate;
+        body.meta = &file->encoded_meta[candidate];
+        body.fd = file->encoded_fd[candidate];
+        body.headers = file->headers[candidate];
+        body.headers_len = file->headers_len[candidate];
+        break;
+      }
+
+      if (http_encoding_supported(candidate)
+        && file->meta.size >= HTTP_ENCODING_SIZE_MIN && file->meta.size <= HTTP_ENCODING_SIZE_MAX
+        && (compressed = http_static_compress(root, path, file, candidate)) != NULL) {
+        variant = file->meta;
+        http_conditional_meta_variant(&variant, http_encoding_name(candidate), compressed->len);
+        body.encoding = candidate;
+        body.meta = &variant;
+        body.fd = -1;
+        body.data = compressed->body;
+        body.pin = compressed;
+        body.headers = NULL;
+        break;
+      }
+    }
+  }
+
+  result = http_static_send(request, socketfd, &body);
+
+  if (compressed != NULL)
+    http_cache_release(compressed);
+  http_static_release(file, &local);
+  return result;
+}
+
+void
+http_static_warm(const char *key, const char *etag, char *body, size_t len)
+{
+  // http_static_warm():
+  // Refill the response cache entry `key` ("encoding:path", see
+  // http_static_compress()) after a restart. A restored `body` is only
+  // taken while the file still has the ETag it was made from, otherwise
+  // the variant is compressed again from the current file.
+
+  http_file_cache_entry_t local, *file;
+  http_cache_entry_t *entry;
+  http_status_code_t status;
+  const char *path = strchr(key, ':');
+  int encoding, reserved;
+
+  if (site.map != NULL || path == NULL)
+    goto done;
+
+  for (encoding = HTTP_ENCODING_IDENTITY + 1; encoding < HTTP_ENCODINGS; encoding++)
+    if (strncmp(key, http_encoding_name(encoding), path - key) == 0 && http_encoding_name(encoding)[path - key] == '\0')
+      break;
+  path++;
+
+  if (encoding == HTTP_ENCODINGS || !http_encoding_supported(encoding)
+    || (file = http_static_file_get(&http_static_target, path, strlen(path), &local, &status)) == NULL)
+    goto done;
+
+  if (body != NULL && strcmp(file->meta.etag, etag) == 0) {
+    if ((entry = http_cache_get(key, etag, &reserved)) != NULL)
+      http_cache_release(entry);
+    else if (reserved && (entry = http_cache_set(key, etag, body, len)) != NULL)
+      http_cache_release(entry);
+    body = reserved ? NULL : body;
+  } else if (file->meta.vary && file->encoded_fd[encoding] == -1
+    && file->meta.size >= HTTP_ENCODING_SIZE_MIN && file->meta.size <= HTTP_ENCODING_SIZE_MAX
+    && (entry = http_static_compress(&http_static_target, path, file, encoding)) != NULL)
+    http_cache_release(entry);
+
+  http_static_release(file, &local);
+
+done:
+  free(body);
+}
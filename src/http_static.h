@@ -0,0 +1,50 @@
+// SPDX-License-Identifier: MIT
+
+#ifndef _HTTP_STATIC
+#define _HTTP_STATIC
+
+#include <linux/limits.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "http_core.h"
+#include "http_pack.h"
+
+#define HTTP_STATIC_INDEX "index.html"
+
+// One representation of a resource, its body is either `len` bytes at
+// `offset` of `fd` or, if `fd` is -1, in memory at `data`
+typedef struct {
+  const http_file_meta_t     *meta;
+  const char                 *content_type;
+  int                         encoding;
+  int                         fd;
+  off_t                       offset;
+  const char                 *data;
+  struct http_cache_entry    *pin; // owns `data` if not NULL
+
+  // Prebuilt header fields of a 200 response, NULL to format them
+  const char                 *headers;
+  size_t                      headers_len;
+} http_static_body_t;
+
+// A directory files are served from
+typedef struct {
+  char                        path[PATH_MAX]; // resolved, for the realpath() fallback
+  int                         fd; // O_PATH
+  uint32_t                    id; // 0 for --target, keeps cache entries of roots apart
+  time_t                      file_cache_ttl; // 0 bypasses the open file cache
+} http_static_root_t;
+
+extern char target[PATH_MAX];
+extern char pack[PATH_MAX];
+extern http_static_root_t http_static_target;
+
+int http_static_init();
+int http_static_root_open(http_static_root_t *root, const char *path, uint32_t id, time_t file_cache_ttl);
+void http_static_root_close(http_static_root_t *root);
+int http_static_send(http_request_t *request, int socketfd, const http_static_body_t *body);
+int http_static_serve(http_request_t *request, int socketfd, const http_static_root_t *root);
+void http_static_warm(const char *key, const char *etag, char *body, size_t len);
+
+#endif
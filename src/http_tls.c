@@ -0,0 +1,430 @@
+// SPDX-License-Identifier: MIT
+
+#include <config.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#ifdef HAVE_OPENSSL
+#include <openssl/core_names.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/ssl.h>
+#endif
+
+#include "http_core.h"
+#include "http_tls.h"
+#include "http_utils.h"
+#include "log_levels.h"
+#include "logger.h"
+
+// TLS
+//
+// With a certificate configured, every accepted connection starts with a
+// TLS handshake in user space. OpenSSL then hands the session keys to
+// the kernel (TCP_ULP "tls") where it can: with kernel TLS, read(),
+// writev() and sendfile() on the socket carry plaintext and the static
+// file path keeps sending file data without copying it to user space.
+// Where the kernel or the cipher does not support it, records are
+// encrypted by SSL_write() instead and file data is read in chunks.
+//
+// The handshake runs on a non-blocking socket, one step each time the
+// worker's poll() finds the socket ready, so a client that stalls in it
+// holds no worker. The socket blocks again once it is done.
+//
+// Sessions are indexed by socket descriptor. A descriptor belongs to one
+// worker while the connection is open, so the table needs no lock.
+//
+// Resumption uses stateless session tickets, valid in every worker and
+// both listening processes. With --tls-ticket-key they also survive
+// restarts.
+
+#ifdef HAVE_OPENSSL
+
+typedef struct {
+  SSL                        *ssl;
+  int                         ready; // handshake done
+  int                         ktls_send;
+  int                         ktls_recv;
+} http_tls_session_t;
+
+static SSL_CTX *context;
+static http_tls_session_t *sessions;
+static size_t sessions_max;
+static unsigned char ticket_key[HTTP_TLS_TICKET_KEY_SIZE];
+
+static int
+http_tls_alpn(SSL *ssl, const unsigned char **out, unsigned char *out_len, const unsigned char *in, unsigned int in_len, void *arg)
+{
+  // Only HTTP/1.1 is spoken, clients offering only h2 get no ALPN
+  static const unsigned char protocols[] = "\x08http/1.1";
+
+  (void)ssl;
+  (void)arg;
+
+  if (SSL_select_next_proto((unsigned char **)out, out_len, protocols, sizeof(protocols) - 1, in, in_len) != OPENSSL_NPN_NEGOTIATED)
+    return SSL_TLSEXT_ERR_NOACK;
+  return SSL_TLSEXT_ERR_OK;
+}
+
+static int
+http_tls_ticket(SSL *ssl, unsigned char name[16], unsigned char *iv, EVP_CIPHER_CTX *cipher, EVP_MAC_CTX *hmac, int encrypt)
+{
+  // Encrypt and authenticate session tickets with the --tls-ticket-key
+  // keys. A ticket under another key name means a full handshake.
+  OSSL_PARAM params[] = {
+    OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, "SHA256", 0),
+    OSSL_PARAM_construct_end(),
+  };
+
+  (void)ssl;
+
+  if (encrypt) {
+    memcpy(name, ticket_key, 16);
+    if (RAND_bytes(iv, EVP_CIPHER_get_iv_length(EVP_aes_256_cbc())) <= 0
+      || EVP_EncryptInit_ex(cipher, EVP_aes_256_cbc(), NULL, ticket_key + 48, iv) != 1)
+      return -1;
+  } else {
+    if (memcmp(name, ticket_key, 16) != 0)
+      return 0;
+    if (EVP_DecryptInit_ex(cipher, EVP_aes_256_cbc(), NULL, ticket_key + 48, iv) != 1)
+      return -1;
+  }
+
+  if (EVP_MAC_init(hmac, ticket_key + 16, 32, params) != 1)
+    return -1;
+  return 1;
+}
+
+static int
+http_tls_ticket_key_load(const char *path)
+{
+  ssize_t bytes_read;
+  int fd;
+
+  if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+    return -1;
+  bytes_read = read(fd, ticket_key, sizeof(ticket_key));
+  close(fd);
+
+  return bytes_read == sizeof(ticket_key) ? 0 : -1;
+}
+
+int
+http_tls_init(const char *cert, const char *key, const char *ticket_key_path)
+{
+  // http_tls_init():
+  // Create the server context. Called before fork(), so both listening
+  // processes share the ticket keys OpenSSL generates when no
+  // `ticket_key_path` is given.
+
+  struct rlimit limit;
+
+  if (getrlimit(RLIMIT_NOFILE, &limit) == -1)
+    return -1;
+  sessions_max = limit.rlim_cur;
+  if ((sessions = calloc(sessions_max, sizeof(*sessions))) == NULL)
+    return -1;
+
+  if ((context = SSL_CTX_new(TLS_server_method())) == NULL)
+    return -1;
+
+  SSL_CTX_set_min_proto_version(context, TLS1_2_VERSION);
+  SSL_CTX_set_options(context, SSL_OP_ENABLE_KTLS | SSL_OP_CIPHER_SERVER_PREFERENCE | SSL_OP_NO_RENEGOTIATION);
+  SSL_CTX_set_alpn_select_cb(context, http_tls_alpn, NULL);
+
+  // Stateless tickets only, a server side session cache would be per
+  // process and lost on restart
+  SSL_CTX_set_session_cache_mode(context, SSL_SESS_CACHE_OFF);
+  SSL_CTX_set_timeout(context, HTTP_TLS_TICKET_LIFETIME);
+
+  if (ticket_key_path != NULL && ticket_key_path[0] != '\0'
+    && (http_tls_ticket_key_load(ticket_key_path) != 0
+      || SSL_CTX_set_tlsext_ticket_key_evp_cb(context, http_tls_ticket) != 1))
+    return -1;
+
+  if (SSL_CTX_use_certificate_chain_file(context, cert) != 1
+    || SSL_CTX_use_PrivateKey_file(context, key, SSL_FILETYPE_PEM) != 1
+    || SSL_CTX_check_private_key(context) != 1) {
+    logger(LOGL_ERROR, NULL, ERR_error_string(ERR_get_error(), NULL));
+    return -1;
+  }
+
+  return 0;
+}
+
+int
+http_tls_enabled()
+{
+  return context != NULL;
+}
+
+int
+http_tls_accept(int socketfd)
+{
+  // http_tls_accept():
+  // Take the server handshake on `socketfd` as far as it goes without
+  // blocking. A client speaking plain HTTP is told so with a 497
+  // response. Returns 0 once the connection is ready, -1 if it should be
+  // closed, or the poll() events to wait for before calling again.
+
+  http_tls_session_t *session;
+  ssize_t peeked;
+  char first;
+  int flags, result;
+
+  if ((size_t)socketfd >= sessions_max)
+    return -1;
+  session = &sessions[socketfd];
+
+  if (session->ssl == NULL) {
+    // A TLS connection starts with a handshake record, plain HTTP with a
+    // method name
+    peeked = recv(socketfd, &first, 1, MSG_PEEK | MSG_DONTWAIT);
+    if (peeked == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+      return POLLIN;
+    if (peeked != 1)
+      return -1;
+    if (first >= 'A' && first <= 'Z') {
+      http_send_error(socketfd, ERROR_HTTP_REQUEST_SENT_TO_HTTPS_PORT, NULL, NULL);
+      return -1;
+    }
+
+    if ((flags = fcntl(socketfd, F_GETFL)) == -1 || fcntl(socketfd, F_SETFL, flags | O_NONBLOCK) == -1)
+      return -1;
+    if ((session->ssl = SSL_new(context)) == NULL)
+      return -1;
+    if (SSL_set_fd(session->ssl, socketfd) != 1)
+      return -1;
+  }
+
+  ERR_clear_error();
+  if ((result = SSL_accept(session->ssl)) != 1) {
+    switch (SSL_get_error(session->ssl, result)) {
+    case SSL_ERROR_WANT_READ:
+      return POLLIN;
+    case SSL_ERROR_WANT_WRITE:
+      return POLLOUT;
+    default:
+      logger(LOGL_INFO, NULL, "TLS handshake failed");
+      return -1;
+    }
+  }
+
+  if ((flags = fcntl(socketfd, F_GETFL)) == -1 || fcntl(socketfd, F_SETFL, flags & ~O_NONBLOCK) == -1)
+    return -1;
+  session->ready = 1;
+  session->ktls_send = BIO_get_ktls_send(SSL_get_wbio(session->ssl));
+  session->ktls_recv = BIO_get_ktls_recv(SSL_get_rbio(session->ssl));
+
+  return 0;
+}
+
+void
+http_tls_close(int socketfd)
+{
+  http_tls_session_t *session;
+
+  if (sessions == NULL || (size_t)socketfd >= sessions_max || sessions[socketfd].ssl == NULL)
+    return;
+
+  session = &sessions[socketfd];
+  // There is nothing to shut down before the handshake is done
+  if (session->ready)
+    SSL_shutdown(session->ssl);
+  SSL_free(session->ssl);
+  memset(session, 0, sizeof(*session));
+}
+
+static http_tls_session_t *
+http_tls_session(int socketfd)
+{
+  // The session records must go through, NULL if the socket can be used
+  // directly
+  if (sessions == NULL || (size_t)socketfd >= sessions_max || sessions[socketfd].ssl == NULL)
+    return NULL;
+  return &sessions[socketfd];
+}
+
+static ssize_t
+http_tls_result(SSL *ssl, int result)
+{
+  // Map an SSL_read()/SSL_write() result to the read()/write() convention
+  if (result > 0)
+    return result;
+
+  switch (SSL_get_error(ssl, result)) {
+  case SSL_ERROR_ZERO_RETURN:
+    return 0;
+  case SSL_ERROR_WANT_READ:
+  case SSL_ERROR_WANT_WRITE:
+    // The socket timed out
+    errno = EAGAIN;
+    return -1;
+  case SSL_ERROR_SYSCALL:
+    if (errno == 0)
+      errno = ECONNRESET;
+    return -1;
+  default:
+    errno = EPROTO;
+    return -1;
+  }
+}
+
+int
+http_tls_kernel(int socketfd)
+{
+  // Whether plaintext written to the socket directly, with splice() for
+  // example, reaches the peer
+  http_tls_session_t *session = http_tls_session(socketfd);
+  return session == NULL || session->ktls_send;
+}
+
+int
+http_tls_pending(int socketfd)
+{
+  // Records already decrypted in user space do not make the socket
+  // readable
+  http_tls_session_t *session = http_tls_session(socketfd);
+  return session != NULL && !session->ktls_recv && SSL_pending(session->ssl) > 0;
+}
+
+ssize_t
+http_tls_read(int socketfd, void *buffer, size_t len)
+{
+  http_tls_session_t *session = http_tls_session(socketfd);
+
+  if (session == NULL || session->ktls_recv)
+    return read(socketfd, buffer, len);
+
+  ERR_clear_error();
+  return http_tls_result(session->ssl, SSL_read(session->ssl, buffer, len > INT32_MAX ? INT32_MAX : len));
+}
+
+ssize_t
+http_tls_writev(int socketfd, const struct iovec *iov, int iovcnt)
+{
+  // Without kernel TLS, gather the vector into full records: one
+  // SSL_write() per vector element would send a record per header block
+  char record[HTTP_TLS_RECORD_MAX];
+  http_tls_session_t *session = http_tls_session(socketfd);
+  size_t record_len = 0, done = 0, len;
+  ssize_t result;
+
+  if (session == NULL || session->ktls_send)
+    return writev(socketfd, iov, iovcnt);
+
+  for (int i = 0; i < iovcnt; i++) {
+    for (size_t copied = 0; copied < iov[i].iov_len; copied += len) {
+      len = iov[i].iov_len - copied;
+      if (len > sizeof(record) - record_len)
+        len = sizeof(record) - record_len;
+      memcpy(record + record_len, (const char *)iov[i].iov_base + copied, len);
+      record_len += len;
+
+      if (record_len == sizeof(record) || (i == iovcnt - 1 && copied + len == iov[i].iov_len)) {
+        ERR_clear_error();
+        if ((result = http_tls_result(session->ssl, SSL_write(session->ssl, record, record_len))) <= 0)
+          return done > 0 ? (ssize_t)done : -1;
+        done += record_len;
+        record_len = 0;
+      }
+    }
+  }
+
+  return done;
+}
+
+ssize_t
+http_tls_sendfile(int socketfd, int fd, off_t *offset, size_t len)
+{
+  char record[HTTP_TLS_RECORD_MAX];
+  http_tls_session_t *session = http_tls_session(socketfd);
+  ssize_t bytes_read;
+
+  if (session == NULL || session->ktls_send)
+    return sendfile(socketfd, fd, offset, len);
+
+  if ((bytes_read = pread(fd, record, len < sizeof(record) ? len : sizeof(record), *offset)) <= 0)
+    return bytes_read;
+
+  ERR_clear_error();
+  if (http_tls_result(session->ssl, SSL_write(session->ssl, record, bytes_read)) <= 0)
+    return -1;
+
+  *offset += bytes_read;
+  return bytes_read;
+}
+
+#else
+
+int
+http_tls_init(const char *cert, const char *key, const char *ticket_key)
+{
+  (void)cert;
+  (void)key;
+  (void)ticket_key;
+
+  errno = ENOTSUP;
+  return -1;
+}
+
+int
+http_tls_enabled()
+{
+  return 0;
+}
+
+int
+http_tls_accept(int socketfd)
+{
+  (void)socketfd;
+  return -1;
+}
+
+void
+http_tls_close(int socketfd)
+{
+  (void)socketfd;
+}
+
+int
+http_tls_kernel(int socketfd)
+{
+  (void)socketfd;
+  return 1;
+}
+
+int
+http_tls_pending(int socketfd)
+{
+  (void)socketfd;
+  return 0;
+}
+
+ssize_t
+http_tls_read(int socketfd, void *buffer, size_t len)
+{
+  return read(socketfd, buffer, len);
+}
+
+ssize_t
+http_tls_writev(int socketfd, const struct iovec *iov, int iovcnt)
+{
+  return writev(socketfd, iov, iovcnt);
+}
+
+ssize_t
+http_tls_sendfile(int socketfd, int fd, off_t *offset, size_t len)
+{
+  return sendfile(socketfd, fd, offset, len);
+}
+
+#endif
@@ -0,0 +1,29 @@
+// SPDX-License-Identifier: MIT
+
+#ifndef _HTTP_TLS
+#define _HTTP_TLS
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+// Plaintext is sent and received in records of at most this size
+#define HTTP_TLS_RECORD_MAX 16384
+
+// --tls-ticket-key file: 16 bytes key name, 32 bytes HMAC key and
+// 32 bytes AES-256 key
+#define HTTP_TLS_TICKET_KEY_SIZE 80
+
+// Seconds a session ticket allows resumption
+#define HTTP_TLS_TICKET_LIFETIME 3600
+
+int http_tls_init(const char *cert, const char *key, const char *ticket_key);
+int http_tls_enabled();
+int http_tls_accept(int socketfd);
+void http_tls_close(int socketfd);
+int http_tls_kernel(int socketfd);
+int http_tls_pending(int socketfd);
+ssize_t http_tls_read(int socketfd, void *buffer, size_t len);
+ssize_t http_tls_writev(int socketfd, const struct iovec *iov, int iovcnt);
+ssize_t http_tls_sendfile(int socketfd, int fd, off_t *offset, size_t len);
+
+#endif
@@ -0,0 +1,43 @@
+// SPDX-License-Identifier: MIT
+
+#ifndef _HTTP_TRACE
+#define _HTTP_TRACE
+
+#include <stdint.h>
+
+// Static tracepoints (USDT)
+//
+// With <sys/sdt.h> at build time every HTTP_TRACE() is a single nop in
+// the binary plus a note in .note.stapsdt, and costs nothing until a
+// tracer attaches to it. Without it they compile to nothing.
+//
+// Provider "wsfs", the first argument is always the connection id:
+//
+//   accept(conn, fd)                   connection accepted
+//   read(conn, bytes)                  request bytes received
+//   parse(conn, method, path, bytes)   request head parsed, `bytes` long
+//   cache_hit(conn, key, bytes)        response cache hit
+//   cache_miss(conn, key)              response cache miss
+//   response(conn, status, bytes)      response head composed, `bytes`
+//                                      of body follow, -1 if unknown
+//   sendfile(conn, fd, bytes)          file range sent
+//   zerocopy(conn, bytes)              cached body sent with MSG_ZEROCOPY
+//   close(conn)                        connection closed
+//
+// For example, time from accept to the first response:
+//
+//   bpftrace -e 'usdt:./wsfs:wsfs:accept { @start[arg0] = nsecs }
+//     usdt:./wsfs:wsfs:response /@start[arg0]/ {
+//       @ms = hist((nsecs - @start[arg0]) / 1000000); delete(@start[arg0]) }'
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define HTTP_TRACE(...) STAP_PROBEV(wsfs, __VA_ARGS__)
+#else
+#define HTTP_TRACE(...) do { } while (0)
+#endif
+
+// Id of the connection the calling worker is serving
+extern __thread uint64_t http_trace_connection;
+
+#endif
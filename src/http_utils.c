@@ -1,14 +1,29 @@
 // SPDX-License-Identifier: MIT
 
+#include <config.h>
+#include <errno.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "http_buffer.h"
 #include "http_core.h"
+#include "http_tls.h"
+#include "http_trace.h"
+#include "http_utils.h"
+#include "log_levels.h"
+#include "logger.h"
 #include "wsfs_core.h"
 
+__thread uint64_t http_trace_connection;
+long http_request_timeout = HTTP_REQUEST_TIMEOUT_DEFAULT;
+
 static int
 check(int exp, const char *msg)
 {
@@ -20,10 +35,86 @@ check(int exp, const char *msg)
   return exp;
 }
 
+static int64_t
+http_monotonic_ms()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
 int
-http_fill_request_buffer(char *buffer, size_t size, ssize_t msgsize, int socketfd)
+http_fill_request_buffer(char *buffer, size_t size, ssize_t msgsize, int socketfd, int64_t deadline)
 {
-  return 0;
+  // http_fill_request_buffer():
+  // Read from `socketfd` into `buffer` until the end of the header section
+  // ("\r\n\r\n") is received. `msgsize` bytes are already in the buffer.
+  // The rest has to arrive by `deadline`, in CLOCK_MONOTONIC milliseconds.
+  //
+  // Returns the number of bytes in the buffer, 0 if the peer closed the
+  // connection before sending a full header section, -1 on read error or
+  // timeout and -2 if the header section does not fit into `size` - 1
+  // bytes.
+
+  struct pollfd pollfd = { .fd = socketfd, .events = POLLIN };
+  ssize_t bytes_read;
+  ssize_t scanned = 0;
+  int64_t remaining;
+  int ready;
+
+  while (1) {
+    buffer[msgsize] = '\0';
+    // Bounded by `msgsize`, a NUL byte from the client must not hide it
+    if (memmem(buffer + scanned, msgsize - scanned, "\r\n\r\n", 4) != NULL)
+      return msgsize;
+
+    if ((size_t)msgsize >= size - 1)
+      return -2;
+
+    // The terminator may straddle two reads
+    scanned = msgsize > 3 ? msgsize - 3 : 0;
+
+    // A head sent a byte at a time must not restart the socket's
+    // receive timeout with each of them
+    if (msgsize > 0 && !http_tls_pending(socketfd)) {
+      if ((remaining = deadline - http_monotonic_ms()) <= 0)
+        return -1;
+      if ((ready = poll(&pollfd, 1, remaining)) == -1 && errno == EINTR)
+        continue;
+      if (ready <= 0)
+        return -1;
+    }
+
+    bytes_read = http_tls_read(socketfd, buffer + msgsize, size - msgsize - 1);
+    if (bytes_read == -1 && errno == EINTR)
+      continue;
+    // A timed out idle connection is not an error worth reporting
+    if (bytes_read == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return -1;
+    if (bytes_read <= 0)
+      return check(bytes_read, "read error\n");
+
+    HTTP_TRACE(read, http_trace_connection, bytes_read);
+    msgsize += bytes_read;
+  }
+}
+
+static http_method_t
+http_method_get(const char *method)
+{
+  if (strcmp(method, HTTP_METHOD_GET_STR) == 0)
+    return HTTP_METHOD_GET;
+  if (strcmp(method, HTTP_METHOD_HEAD_STR) == 0)
+    return HTTP_METHOD_HEAD;
+  if (strcmp(method, HTTP_METHOD_POST_STR) == 0)
+    return HTTP_METHOD_POST;
+  if (strcmp(method, HTTP_METHOD_PUT_STR) == 0)
+    return HTTP_METHOD_PUT;
+  if (strcmp(method, HTTP_METHOD_DELETE_STR) == 0)
+    return HTTP_METHOD_DELETE;
+  if (strcmp(method, HTTP_METHOD_OPTIONS_STR) == 0)
+    return HTTP_METHOD_OPTIONS;
+  return HTTP_METHOD_UNKNOWN;
 }
 
 int
@@ -33,6 +124,16 @@ http_parse_request(http_request_t *out, int socketfd)
   // Read data stream from `socketfd` and define a `http_request_t` at `out` location.
   //
   // Caller is expected to allocate and free memory pointed to by `out` pointer.
+  //
+  // The request line and header fields are split in place inside `out->raw`,
+  // so `out->path` and every header name/value are NUL terminated strings
+  // that live as long as `out` does.
+  //
+  // `out->raw_len` bytes already in `out->raw` (the rest of a pipelined
+  // read) are parsed before anything else is read from the socket.
+  //
+  // Returns 0 on success, -1 if the connection should be closed without
+  // a response, or an HTTP status code to answer the client with.
 
   if (out == NULL) {
     // TODO: use logging function. It is a critical server error.
@@ -48,40 +149,383 @@ http_parse_request(http_request_t *out, int socketfd)
     return -1;
   }
 
-  const size_t buffer_max = 4096;
+  out->headers.headers = out->header_list;
+  out->headers.header_count = 0;
+  out->body.string = NULL;
+  out->body.len = 0;
+  out->keep_alive = 0;
 
-  char buffer[buffer_max];
+  if (out->raw == NULL) {
+    if ((out->raw = http_buffer_get(HTTP_BUFFER_SMALL)) == NULL)
+      return CRIT_INTERNAL_SERVER_ERROR;
+    out->raw_size = HTTP_BUFFER_SMALL;
+  }
 
-  int msgsize = 0;
-  ssize_t bytes_read;
+  // The head is due `http_request_timeout` seconds after the worker
+  // found it starting to arrive
+  int64_t deadline = http_monotonic_ms() + http_request_timeout * 1000;
+  int msgsize = http_fill_request_buffer(out->raw, out->raw_size, out->raw_len, socketfd, deadline);
+
+  // Oversized header sections continue in a large buffer
+  if (msgsize == -2 && out->raw_size == HTTP_BUFFER_SMALL) {
+    char *large = http_buffer_get(HTTP_BUFFER_LARGE);
+    if (large == NULL)
+      return CRIT_INTERNAL_SERVER_ERROR;
+    memcpy(large, out->raw, out->raw_size);
+    http_buffer_put(out->raw, out->raw_size);
+    out->raw = large;
+    out->raw_size = HTTP_BUFFER_LARGE;
+    msgsize = http_fill_request_buffer(out->raw, out->raw_size, HTTP_BUFFER_SMALL - 1, socketfd, deadline);
+  }
 
-  int i = 0;
-  while ((bytes_read = read(socketfd, buffer + msgsize, sizeof(buffer) - msgsize - 1)) > 0) {
-    msgsize += bytes_read;
-    if (msgsize > buffer_max - 1 || buffer[msgsize - 1] == '\n')
-      break;
+  if (msgsize == -2)
+    return ERROR_REQUEST_HEADER_FIELDS_TOO_LARGE;
+  if (msgsize <= 0)
+    return -1;
+  out->raw_len = msgsize;
+  out->header_len = (char *)memmem(out->raw, msgsize, "\r\n\r\n", 4) + 4 - out->raw;
+
+  // The head is split with string functions below
+  if (memchr(out->raw, '\0', out->header_len) != NULL)
+    return ERROR_BAD_REQUEST;
+
+  logger(LOGL_DEBUG, NULL, out->raw);
+
+  // Request line: method SP request-target SP HTTP-version CRLF
+  char *line = out->raw;
+  char *line_end = strstr(line, "\r\n");
+  if (line_end == NULL)
+    return ERROR_BAD_REQUEST;
+  *line_end = '\0';
+
+  char *method = line;
+  char *path = strchr(method, ' ');
+  if (path == NULL)
+    return ERROR_BAD_REQUEST;
+  *path++ = '\0';
+
+  char *version = strchr(path, ' ');
+  if (version == NULL)
+    return ERROR_BAD_REQUEST;
+  *version++ = '\0';
+
+  out->method = http_method_get(method);
+  out->method_name.string = method;
+  out->method_name.len = path - method - 1;
+
+  if (strcmp(version, HTTP11_STR) == 0)
+    out->version = HTTP11;
+  else if (strcmp(version, HTTP10_STR) == 0)
+    out->version = HTTP10;
+  else if (strncmp(version, "HTTP/", 5) == 0)
+    return CRIT_HTTP_VERSION_NOT_SUPPORTED;
+  else
+    return ERROR_BAD_REQUEST;
+
+  if (path[0] != '/')
+    return ERROR_BAD_REQUEST;
+
+  // Query and fragment are not part of the resource path
+  char *query = path + strcspn(path, "?#");
+  if (*query == '?') {
+    *query++ = '\0';
+    query[strcspn(query, "#")] = '\0';
+  } else
+    *query = '\0';
+  out->query.string = query;
+  out->query.len = strlen(query);
+  out->path.string = path;
+  out->path.len = strlen(path);
+
+  if (out->path.len >= HTTP_PATH_MAX)
+    return ERROR_URI_TOO_LONG;
+
+  // Header fields: field-name ":" OWS field-value OWS CRLF
+  line = line_end + 2;
+  while ((line_end = strstr(line, "\r\n")) != NULL && line_end != line) {
+    *line_end = '\0';
+
+    char *value = strchr(line, ':');
+    if (value == NULL || value == line)
+      return ERROR_BAD_REQUEST;
+    size_t name_len = value - line;
+    *value++ = '\0';
+
+    while (*value == ' ' || *value == '\t')
+      value++;
+
+    char *value_end = line_end;
+    while (value_end > value && (value_end[-1] == ' ' || value_end[-1] == '\t'))
+      *--value_end = '\0';
+
+    if (out->headers.header_count == HTTP_HEADERS_MAX)
+      return ERROR_REQUEST_HEADER_FIELDS_TOO_LARGE;
+
+    http_header_t *header = &out->header_list[out->headers.header_count++];
+    header->name.string = line;
+    header->name.len = name_len;
+    header->value.string = value;
+    header->value.len = value_end - value;
+
+    line = line_end + 2;
   }
+  if (line_end == NULL)
+    return ERROR_BAD_REQUEST;
+
+  // Request bodies are never read, so only a request without one can be
+  // followed by another on the same connection
+  const char *connection = http_header_get(out, "Connection");
+  const char *content_length = http_header_get(out, "Content-Length");
+  if (out->version == HTTP11)
+    out->keep_alive = connection == NULL || strcasestr(connection, "close") == NULL;
+  else
+    out->keep_alive = connection != NULL && strcasestr(connection, "keep-alive") != NULL;
+  if ((content_length != NULL && strcmp(content_length, "0") != 0)
+    || http_header_get(out, "Transfer-Encoding") != NULL)
+    out->keep_alive = 0;
+
+  HTTP_TRACE(parse, http_trace_connection, out->method_name.string, out->path.string, out->header_len);
+  return 0;
+}
 
-  check(bytes_read, "read error\n");
+void
+http_request_release(http_request_t *request)
+{
+  // http_request_release():
+  // Return the buffer of an idle connection to the pool. Bytes the client
+  // already pipelined keep it borrowed.
+
+  if (request->raw == NULL || request->raw_len > 0)
+    return;
+  http_buffer_put(request->raw, request->raw_size);
+  request->raw = NULL;
+}
+
+const char *
+http_header_get(const http_request_t *request, const char *name)
+{
+  // Field values are NUL terminated in place, so they double as C strings
+  wsfs_str_t key = wsfs_str_from(name);
 
-  printf("%s\n", buffer);
+  for (size_t i = 0; i < request->headers.header_count; i++)
+    if (wsfs_str_case_eq(request->headers.headers[i].name, key))
+      return request->headers.headers[i].value.string;
+  return NULL;
+}
+
+int
+http_date_format(char *out, size_t size, time_t time)
+{
+  // IMF-fixdate, e.g. "Sun, 06 Nov 1994 08:49:37 GMT" (RFC 9110 5.6.7)
+  struct tm tm;
+  if (gmtime_r(&time, &tm) == NULL)
+    return -1;
+  if (strftime(out, size, "%a, %d %b %Y %H:%M:%S GMT", &tm) == 0)
+    return -1;
   return 0;
 }
 
+wsfs_str_t
+http_date_header()
+{
+  // http_date_header():
+  // The "Date: ...\r\n" field of a response sent now. Each thread formats
+  // it once a second and hands out the same line in between, so it needs
+  // no synchronization.
+
+  static __thread char line[HTTP_DATE_MAX + 8];
+  static __thread size_t line_len;
+  static __thread time_t formatted;
+  time_t now = time(NULL);
+
+  if (now != formatted || line_len == 0) {
+    memcpy(line, "Date: ", 6);
+    if (http_date_format(line + 6, HTTP_DATE_MAX, now) != 0)
+      return (wsfs_str_t) { .len = 0, .string = "" };
+    line_len = strlen(line);
+    memcpy(line + line_len, "\r\n", 2);
+    line_len += 2;
+    formatted = now;
+  }
+
+  return (wsfs_str_t) { .len = line_len, .string = line };
+}
+
 int
-http_construct_response(http_response_t *out, http_request_t *request)
+http_date_parse(const char *date, time_t *out)
 {
-  return -1;
+  // Only IMF-fixdate is accepted. Obsolete formats are treated as invalid,
+  // which makes every conditional that uses them evaluate as false.
+  struct tm tm;
+  memset(&tm, 0, sizeof(tm));
+
+  const char *end = strptime(date, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+  if (end == NULL || *end != '\0')
+    return -1;
+
+  *out = timegm(&tm);
+  return 0;
 }
 
 int
-http_cache_set(http_response_t *response)
+http_status_line_format(char *out, size_t size, http_status_code_t status)
 {
-  return -1;
+  wsfs_str_t status_string;
+  int length;
+
+  if (http_status_string_get(&status_string, status) != 0)
+    return -1;
+
+  length = snprintf(out, size, "%s %d %.*s\r\n", HTTP11_STR, status, (int)status_string.len, status_string.string);
+
+  if (length < 0 || (size_t)length >= size)
+    return -1;
+  return length;
+}
+
+static int
+http_writev_all(int socketfd, struct iovec *iov, int iovcnt)
+{
+  ssize_t bytes_written;
+
+  while (iovcnt > 0) {
+    bytes_written = http_tls_writev(socketfd, iov, iovcnt);
+    if (bytes_written == -1 && errno == EINTR)
+      continue;
+    if (bytes_written <= 0)
+      return -1;
+
+    while (iovcnt > 0 && (size_t)bytes_written >= iov->iov_len) {
+      bytes_written -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+
+    if (iovcnt > 0) {
+      iov->iov_base = (char *)iov->iov_base + bytes_written;
+      iov->iov_len -= bytes_written;
+    }
+  }
+
+  return 0;
+}
+
+static int
+http_sendfile_all(int socketfd, int fd, off_t offset, size_t len)
+{
+  ssize_t bytes_sent;
+
+  while (len > 0) {
+    bytes_sent = http_tls_sendfile(socketfd, fd, &offset, len);
+    if (bytes_sent == -1 && errno == EINTR)
+      continue;
+    // 0 means the file got shorter than we announced
+    if (bytes_sent <= 0)
+      return -1;
+    len -= bytes_sent;
+  }
+
+  return 0;
 }
 
 int
-http_cache_get(http_response_t *response)
+http_send_segments(int socketfd, const http_segment_t *segments, size_t count)
+{
+  // http_send_segments():
+  // Send `segments` in order. Consecutive memory segments are gathered into
+  // one writev() call, file segments are sent with sendfile() from their
+  // offset so file data never passes through user space.
+
+  struct iovec iov[HTTP_SEGMENTS_MAX];
+  int iovcnt = 0;
+
+  for (size_t i = 0; i < count; i++) {
+    if (segments[i].fd == -1) {
+      if (segments[i].len == 0)
+        continue;
+      if (iovcnt == HTTP_SEGMENTS_MAX) {
+        if (http_writev_all(socketfd, iov, iovcnt) != 0)
+          return -1;
+        iovcnt = 0;
+      }
+      iov[iovcnt].iov_base = (void *)segments[i].data;
+      iov[iovcnt].iov_len = segments[i].len;
+      iovcnt++;
+      continue;
+    }
+
+    if (iovcnt > 0) {
+      if (http_writev_all(socketfd, iov, iovcnt) != 0)
+        return -1;
+      iovcnt = 0;
+    }
+
+    if (http_sendfile_all(socketfd, segments[i].fd, segments[i].offset, segments[i].len) != 0)
+      return -1;
+    HTTP_TRACE(sendfile, http_trace_connection, segments[i].fd, segments[i].len);
+  }
+
+  if (iovcnt > 0)
+    return http_writev_all(socketfd, iov, iovcnt);
+  return 0;
+}
+
+const char *
+http_connection_header(const http_request_t *request)
+{
+  if (request != NULL && request->keep_alive)
+    return "Connection: keep-alive\r\n";
+  return "Connection: close\r\n";
+}
+
+int
+http_send_error(int socketfd, http_status_code_t status, const char *extra_headers, const http_request_t *request)
+{
+  // http_send_error():
+  // Send a complete response with a short text/plain body describing
+  // `status`. `extra_headers` (may be NULL) must be a block of
+  // CRLF-terminated header fields. `request` is NULL if the request could
+  // not be parsed, in which case the connection is closed.
+
+  char status_line[HTTP_STATUS_STRING_LENGTH_MAX];
+  char headers[HTTP_RESPONSE_HEADERS_MAX];
+  char body[HTTP_STATUS_STRING_LENGTH_MAX];
+  wsfs_str_t date = http_date_header();
+  int status_line_len, headers_len, body_len;
+  int head_only = request != NULL && request->method == HTTP_METHOD_HEAD;
+
+  status_line_len = http_status_line_format(status_line, sizeof(status_line), status);
+  if (status_line_len < 0)
+    return -1;
+
+  // Status line without "HTTP/1.1 " and CRLF doubles as the body
+  body_len = snprintf(body, sizeof(body), "%.*s\n", status_line_len - 11, status_line + 9);
+
+  headers_len = snprintf(headers, sizeof(headers),
+    "%s"
+    "%.*s"
+    "Server: " PACKAGE_STRING "\r\n"
+    "Content-Type: text/plain\r\n"
+    "Content-Length: %d\r\n"
+    "%s"
+    "%s"
+    "\r\n",
+    status_line, (int)date.len, date.string, body_len, http_connection_header(request), extra_headers != NULL ? extra_headers : "");
+  if (headers_len < 0 || (size_t)headers_len >= sizeof(headers))
+    return -1;
+
+  http_segment_t segments[] = {
+    { .fd = -1, .data = headers, .len = headers_len },
+    { .fd = -1, .data = body, .len = head_only ? 0 : body_len },
+  };
+
+  HTTP_TRACE(response, http_trace_connection, status, segments[1].len);
+
+  return http_send_segments(socketfd, segments, 2);
+}
+
+int
+http_construct_response(http_response_t *out, http_request_t *request)
 {
   return -1;
 }
@@ -96,23 +540,9 @@ http_status_bsearch(wsfs_str_t *out, const http_status_code_t *key, const http_s
 
   while (left <= right) {
     middle = (left + right) / 2;
-    printf("middle: %ld", middle);
 
     if (list[middle].code == *key) {
-      size_t desired_size = strlen(list[middle].code_string.string);
-
-      if (desired_size >= out->len)
-      {
-        if (out->string != NULL)
-          free(out->string);
-
-        out->string = (char*)malloc(desired_size + 1);
-      }
-
-      strncpy(out->string, list[middle].code_string.string, list[middle].code_string.len);
-      out->string[desired_size] = '\0';
-      out->len = desired_size;
-
+      *out = list[middle].code_string;
       return 0;
     }
 
@@ -130,113 +560,113 @@ http_status_string_get(wsfs_str_t *out, http_status_code_t status)
 {
   //! IMPORTANT
   //! This struct MUST BE ASCENDINGLY SORTED by .code
-  static http_status_t http_status_list[] = {
+  static const http_status_t http_status_list[] = {
     // Info 1xx
-    { INFO_CONTINUE, WSFS_STR_T_CHAR(INFO_CONTINUE_STRING) },
-    { INFO_SWITCH_PROTOCOLS, WSFS_STR_T_CHAR(INFO_SWITCH_PROTOCOLS_STRING) },
-    { INFO_PROCESSING, WSFS_STR_T_CHAR(INFO_PROCESSING_STRING) },
-    { INFO_EARLY_HINTS, WSFS_STR_T_CHAR(INFO_EARLY_HINTS_STRING) },
+    { INFO_CONTINUE, WSFS_STR(INFO_CONTINUE_STRING) },
+    { INFO_SWITCH_PROTOCOLS, WSFS_STR(INFO_SWITCH_PROTOCOLS_STRING) },
+    { INFO_PROCESSING, WSFS_STR(INFO_PROCESSING_STRING) },
+    { INFO_EARLY_HINTS, WSFS_STR(INFO_EARLY_HINTS_STRING) },
 
     // Success 2xx
-    { SUCCESS_OK, WSFS_STR_T_CHAR(SUCCESS_OK_STRING) },
-    { SUCCESS_CREATED, WSFS_STR_T_CHAR(SUCCESS_CREATED_STRING) },
-    { SUCCESS_ACCEPTED, WSFS_STR_T_CHAR(SUCCESS_ACCEPTED_STRING) },
-    { SUCCESS_NON_AUTHORITATIVE_INFORMATION, WSFS_STR_T_CHAR(SUCCESS_NON_AUTHORITATIVE_INFORMATION_STRING) },
-    { SUCCESS_NO_CONTENT, WSFS_STR_T_CHAR(SUCCESS_NO_CONTENT_STRING) },
-    { SUCCESS_RESET_CONTENT, WSFS_STR_T_CHAR(SUCCESS_RESET_CONTENT_STRING) },
-    { SUCCESS_PARTIAL_CONTENT, WSFS_STR_T_CHAR(SUCCESS_PARTIAL_CONTENT_STRING) },
-    { SUCCESS_MULTI_STATUS, WSFS_STR_T_CHAR(SUCCESS_MULTI_STATUS_STRING) },
-    { SUCCESS_ALREADY_REPORTED, WSFS_STR_T_CHAR(SUCCESS_ALREADY_REPORTED_STRING) },
-    { SUCCESS_THIS_IS_FINE, WSFS_STR_T_CHAR(SUCCESS_THIS_IS_FINE_STRING) },
-    { SUCCESS_IM_USED, WSFS_STR_T_CHAR(SUCCESS_IM_USED_STRING) },
+    { SUCCESS_OK, WSFS_STR(SUCCESS_OK_STRING) },
+    { SUCCESS_CREATED, WSFS_STR(SUCCESS_CREATED_STRING) },
+    { SUCCESS_ACCEPTED, WSFS_STR(SUCCESS_ACCEPTED_STRING) },
+    { SUCCESS_NON_AUTHORITATIVE_INFORMATION, WSFS_STR(SUCCESS_NON_AUTHORITATIVE_INFORMATION_STRING) },
+    { SUCCESS_NO_CONTENT, WSFS_STR(SUCCESS_NO_CONTENT_STRING) },
+    { SUCCESS_RESET_CONTENT, WSFS_STR(SUCCESS_RESET_CONTENT_STRING) },
+    { SUCCESS_PARTIAL_CONTENT, WSFS_STR(SUCCESS_PARTIAL_CONTENT_STRING) },
+    { SUCCESS_MULTI_STATUS, WSFS_STR(SUCCESS_MULTI_STATUS_STRING) },
+    { SUCCESS_ALREADY_REPORTED, WSFS_STR(SUCCESS_ALREADY_REPORTED_STRING) },
+    { SUCCESS_THIS_IS_FINE, WSFS_STR(SUCCESS_THIS_IS_FINE_STRING) },
+    { SUCCESS_IM_USED, WSFS_STR(SUCCESS_IM_USED_STRING) },
 
     // Redirect 3xx
-    { REDIRECT_MULTIPLE_CHOICES, WSFS_STR_T_CHAR(REDIRECT_MULTIPLE_CHOICES_STRING) },
-    { REDIRECT_MOVED_PERMANENTLY, WSFS_STR_T_CHAR(REDIRECT_MOVED_PERMANENTLY_STRING) },
-    { REDIRECT_FOUND, WSFS_STR_T_CHAR(REDIRECT_FOUND_STRING) },
-    { REDIRECT_SEE_OTHER, WSFS_STR_T_CHAR(REDIRECT_SEE_OTHER_STRING) },
-    { REDIRECT_NOT_MODIFIED, WSFS_STR_T_CHAR(REDIRECT_NOT_MODIFIED_STRING) },
-    { REDIRECT_USE_PROXY, WSFS_STR_T_CHAR(REDIRECT_USE_PROXY_STRING) },
-    { REDIRECT_SWITCH_PROXY, WSFS_STR_T_CHAR(REDIRECT_SWITCH_PROXY_STRING) },
-    { REDIRECT_TEMPORARY_REDIRECT, WSFS_STR_T_CHAR(REDIRECT_TEMPORARY_REDIRECT_STRING) },
-    { REDIRECT_PERMANENT_REDIRECT, WSFS_STR_T_CHAR(REDIRECT_PERMANENT_REDIRECT_STRING) },
+    { REDIRECT_MULTIPLE_CHOICES, WSFS_STR(REDIRECT_MULTIPLE_CHOICES_STRING) },
+    { REDIRECT_MOVED_PERMANENTLY, WSFS_STR(REDIRECT_MOVED_PERMANENTLY_STRING) },
+    { REDIRECT_FOUND, WSFS_STR(REDIRECT_FOUND_STRING) },
+    { REDIRECT_SEE_OTHER, WSFS_STR(REDIRECT_SEE_OTHER_STRING) },
+    { REDIRECT_NOT_MODIFIED, WSFS_STR(REDIRECT_NOT_MODIFIED_STRING) },
+    { REDIRECT_USE_PROXY, WSFS_STR(REDIRECT_USE_PROXY_STRING) },
+    { REDIRECT_SWITCH_PROXY, WSFS_STR(REDIRECT_SWITCH_PROXY_STRING) },
+    { REDIRECT_TEMPORARY_REDIRECT, WSFS_STR(REDIRECT_TEMPORARY_REDIRECT_STRING) },
+    { REDIRECT_PERMANENT_REDIRECT, WSFS_STR(REDIRECT_PERMANENT_REDIRECT_STRING) },
 
     // Error 4xx
-    { ERROR_BAD_REQUEST, WSFS_STR_T_CHAR(ERROR_BAD_REQUEST_STRING) },
-    { ERROR_UNAUTHORIZED, WSFS_STR_T_CHAR(ERROR_UNAUTHORIZED_STRING) },
-    { ERROR_PAYMENT_REQUIRED, WSFS_STR_T_CHAR(ERROR_PAYMENT_REQUIRED_STRING) },
-    { ERROR_FORBIDDEN, WSFS_STR_T_CHAR(ERROR_FORBIDDEN_STRING) },
-    { ERROR_NOT_FOUND, WSFS_STR_T_CHAR(ERROR_NOT_FOUND_STRING) },
-    { ERROR_METHOD_NOT_ALLOWED, WSFS_STR_T_CHAR(ERROR_METHOD_NOT_ALLOWED_STRING) },
-    { ERROR_NOT_ACCEPTABLE, WSFS_STR_T_CHAR(ERROR_NOT_ACCEPTABLE_STRING) },
-    { ERROR_PROXY_AUTHENTICATION_REQUIRED, WSFS_STR_T_CHAR(ERROR_PROXY_AUTHENTICATION_REQUIRED_STRING) },
-    { ERROR_REQUEST_TIMEOUT, WSFS_STR_T_CHAR(ERROR_REQUEST_TIMEOUT_STRING) },
-    { ERROR_CONFLICT, WSFS_STR_T_CHAR(ERROR_CONFLICT_STRING) },
-    { ERROR_GONE, WSFS_STR_T_CHAR(ERROR_GONE_STRING) },
-    { ERROR_LENGTH_REQUIRED, WSFS_STR_T_CHAR(ERROR_LENGTH_REQUIRED_STRING) },
-    { ERROR_PRECONDITION_FAILED, WSFS_STR_T_CHAR(ERROR_PRECONDITION_FAILED_STRING) },
-    { ERROR_PAYLOAD_TOO_LARGE, WSFS_STR_T_CHAR(ERROR_PAYLOAD_TOO_LARGE_STRING) },
-    { ERROR_URI_TOO_LONG, WSFS_STR_T_CHAR(ERROR_URI_TOO_LONG_STRING) },
-    { ERROR_UNSUPPORTED_MEDIA_TYPE, WSFS_STR_T_CHAR(ERROR_UNSUPPORTED_MEDIA_TYPE_STRING) },
-    { ERROR_RANGE_NOT_SATISFIABLE, WSFS_STR_T_CHAR(ERROR_RANGE_NOT_SATISFIABLE_STRING) },
-    { ERROR_EXPECTATION_FAILED, WSFS_STR_T_CHAR(ERROR_EXPECTATION_FAILED_STRING) },
-    { ERROR_IM_A_TEAPOT, WSFS_STR_T_CHAR(ERROR_IM_A_TEAPOT_STRING) },
-    { ERROR_PAGE_EXPIRED, WSFS_STR_T_CHAR(ERROR_PAGE_EXPIRED_STRING) },
-    { ERROR_METHOD_FAILURE_OR_ENHANCE_YOUR_CALM, WSFS_STR_T_CHAR(ERROR_METHOD_FAILURE_OR_ENHANCE_YOUR_CALM_STRING) },
-    { ERROR_MISDIRECTED_REQUEST, WSFS_STR_T_CHAR(ERROR_MISDIRECTED_REQUEST_STRING) },
-    { ERROR_UNPROCESSABLE_ENTITY, WSFS_STR_T_CHAR(ERROR_UNPROCESSABLE_ENTITY_STRING) },
-    { ERROR_LOCKED, WSFS_STR_T_CHAR(ERROR_LOCKED_STRING) },
-    { ERROR_FAILED_DEPENDENCY, WSFS_STR_T_CHAR(ERROR_FAILED_DEPENDENCY_STRING) },
-    { ERROR_TOO_EARLY, WSFS_STR_T_CHAR(ERROR_TOO_EARLY_STRING) },
-    { ERROR_UPGRADE_REQUIRED, WSFS_STR_T_CHAR(ERROR_UPGRADE_REQUIRED_STRING) },
-    { ERROR_PRECONDITION_REQUIRED, WSFS_STR_T_CHAR(ERROR_PRECONDITION_REQUIRED_STRING) },
-    { ERROR_TOO_MANY_REQUESTS, WSFS_STR_T_CHAR(ERROR_TOO_MANY_REQUESTS_STRING) },
-    { ERROR_HTTP_STATUS_CODE, WSFS_STR_T_CHAR(ERROR_HTTP_STATUS_CODE_STRING) },
-    { ERROR_REQUEST_HEADER_FIELDS_TOO_LARGE, WSFS_STR_T_CHAR(ERROR_REQUEST_HEADER_FIELDS_TOO_LARGE_STRING) },
-    { ERROR_LOGIN_TIME_OUT, WSFS_STR_T_CHAR(ERROR_LOGIN_TIME_OUT_STRING) },
-    { ERROR_NO_RESPONSE, WSFS_STR_T_CHAR(ERROR_NO_RESPONSE_STRING) },
-    { ERROR_RETRY_WITH, WSFS_STR_T_CHAR(ERROR_RETRY_WITH_STRING) },
-    { ERROR_BLOCKED_BY_WINDOWS_PARENTAL_CONTROLS, WSFS_STR_T_CHAR(ERROR_BLOCKED_BY_WINDOWS_PARENTAL_CONTROLS_STRING) },
-    { ERROR_UNAVAILABLE_FOR_LEGAL_REASONS, WSFS_STR_T_CHAR(ERROR_UNAVAILABLE_FOR_LEGAL_REASONS_STRING) },
-    { ERROR_CLIENT_CLOSED_CONNECTION_PREMATURELY, WSFS_STR_T_CHAR(ERROR_CLIENT_CLOSED_CONNECTION_PREMATURELY_STRING) },
-    { ERROR_TOO_MANY_FORWARDED_IP_ADDRESSES, WSFS_STR_T_CHAR(ERROR_TOO_MANY_FORWARDED_IP_ADDRESSES_STRING) },
-    { ERROR_INCOMPATIBLE_PROTOCOL, WSFS_STR_T_CHAR(ERROR_INCOMPATIBLE_PROTOCOL_STRING) },
-    { ERROR_REQUEST_HEADER_TOO_LARGE, WSFS_STR_T_CHAR(ERROR_REQUEST_HEADER_TOO_LARGE_STRING) },
-    { ERROR_SSL_CERTIFICATE_ERROR, WSFS_STR_T_CHAR(ERROR_SSL_CERTIFICATE_ERROR_STRING) },
-    { ERROR_SSL_CERTIFICATE_REQUIRED, WSFS_STR_T_CHAR(ERROR_SSL_CERTIFICATE_REQUIRED_STRING) },
-    { ERROR_HTTP_REQUEST_SENT_TO_HTTPS_PORT, WSFS_STR_T_CHAR(ERROR_HTTP_REQUEST_SENT_TO_HTTPS_PORT_STRING) },
-    { ERROR_INVALID_TOKEN, WSFS_STR_T_CHAR(ERROR_INVALID_TOKEN_STRING) },
-    { ERROR_TOKEN_REQUIRED_OR_CLIENT_CLOSED_REQUEST, WSFS_STR_T_CHAR(ERROR_TOKEN_REQUIRED_OR_CLIENT_CLOSED_REQUEST_STRING) },
+    { ERROR_BAD_REQUEST, WSFS_STR(ERROR_BAD_REQUEST_STRING) },
+    { ERROR_UNAUTHORIZED, WSFS_STR(ERROR_UNAUTHORIZED_STRING) },
+    { ERROR_PAYMENT_REQUIRED, WSFS_STR(ERROR_PAYMENT_REQUIRED_STRING) },
+    { ERROR_FORBIDDEN, WSFS_STR(ERROR_FORBIDDEN_STRING) },
+    { ERROR_NOT_FOUND, WSFS_STR(ERROR_NOT_FOUND_STRING) },
+    { ERROR_METHOD_NOT_ALLOWED, WSFS_STR(ERROR_METHOD_NOT_ALLOWED_STRING) },
+    { ERROR_NOT_ACCEPTABLE, WSFS_STR(ERROR_NOT_ACCEPTABLE_STRING) },
+    { ERROR_PROXY_AUTHENTICATION_REQUIRED, WSFS_STR(ERROR_PROXY_AUTHENTICATION_REQUIRED_STRING) },
+    { ERROR_REQUEST_TIMEOUT, WSFS_STR(ERROR_REQUEST_TIMEOUT_STRING) },
+    { ERROR_CONFLICT, WSFS_STR(ERROR_CONFLICT_STRING) },
+    { ERROR_GONE, WSFS_STR(ERROR_GONE_STRING) },
+    { ERROR_LENGTH_REQUIRED, WSFS_STR(ERROR_LENGTH_REQUIRED_STRING) },
+    { ERROR_PRECONDITION_FAILED, WSFS_STR(ERROR_PRECONDITION_FAILED_STRING) },
+    { ERROR_PAYLOAD_TOO_LARGE, WSFS_STR(ERROR_PAYLOAD_TOO_LARGE_STRING) },
+    { ERROR_URI_TOO_LONG, WSFS_STR(ERROR_URI_TOO_LONG_STRING) },
+    { ERROR_UNSUPPORTED_MEDIA_TYPE, WSFS_STR(ERROR_UNSUPPORTED_MEDIA_TYPE_STRING) },
+    { ERROR_RANGE_NOT_SATISFIABLE, WSFS_STR(ERROR_RANGE_NOT_SATISFIABLE_STRING) },
+    { ERROR_EXPECTATION_FAILED, WSFS_STR(ERROR_EXPECTATION_FAILED_STRING) },
+    { ERROR_IM_A_TEAPOT, WSFS_STR(ERROR_IM_A_TEAPOT_STRING) },
+    { ERROR_PAGE_EXPIRED, WSFS_STR(ERROR_PAGE_EXPIRED_STRING) },
+    { ERROR_METHOD_FAILURE_OR_ENHANCE_YOUR_CALM, WSFS_STR(ERROR_METHOD_FAILURE_OR_ENHANCE_YOUR_CALM_STRING) },
+    { ERROR_MISDIRECTED_REQUEST, WSFS_STR(ERROR_MISDIRECTED_REQUEST_STRING) },
+    { ERROR_UNPROCESSABLE_ENTITY, WSFS_STR(ERROR_UNPROCESSABLE_ENTITY_STRING) },
+    { ERROR_LOCKED, WSFS_STR(ERROR_LOCKED_STRING) },
+    { ERROR_FAILED_DEPENDENCY, WSFS_STR(ERROR_FAILED_DEPENDENCY_STRING) },
+    { ERROR_TOO_EARLY, WSFS_STR(ERROR_TOO_EARLY_STRING) },
+    { ERROR_UPGRADE_REQUIRED, WSFS_STR(ERROR_UPGRADE_REQUIRED_STRING) },
+    { ERROR_PRECONDITION_REQUIRED, WSFS_STR(ERROR_PRECONDITION_REQUIRED_STRING) },
+    { ERROR_TOO_MANY_REQUESTS, WSFS_STR(ERROR_TOO_MANY_REQUESTS_STRING) },
+    { ERROR_HTTP_STATUS_CODE, WSFS_STR(ERROR_HTTP_STATUS_CODE_STRING) },
+    { ERROR_REQUEST_HEADER_FIELDS_TOO_LARGE, WSFS_STR(ERROR_REQUEST_HEADER_FIELDS_TOO_LARGE_STRING) },
+    { ERROR_LOGIN_TIME_OUT, WSFS_STR(ERROR_LOGIN_TIME_OUT_STRING) },
+    { ERROR_NO_RESPONSE, WSFS_STR(ERROR_NO_RESPONSE_STRING) },
+    { ERROR_RETRY_WITH, WSFS_STR(ERROR_RETRY_WITH_STRING) },
+    { ERROR_BLOCKED_BY_WINDOWS_PARENTAL_CONTROLS, WSFS_STR(ERROR_BLOCKED_BY_WINDOWS_PARENTAL_CONTROLS_STRING) },
+    { ERROR_UNAVAILABLE_FOR_LEGAL_REASONS, WSFS_STR(ERROR_UNAVAILABLE_FOR_LEGAL_REASONS_STRING) },
+    { ERROR_CLIENT_CLOSED_CONNECTION_PREMATURELY, WSFS_STR(ERROR_CLIENT_CLOSED_CONNECTION_PREMATURELY_STRING) },
+    { ERROR_TOO_MANY_FORWARDED_IP_ADDRESSES, WSFS_STR(ERROR_TOO_MANY_FORWARDED_IP_ADDRESSES_STRING) },
+    { ERROR_INCOMPATIBLE_PROTOCOL, WSFS_STR(ERROR_INCOMPATIBLE_PROTOCOL_STRING) },
+    { ERROR_REQUEST_HEADER_TOO_LARGE, WSFS_STR(ERROR_REQUEST_HEADER_TOO_LARGE_STRING) },
+    { ERROR_SSL_CERTIFICATE_ERROR, WSFS_STR(ERROR_SSL_CERTIFICATE_ERROR_STRING) },
+    { ERROR_SSL_CERTIFICATE_REQUIRED, WSFS_STR(ERROR_SSL_CERTIFICATE_REQUIRED_STRING) },
+    { ERROR_HTTP_REQUEST_SENT_TO_HTTPS_PORT, WSFS_STR(ERROR_HTTP_REQUEST_SENT_TO_HTTPS_PORT_STRING) },
+    { ERROR_INVALID_TOKEN, WSFS_STR(ERROR_INVALID_TOKEN_STRING) },
+    { ERROR_TOKEN_REQUIRED_OR_CLIENT_CLOSED_REQUEST, WSFS_STR(ERROR_TOKEN_REQUIRED_OR_CLIENT_CLOSED_REQUEST_STRING) },
 
     // Crit (Server Error) 5xx
-    { CRIT_INTERNAL_SERVER_ERROR, WSFS_STR_T_CHAR(CRIT_INTERNAL_SERVER_ERROR_STRING) },
-    { CRIT_NOT_IMPLEMENTED, WSFS_STR_T_CHAR(CRIT_NOT_IMPLEMENTED_STRING) },
-    { CRIT_BAD_GATEWAY, WSFS_STR_T_CHAR(CRIT_BAD_GATEWAY_STRING) },
-    { CRIT_SERVICE_UNAVAILABLE, WSFS_STR_T_CHAR(CRIT_SERVICE_UNAVAILABLE_STRING) },
-    { CRIT_GATEWAY_TIMEOUT, WSFS_STR_T_CHAR(CRIT_GATEWAY_TIMEOUT_STRING) },
-    { CRIT_HTTP_VERSION_NOT_SUPPORTED, WSFS_STR_T_CHAR(CRIT_HTTP_VERSION_NOT_SUPPORTED_STRING) },
-    { CRIT_VARIANT_ALSO_NEGOTIATES, WSFS_STR_T_CHAR(CRIT_VARIANT_ALSO_NEGOTIATES_STRING) },
-    { CRIT_INSUFFICIENT_STORAGE, WSFS_STR_T_CHAR(CRIT_INSUFFICIENT_STORAGE_STRING) },
-    { CRIT_LOOP_DETECTED, WSFS_STR_T_CHAR(CRIT_LOOP_DETECTED_STRING) },
-    { CRIT_BANDWIDTH_LIMIT_EXCEEDED, WSFS_STR_T_CHAR(CRIT_BANDWIDTH_LIMIT_EXCEEDED_STRING) },
-    { CRIT_NOT_EXTENDED, WSFS_STR_T_CHAR(CRIT_NOT_EXTENDED_STRING) },
-    { CRIT_NETWORK_AUTHENTICATION_REQUIRED, WSFS_STR_T_CHAR(CRIT_NETWORK_AUTHENTICATION_REQUIRED_STRING) },
-    { CRIT_WEB_SERVER_IS_RETURNING_AN_UNKNOWN_ERROR, WSFS_STR_T_CHAR(CRIT_WEB_SERVER_IS_RETURNING_AN_UNKNOWN_ERROR_STRING) },
-    { CRIT_WEB_SERVER_IS_DOWN, WSFS_STR_T_CHAR(CRIT_WEB_SERVER_IS_DOWN_STRING) },
-    { CRIT_CONNECTION_TIMED_OUT, WSFS_STR_T_CHAR(CRIT_CONNECTION_TIMED_OUT_STRING) },
-    { CRIT_ORIGIN_IS_UNREACHABLE, WSFS_STR_T_CHAR(CRIT_ORIGIN_IS_UNREACHABLE_STRING) },
-    { CRIT_A_TIMEOUT_OCCURRED, WSFS_STR_T_CHAR(CRIT_A_TIMEOUT_OCCURRED_STRING) },
-    { CRIT_SSL_HANDSHAKE_FAILED, WSFS_STR_T_CHAR(CRIT_SSL_HANDSHAKE_FAILED_STRING) },
-    { CRIT_INVALID_SSL_CERTIFICATE, WSFS_STR_T_CHAR(CRIT_INVALID_SSL_CERTIFICATE_STRING) },
-    { CRIT_RAILGUN_LISTENER_TO_ORIGIN, WSFS_STR_T_CHAR(CRIT_RAILGUN_LISTENER_TO_ORIGIN_STRING) },
-    { CRIT_THE_SERVICE_IS_OVERLOADED, WSFS_STR_T_CHAR(CRIT_THE_SERVICE_IS_OVERLOADED_STRING) },
-    { CRIT_SITE_FROZEN, WSFS_STR_T_CHAR(CRIT_SITE_FROZEN_STRING) },
-    { CRIT_UNAUTHORIZED, WSFS_STR_T_CHAR(CRIT_UNAUTHORIZED_STRING) },
-    { CRIT_NETWORK_READ_TIMEOUT_ERROR, WSFS_STR_T_CHAR(CRIT_NETWORK_READ_TIMEOUT_ERROR_STRING) },
-    { CRIT_NETWORK_CONNECT_TIMEOUT_ERROR, WSFS_STR_T_CHAR(CRIT_NETWORK_CONNECT_TIMEOUT_ERROR_STRING) },
+    { CRIT_INTERNAL_SERVER_ERROR, WSFS_STR(CRIT_INTERNAL_SERVER_ERROR_STRING) },
+    { CRIT_NOT_IMPLEMENTED, WSFS_STR(CRIT_NOT_IMPLEMENTED_STRING) },
+    { CRIT_BAD_GATEWAY, WSFS_STR(CRIT_BAD_GATEWAY_STRING) },
+    { CRIT_SERVICE_UNAVAILABLE, WSFS_STR(CRIT_SERVICE_UNAVAILABLE_STRING) },
+    { CRIT_GATEWAY_TIMEOUT, WSFS_STR(CRIT_GATEWAY_TIMEOUT_STRING) },
+    { CRIT_HTTP_VERSION_NOT_SUPPORTED, WSFS_STR(CRIT_HTTP_VERSION_NOT_SUPPORTED_STRING) },
+    { CRIT_VARIANT_ALSO_NEGOTIATES, WSFS_STR(CRIT_VARIANT_ALSO_NEGOTIATES_STRING) },
+    { CRIT_INSUFFICIENT_STORAGE, WSFS_STR(CRIT_INSUFFICIENT_STORAGE_STRING) },
+    { CRIT_LOOP_DETECTED, WSFS_STR(CRIT_LOOP_DETECTED_STRING) },
+    { CRIT_BANDWIDTH_LIMIT_EXCEEDED, WSFS_STR(CRIT_BANDWIDTH_LIMIT_EXCEEDED_STRING) },
+    { CRIT_NOT_EXTENDED, WSFS_STR(CRIT_NOT_EXTENDED_STRING) },
+    { CRIT_NETWORK_AUTHENTICATION_REQUIRED, WSFS_STR(CRIT_NETWORK_AUTHENTICATION_REQUIRED_STRING) },
+    { CRIT_WEB_SERVER_IS_RETURNING_AN_UNKNOWN_ERROR, WSFS_STR(CRIT_WEB_SERVER_IS_RETURNING_AN_UNKNOWN_ERROR_STRING) },
+    { CRIT_WEB_SERVER_IS_DOWN, WSFS_STR(CRIT_WEB_SERVER_IS_DOWN_STRING) },
+    { CRIT_CONNECTION_TIMED_OUT, WSFS_STR(CRIT_CONNECTION_TIMED_OUT_STRING) },
+    { CRIT_ORIGIN_IS_UNREACHABLE, WSFS_STR(CRIT_ORIGIN_IS_UNREACHABLE_STRING) },
+    { CRIT_A_TIMEOUT_OCCURRED, WSFS_STR(CRIT_A_TIMEOUT_OCCURRED_STRING) },
+    { CRIT_SSL_HANDSHAKE_FAILED, WSFS_STR(CRIT_SSL_HANDSHAKE_FAILED_STRING) },
+    { CRIT_INVALID_SSL_CERTIFICATE, WSFS_STR(CRIT_INVALID_SSL_CERTIFICATE_STRING) },
+    { CRIT_RAILGUN_LISTENER_TO_ORIGIN, WSFS_STR(CRIT_RAILGUN_LISTENER_TO_ORIGIN_STRING) },
+    { CRIT_THE_SERVICE_IS_OVERLOADED, WSFS_STR(CRIT_THE_SERVICE_IS_OVERLOADED_STRING) },
+    { CRIT_SITE_FROZEN, WSFS_STR(CRIT_SITE_FROZEN_STRING) },
+    { CRIT_UNAUTHORIZED, WSFS_STR(CRIT_UNAUTHORIZED_STRING) },
+    { CRIT_NETWORK_READ_TIMEOUT_ERROR, WSFS_STR(CRIT_NETWORK_READ_TIMEOUT_ERROR_STRING) },
+    { CRIT_NETWORK_CONNECT_TIMEOUT_ERROR, WSFS_STR(CRIT_NETWORK_CONNECT_TIMEOUT_ERROR_STRING) },
   };
 
-  static size_t status_code_count = sizeof(http_status_list) / sizeof(http_status_t);
+  static const size_t status_code_count = sizeof(http_status_list) / sizeof(http_status_t);
 
   return check(http_status_bsearch(out, &status, http_status_list, status_code_count), "Status code not found.\n");
 }
@@ -3,13 +3,27 @@
 #ifndef _HTTP_FUNC
 #define _HTTP_FUNC
 
+#include <time.h>
+
 #include "http_core.h"
 #include "wsfs_core.h"
 
+#define HTTP_REQUEST_TIMEOUT_DEFAULT 10 // seconds
+
+extern long http_request_timeout; // for a request head, and for each send
+
 int http_parse_request(http_request_t *out, int socketfd);
 int http_construct_response(http_response_t *out, http_request_t *request);
-int http_cache_set(http_response_t *response);
-int http_cache_get(http_response_t *response);
-int http_status_string_get(wsfs_str_t *out, int status);
+int http_status_string_get(wsfs_str_t *out, http_status_code_t status);
+
+void http_request_release(http_request_t *request);
+const char *http_header_get(const http_request_t *request, const char *name);
+int http_date_format(char *out, size_t size, time_t time);
+wsfs_str_t http_date_header();
+int http_date_parse(const char *date, time_t *out);
+int http_status_line_format(char *out, size_t size, http_status_code_t status);
+int http_send_segments(int socketfd, const http_segment_t *segments, size_t count);
+const char *http_connection_header(const http_request_t *request);
+int http_send_error(int socketfd, http_status_code_t status, const char *extra_headers, const http_request_t *request);
 
 #endif
@@ -0,0 +1,471 @@
+// SPDX-License-Identifier: MIT
+
+#include <config.h>
+#include <ctype.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "http_file_cache.h"
+#include "http_path.h"
+#include "http_utils.h"
+#include "http_vhost.h"
+#include "log_levels.h"
+#include "logger.h"
+
+// Virtual hosts
+//
+// A request is served by the virtual host its Host field names, or by
+// the default one made of --target and --proxy. Virtual hosts come from
+// the --vhosts file:
+//
+//   # comment
+//   host example.com www.example.com
+//   target /srv/example
+//   file-cache-ttl 60
+//   proxy /api=127.0.0.1:9000,unix:/run/app.sock
+//
+// Every "host" line starts a virtual host, the lines up to the next one
+// configure it. "target" is required, "file-cache-ttl" defaults to
+// --file-cache-ttl and 0 bypasses the open file cache. "proxy" takes
+// the same routes as --proxy.
+//
+// The file is compiled into an immutable table: an open addressing hash
+// of the host names and, per virtual host, a trie of the route prefixes
+// with one node per path segment. Resolving a request takes one hash and
+// one walk down the trie, without locks.
+//
+// SIGHUP loads the file again. The new table replaces the old one with
+// a single atomic store; the old one is freed once every thread that
+// might still be using it has left its read section (a grace period, as
+// with RCU). Requests never wait for a reload, the reload waits for
+// them.
+
+typedef struct {
+  const wsfs_string_t         *name; // NULL if the slot is free
+  uint32_t                    hash;
+  http_vhost_t                *vhost;
+} http_vhost_slot_t;
+
+typedef struct {
+  http_vhost_t                **vhosts;
+  size_t                      vhost_count;
+  http_vhost_slot_t           *slots;
+  size_t                      slot_mask;
+} http_vhost_table_t;
+
+char http_vhost_file[PATH_MAX];
+
+static http_vhost_t default_vhost;
+static _Atomic(http_vhost_table_t *) current;
+static wsfs_epoch_t epoch = WSFS_EPOCH_INIT;
+static __thread wsfs_epoch_reader_t *reader;
+static uint32_t root_ids; // document roots ever opened, 0 is --target
+
+static uint32_t
+http_vhost_hash(const char *name, size_t len)
+{
+  // FNV-1a over the lower case name
+  uint32_t hash = WSFS_FNV32_BASIS;
+  for (size_t i = 0; i < len; i++)
+    hash = wsfs_fnv1a32_byte(hash, tolower((unsigned char)name[i]));
+  return hash;
+}
+
+static int
+http_vhost_node(http_vhost_t *vhost, int parent, const char *segment, size_t len)
+{
+  // Child of `parent` for `segment`, added if missing. Returns its index
+  // or -1 if out of memory.
+  http_vhost_node_t *nodes;
+  int child;
+
+  for (child = vhost->nodes[parent].child; child != -1; child = vhost->nodes[child].sibling)
+    if (vhost->nodes[child].segment_len == len && memcmp(vhost->nodes[child].segment, segment, len) == 0)
+      return child;
+
+  if ((nodes = realloc(vhost->nodes, (vhost->node_count + 1) * sizeof(*nodes))) == NULL)
+    return -1;
+  vhost->nodes = nodes;
+
+  child = vhost->node_count++;
+  nodes[child] = (http_vhost_node_t) {
+    .segment = segment,
+    .segment_len = len,
+    .child = -1,
+    .sibling = nodes[parent].child,
+  };
+  nodes[parent].child = child;
+  return child;
+}
+
+static int
+http_vhost_compile(http_vhost_t *vhost)
+{
+  // http_vhost_compile():
+  // Build the trie of the route prefixes of `vhost`. A later route with
+  // the same prefix replaces an earlier one. Returns 0 or -1.
+
+  http_proxy_route_t *route;
+  const char *segment, *end;
+  size_t len;
+  int node, below;
+
+  free(vhost->nodes);
+  if ((vhost->nodes = malloc(sizeof(*vhost->nodes))) == NULL)
+    return -1;
+  vhost->nodes[0] = (http_vhost_node_t) { .child = -1, .sibling = -1 };
+  vhost->node_count = 1;
+
+  for (size_t i = 0; i < vhost->route_count; i++) {
+    route = &vhost->routes[i];
+    len = route->prefix_len;
+    below = len > 0 && route->prefix[len - 1] == '/';
+    if (below)
+      len--;
+
+    node = 0;
+    for (segment = route->prefix; len > 0 && segment <= route->prefix + len; segment = end + 1) {
+      if ((end = memchr(segment, '/', route->prefix + len - segment)) == NULL)
+        end = route->prefix + len;
+      if ((node = http_vhost_node(vhost, node, segment, end - segment)) == -1)
+        return -1;
+    }
+
+    if (below)
+      vhost->nodes[node].below = route;
+    else
+      vhost->nodes[node].exact = route;
+  }
+
+  return 0;
+}
+
+static void
+http_vhost_free(http_vhost_t *vhost)
+{
+  for (size_t i = 0; i < vhost->name_count; i++)
+    wsfs_string_free(&vhost->names[i]);
+  http_static_root_close(&vhost->root);
+  free(vhost->nodes);
+  free(vhost);
+}
+
+static void
+http_vhost_table_free(http_vhost_table_t *table)
+{
+  if (table == NULL)
+    return;
+  for (size_t i = 0; i < table->vhost_count; i++)
+    http_vhost_free(table->vhosts[i]);
+  free(table->vhosts);
+  free(table->slots);
+  free(table);
+}
+
+static int
+http_vhost_error(const char *path, size_t line, const char *message)
+{
+  char text[PATH_MAX + 128];
+
+  snprintf(text, sizeof(text), "vhosts: %s:%zu: %s", path, line, message);
+  logger(LOGL_ERROR, NULL, text);
+  return -1;
+}
+
+static int
+http_vhost_line(http_vhost_table_t *table, char *text, const char *path, size_t line)
+{
+  // http_vhost_line():
+  // Apply one line of the --vhosts file to `table`. Returns 0, or -1
+  // after logging what is wrong with it.
+
+  http_vhost_t *vhost = table->vhost_count > 0 ? table->vhosts[table->vhost_count - 1] : NULL;
+  http_vhost_t **vhosts;
+  char *save, *directive, *argument, *end;
+  long number;
+
+  if ((directive = strtok_r(text, " \t\r\n", &save)) == NULL || directive[0] == '#')
+    return 0;
+  argument = strtok_r(NULL, " \t\r\n", &save);
+
+  if (strcmp(directive, "host") == 0) {
+    if ((vhost = calloc(1, sizeof(*vhost))) == NULL)
+      return http_vhost_error(path, line, "out of memory");
+    vhost->root.fd = -1;
+    vhost->root.file_cache_ttl = http_file_cache_ttl;
+
+    if ((vhosts = realloc(table->vhosts, (table->vhost_count + 1) * sizeof(*vhosts))) == NULL) {
+      free(vhost);
+      return http_vhost_error(path, line, "out of memory");
+    }
+    table->vhosts = vhosts;
+    table->vhosts[table->vhost_count++] = vhost;
+
+    for (; argument != NULL; argument = strtok_r(NULL, " \t\r\n", &save)) {
+      if (vhost->name_count == HTTP_VHOST_NAMES_MAX)
+        return http_vhost_error(path, line, "too many host names");
+      for (char *c = argument; *c != '\0'; c++)
+        *c = tolower((unsigned char)*c);
+      if (wsfs_string_set(&vhost->names[vhost->name_count], wsfs_str_from(argument)) != 0)
+        return http_vhost_error(path, line, "out of memory");
+      vhost->name_count++;
+    }
+    if (vhost->name_count == 0)
+      return http_vhost_error(path, line, "host needs a name");
+    return 0;
+  }
+
+  if (vhost == NULL)
+    return http_vhost_error(path, line, "directive outside of a host");
+  if (argument == NULL || strtok_r(NULL, " \t\r\n", &save) != NULL)
+    return http_vhost_error(path, line, "directive takes one argument");
+
+  if (strcmp(directive, "target") == 0) {
+    if (vhost->root.fd != -1)
+      return http_vhost_error(path, line, "target given twice");
+    if (http_static_root_open(&vhost->root, argument, ++root_ids, vhost->root.file_cache_ttl) != 0)
+      return http_vhost_error(path, line, "target is not an accessible directory");
+  } else if (strcmp(directive, "file-cache-ttl") == 0) {
+    number = strtol(argument, &end, 10);
+    if (end == argument || *end != '\0' || number < 0 || number > INT32_MAX)
+      return http_vhost_error(path, line, "file-cache-ttl is not a number of seconds");
+    vhost->root.file_cache_ttl = number;
+  } else if (strcmp(directive, "proxy") == 0) {
+    if (vhost->route_count == HTTP_PROXY_ROUTES_MAX)
+      return http_vhost_error(path, line, "too many routes");
+    if (http_proxy_route_parse(&vhost->routes[vhost->route_count], argument) != 0)
+      return http_vhost_error(path, line, "proxy route is malformed");
+    vhost->route_count++;
+  } else
+    return http_vhost_error(path, line, "unknown directive");
+
+  return 0;
+}
+
+static int
+http_vhost_index(http_vhost_table_t *table, const char *path)
+{
+  // Hash every host name of `table`, at most half of the slots are used
+  size_t slot_count = 1, name_count = 0;
+  http_vhost_slot_t *slot;
+  uint32_t hash;
+
+  for (size_t i = 0; i < table->vhost_count; i++)
+    name_count += table->vhosts[i]->name_count;
+  while (slot_count < name_count * 2)
+    slot_count <<= 1;
+
+  if ((table->slots = calloc(slot_count, sizeof(*table->slots))) == NULL)
+    return -1;
+  table->slot_mask = slot_count - 1;
+
+  for (size_t i = 0; i < table->vhost_count; i++) {
+    for (size_t j = 0; j < table->vhosts[i]->name_count; j++) {
+      const wsfs_string_t *name = &table->vhosts[i]->names[j];
+      hash = http_vhost_hash(name->string, name->len);
+
+      for (slot = &table->slots[hash & table->slot_mask]; slot->name != NULL;
+        slot = &table->slots[(slot - table->slots + 1) & table->slot_mask]) {
+        if (wsfs_str_eq(wsfs_string_view(slot->name), wsfs_string_view(name))) {
+          char message[PATH_MAX + 128];
+          snprintf(message, sizeof(message), "vhosts: %s: host %.64s defined twice", path, name->string);
+          logger(LOGL_ERROR, NULL, message);
+          return -1;
+        }
+      }
+      *slot = (http_vhost_slot_t) { .name = name, .hash = hash, .vhost = table->vhosts[i] };
+    }
+  }
+
+  return 0;
+}
+
+static http_vhost_table_t *
+http_vhost_load(const char *path)
+{
+  // http_vhost_load():
+  // Compile the --vhosts file at `path`. Returns the table, or NULL
+  // after logging why not.
+
+  http_vhost_table_t *table;
+  FILE *file;
+  char message[PATH_MAX + 32];
+  char *text = NULL;
+  size_t size = 0, line = 0;
+  int result = 0;
+
+  if ((file = fopen(path, "re")) == NULL) {
+    snprintf(message, sizeof(message), "vhosts: %s cannot be opened", path);
+    logger(LOGL_ERROR, NULL, message);
+    return NULL;
+  }
+
+  if ((table = calloc(1, sizeof(*table))) == NULL) {
+    fclose(file);
+    return NULL;
+  }
+
+  while (result == 0 && getline(&text, &size, file) != -1)
+    result = http_vhost_line(table, text, path, ++line);
+  free(text);
+  fclose(file);
+
+  for (size_t i = 0; i < table->vhost_count && result == 0; i++) {
+    if (table->vhosts[i]->root.fd == -1)
+      result = http_vhost_error(path, line, "every host needs a target");
+    else if (http_vhost_compile(table->vhosts[i]) != 0)
+      result = -1;
+  }
+
+  if (result != 0 || http_vhost_index(table, path) != 0) {
+    http_vhost_table_free(table);
+    return NULL;
+  }
+  return table;
+}
+
+int
+http_vhost_proxy(const char *spec)
+{
+  // http_vhost_proxy():
+  // Add a --proxy route to the default virtual host. Returns 0 or -1.
+
+  if (default_vhost.route_count == HTTP_PROXY_ROUTES_MAX
+    || http_proxy_route_parse(&default_vhost.routes[default_vhost.route_count], spec) != 0)
+    return -1;
+  default_vhost.route_count++;
+  return 0;
+}
+
+int
+http_vhost_init()
+{
+  // http_vhost_init():
+  // Set up the default virtual host and load the --vhosts file, after
+  // http_static_init(). Returns 0 or -1.
+
+  http_vhost_table_t *table;
+
+  default_vhost.root = http_static_target;
+  if (http_vhost_compile(&default_vhost) != 0)
+    return -1;
+
+  if (http_vhost_file[0] == '\0')
+    return 0;
+  if ((table = http_vhost_load(http_vhost_file)) == NULL)
+    return -1;
+  atomic_store(&current, table);
+  return 0;
+}
+
+int
+http_vhost_reload()
+{
+  // http_vhost_reload():
+  // Load the --vhosts file again and switch to it. The old table stays
+  // in place if the file has errors. Returns 0 or -1.
+
+  http_vhost_table_t *table, *old;
+  char message[64];
+
+  if ((table = http_vhost_load(http_vhost_file)) == NULL)
+    return -1;
+
+  old = atomic_exchange(&current, table);
+  wsfs_epoch_synchronize(&epoch);
+  http_vhost_table_free(old);
+
+  snprintf(message, sizeof(message), "vhosts: %zu virtual hosts loaded", table->vhost_count);
+  logger(LOGL_NOTICE, NULL, message);
+  return 0;
+}
+
+const http_vhost_t *
+http_vhost_enter(const http_request_t *request)
+{
+  // http_vhost_enter():
+  // Start a read section and find the virtual host for `request`. The
+  // result stays valid until http_vhost_exit().
+
+  http_vhost_table_t *table;
+  const http_vhost_slot_t *slot;
+  const char *host;
+  wsfs_str_t name;
+  uint32_t hash;
+
+  if (http_vhost_file[0] == '\0')
+    return &default_vhost;
+
+  if (wsfs_epoch_enter(&epoch, &reader) != 0)
+    return &default_vhost;
+  table = atomic_load(&current);
+
+  if ((host = http_header_get(request, "Host")) == NULL)
+    return &default_vhost;
+
+  // Without the port, which follows the closing bracket of an IPv6 address
+  name.string = host;
+  if (host[0] == '[')
+    name.len = strcspn(host, "]") + (strchr(host, ']') != NULL);
+  else
+    name.len = strcspn(host, ":");
+  hash = http_vhost_hash(name.string, name.len);
+
+  for (slot = &table->slots[hash & table->slot_mask]; slot->name != NULL;
+    slot = &table->slots[(slot - table->slots + 1) & table->slot_mask])
+    if (slot->hash == hash && wsfs_str_case_eq(wsfs_string_view(slot->name), name))
+      return slot->vhost;
+
+  return &default_vhost;
+}
+
+http_proxy_route_t *
+http_vhost_route(const http_vhost_t *vhost, const http_request_t *request)
+{
+  // http_vhost_route():
+  // Find the route of `vhost` with the longest prefix of the request
+  // path, or NULL. Prefixes match whole path segments; one ending with a
+  // slash only matches below it.
+
+  char path[HTTP_PATH_MAX];
+  const char *segment, *end;
+  http_proxy_route_t *best;
+  int node, child, len;
+
+  if (vhost->route_count == 0 || (len = http_path_normalize(path, sizeof(path), request->path.string)) < 0)
+    return NULL;
+
+  best = vhost->nodes[0].exact;
+  segment = len > 0 ? path : NULL;
+
+  for (node = 0; segment != NULL; node = child) {
+    if ((end = memchr(segment, '/', path + len - segment)) == NULL)
+      end = path + len;
+
+    for (child = vhost->nodes[node].child; child != -1; child = vhost->nodes[child].sibling)
+      if (vhost->nodes[child].segment_len == (size_t)(end - segment)
+        && memcmp(vhost->nodes[child].segment, segment, end - segment) == 0)
+        break;
+    if (child == -1)
+      break;
+
+    // Is there more path below this segment, even an empty one?
+    segment = end < path + len ? end + 1 : NULL;
+    if (segment != NULL && vhost->nodes[child].below != NULL)
+      best = vhost->nodes[child].below;
+    else if (vhost->nodes[child].exact != NULL)
+      best = vhost->nodes[child].exact;
+  }
+
+  return best;
+}
+
+void
+http_vhost_exit()
+{
+  wsfs_epoch_exit(reader);
+}
@@ -0,0 +1,46 @@
+// SPDX-License-Identifier: MIT
+
+#ifndef _HTTP_VHOST
+#define _HTTP_VHOST
+
+#include <linux/limits.h>
+
+#include "http_core.h"
+#include "http_proxy.h"
+#include "http_static.h"
+#include "wsfs_core.h"
+
+#define HTTP_VHOST_NAMES_MAX 16 // host names per virtual host
+
+// One node per path segment of the route prefixes of a virtual host
+typedef struct {
+  const char                  *segment; // into a route prefix
+  size_t                      segment_len;
+  int                         child; // first child, -1 if none
+  int                         sibling; // next child of the parent, -1 if none
+  http_proxy_route_t          *exact; // prefix ends here: this path and below
+  http_proxy_route_t          *below; // prefix ends here with a slash: only below
+} http_vhost_node_t;
+
+typedef struct {
+  wsfs_string_t               names[HTTP_VHOST_NAMES_MAX]; // lower case
+  size_t                      name_count;
+
+  http_static_root_t          root;
+
+  http_proxy_route_t          routes[HTTP_PROXY_ROUTES_MAX];
+  size_t                      route_count;
+  http_vhost_node_t           *nodes; // nodes[0] stands for "/"
+  size_t                      node_count;
+} http_vhost_t;
+
+extern char http_vhost_file[PATH_MAX];
+
+int http_vhost_proxy(const char *spec);
+int http_vhost_init();
+int http_vhost_reload();
+const http_vhost_t *http_vhost_enter(const http_request_t *request);
+http_proxy_route_t *http_vhost_route(const http_vhost_t *vhost, const http_request_t *request);
+void http_vhost_exit();
+
+#endif
@@ -0,0 +1,405 @@
+// SPDX-License-Identifier: MIT
+
+#include <config.h>
+#include <errno.h>
+#include <time.h> // for <linux/errqueue.h>
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "http_tls.h"
+#include "http_trace.h"
+#include "http_utils.h"
+#include "http_zerocopy.h"
+#include "log_levels.h"
+#include "logger.h"
+
+// Zero-copy sends
+//
+// Bodies from the response cache of at least `http_zerocopy_threshold`
+// bytes are sent with MSG_ZEROCOPY: the kernel transmits straight from
+// the cache entry instead of copying it into socket buffers first. The
+// entry then has to stay unchanged until the kernel is done with it, so
+// the connection holds a reference until the completion for every
+// sendmsg() involved shows up on the socket's error queue.
+//
+// Completions are reaped before each zero-copy send, while the
+// connection waits for its next request (the error queue makes the
+// socket report POLLERR) and when it is closed. A connection closed with
+// sends still in flight is shut down and handed to the reaper thread,
+// which closes it once they complete: the worker never waits for the
+// peer to acknowledge data. A connection whose
+// completions say the data was copied anyway, such as over loopback,
+// goes back to plain sends. With TLS the kernel cannot send from user
+// memory, zero-copy is then off.
+//
+// State is indexed by socket descriptor and only exists while a
+// connection has used zero-copy. A descriptor belongs to one thread
+// while the connection is open, then to the reaper, so the table needs
+// no lock.
+
+typedef struct {
+  http_cache_entry_t          *entry;
+  uint32_t                    first; // sendmsg() ids
+  uint32_t                    last;
+  uint32_t                    remaining; // ids not completed yet
+} http_zerocopy_pin_t;
+
+typedef struct {
+  int                         off; // not supported, or copied anyway
+  uint32_t                    next; // id of the next sendmsg()
+  http_zerocopy_pin_t         pins[HTTP_ZEROCOPY_PINS_MAX];
+  size_t                      pin_count;
+  time_t                      linger_until; // CLOCK_MONOTONIC, once closed
+} http_zerocopy_t;
+
+long http_zerocopy_threshold = HTTP_ZEROCOPY_THRESHOLD_DEFAULT;
+
+static http_zerocopy_t **states;
+static size_t states_max;
+
+// Closed connections waiting for completions, appended to by the
+// workers and removed from by the reaper only
+static pthread_mutex_t lingering_lock = PTHREAD_MUTEX_INITIALIZER;
+static int *lingering;
+static size_t lingering_count;
+static size_t lingering_capacity;
+static int reaper_fd = -1; // eventfd, wakes the reaper up
+
+static void *http_zerocopy_reaper(void *arg);
+
+int
+http_zerocopy_init()
+{
+  // http_zerocopy_init():
+  // Returns 0 or -1.
+
+  struct rlimit limit;
+  pthread_t thread;
+
+  if (http_zerocopy_threshold == 0 || http_tls_enabled())
+    return 0;
+
+  if (getrlimit(RLIMIT_NOFILE, &limit) == -1)
+    return -1;
+  states_max = limit.rlim_cur;
+  if ((states = calloc(states_max, sizeof(*states))) == NULL)
+    return -1;
+
+  if ((reaper_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+    return -1;
+  if (pthread_create(&thread, NULL, http_zerocopy_reaper, NULL) != 0)
+    return -1;
+  pthread_detach(thread);
+  return 0;
+}
+
+static void
+http_zerocopy_complete(http_zerocopy_t *state, uint32_t low, uint32_t high)
+{
+  // Sends `low` to `high` are done with their memory
+  http_zerocopy_pin_t *pin;
+  uint32_t first, last;
+
+  for (size_t i = 0; i < state->pin_count;) {
+    pin = &state->pins[i];
+    first = low > pin->first ? low : pin->first;
+    last = high < pin->last ? high : pin->last;
+    if (first <= last)
+      pin->remaining -= last - first + 1;
+
+    if (pin->remaining != 0) {
+      i++;
+      continue;
+    }
+    http_cache_release(pin->entry);
+    *pin = state->pins[--state->pin_count];
+  }
+}
+
+int
+http_zerocopy_reap(int socketfd)
+{
+  // http_zerocopy_reap():
+  // Take the completions queued on `socketfd` without blocking. Returns
+  // how many there were.
+
+  char control[CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in6))];
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+  struct sock_extended_err *error;
+  http_zerocopy_t *state;
+  int count = 0;
+
+  if (states == NULL || (size_t)socketfd >= states_max || (state = states[socketfd]) == NULL)
+    return 0;
+
+  while (1) {
+    msg = (struct msghdr) { .msg_control = control, .msg_controllen = sizeof(control) };
+    if (recvmsg(socketfd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1) {
+      if (errno == EINTR)
+        continue;
+      return count;
+    }
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if (!(cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR)
+        && !(cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR))
+        continue;
+      error = (struct sock_extended_err *)CMSG_DATA(cmsg);
+      if (error->ee_errno != 0 || error->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+        continue;
+
+      if (error->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+        state->off = 1;
+      http_zerocopy_complete(state, error->ee_info, error->ee_data);
+      count++;
+    }
+  }
+}
+
+static int
+http_zerocopy_sendmsg(int socketfd, struct iovec *iov, int iovcnt, int flags, http_zerocopy_t *state)
+{
+  // Send all of `iov`. With MSG_ZEROCOPY every sendmsg() that sent
+  // something takes an id. Falls back to copying when the kernel runs
+  // out of memory to pin pages with.
+  struct msghdr msg;
+  ssize_t bytes_sent;
+
+  while (iovcnt > 0) {
+    msg = (struct msghdr) { .msg_iov = iov, .msg_iovlen = iovcnt };
+    bytes_sent = sendmsg(socketfd, &msg, flags);
+    if (bytes_sent == -1 && errno == EINTR)
+      continue;
+    if (bytes_sent == -1 && errno == ENOBUFS && (flags & MSG_ZEROCOPY)) {
+      flags &= ~MSG_ZEROCOPY;
+      continue;
+    }
+    if (bytes_sent <= 0)
+      return -1;
+    if (flags & MSG_ZEROCOPY)
+      state->next++;
+
+    while (iovcnt > 0 && (size_t)bytes_sent >= iov->iov_len) {
+      bytes_sent -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (char *)iov->iov_base + bytes_sent;
+      iov->iov_len -= bytes_sent;
+    }
+  }
+
+  return 0;
+}
+
+int
+http_zerocopy_send(int socketfd, const http_segment_t *segments, size_t count, http_cache_entry_t *pin)
+{
+  // http_zerocopy_send():
+  // Send `segments` like http_send_segments(). The last one must be in
+  // memory owned by `pin` and is sent without copying if it is big
+  // enough, in which case `pin` gets referenced until the kernel is done
+  // with it. The others are copied, they usually live on the stack.
+  // Returns 0 or -1.
+
+  struct iovec iov[HTTP_SEGMENTS_MAX];
+  http_zerocopy_t *state;
+  http_zerocopy_pin_t *slot;
+  uint32_t first;
+  int one = 1, iovcnt = 0, result;
+
+  if (states == NULL || (size_t)socketfd >= states_max || count == 0 || count > HTTP_SEGMENTS_MAX
+    || segments[count - 1].fd != -1 || segments[count - 1].len < (size_t)http_zerocopy_threshold)
+    return http_send_segments(socketfd, segments, count);
+
+  if ((state = states[socketfd]) == NULL) {
+    if ((state = calloc(1, sizeof(*state))) == NULL)
+      return http_send_segments(socketfd, segments, count);
+    state->off = setsockopt(socketfd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) != 0;
+    states[socketfd] = state;
+  }
+
+  http_zerocopy_reap(socketfd);
+  if (state->off || state->pin_count == HTTP_ZEROCOPY_PINS_MAX)
+    return http_send_segments(socketfd, segments, count);
+
+  // The head is sent with MSG_MORE to leave in the same packet as the
+  // start of the body
+  for (size_t i = 0; i < count - 1; i++) {
+    if (segments[i].len == 0)
+      continue;
+    if (segments[i].fd != -1)
+      return http_send_segments(socketfd, segments, count);
+    iov[iovcnt].iov_base = (void *)segments[i].data;
+    iov[iovcnt].iov_len = segments[i].len;
+    iovcnt++;
+  }
+  if (http_zerocopy_sendmsg(socketfd, iov, iovcnt, MSG_MORE, state) != 0)
+    return -1;
+
+  iov[0].iov_base = (void *)segments[count - 1].data;
+  iov[0].iov_len = segments[count - 1].len;
+  first = state->next;
+  result = http_zerocopy_sendmsg(socketfd, iov, 1, MSG_ZEROCOPY, state);
+
+  // Whatever was handed to the kernel keeps `pin`, even after a failure
+  if (state->next != first) {
+    http_cache_retain(pin);
+    slot = &state->pins[state->pin_count++];
+    *slot = (http_zerocopy_pin_t) { .entry = pin, .first = first, .last = state->next - 1, .remaining = state->next - first };
+  }
+
+  HTTP_TRACE(zerocopy, http_trace_connection, segments[count - 1].len);
+  return result;
+}
+
+static int
+http_zerocopy_linger(int socketfd, http_zerocopy_t *state)
+{
+  // Hand `socketfd` over to the reaper. Returns 0 or -1.
+  struct timespec now;
+  uint64_t one = 1;
+  int *grown;
+  size_t capacity;
+
+  pthread_mutex_lock(&lingering_lock);
+  if (lingering_count == lingering_capacity) {
+    capacity = lingering_capacity ? lingering_capacity * 2 : HTTP_ZEROCOPY_PINS_MAX;
+    if ((grown = realloc(lingering, capacity * sizeof(*lingering))) == NULL) {
+      pthread_mutex_unlock(&lingering_lock);
+      return -1;
+    }
+    lingering = grown;
+    lingering_capacity = capacity;
+  }
+
+  // The peer still gets its end of file right after the data
+  shutdown(socketfd, SHUT_WR);
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  state->linger_until = now.tv_sec + HTTP_ZEROCOPY_LINGER;
+  lingering[lingering_count++] = socketfd;
+  pthread_mutex_unlock(&lingering_lock);
+
+  if (write(reaper_fd, &one, sizeof(one)) == -1)
+    logger(LOGL_WARN, NULL, "zerocopy: could not wake the reaper up");
+  return 0;
+}
+
+static void
+http_zerocopy_forget(int socketfd, http_zerocopy_t *state)
+{
+  // Bodies still in use stay referenced for good: leaking them is better
+  // than reusing memory the kernel may still send
+  if (state->pin_count > 0)
+    logger(LOGL_WARN, NULL, "zerocopy: connection closed with bodies still in flight, keeping them");
+  states[socketfd] = NULL;
+  free(state);
+}
+
+static void *
+http_zerocopy_reaper(void *arg)
+{
+  // Reap the completions of closed connections and close each once all
+  // of them are in, or after HTTP_ZEROCOPY_LINGER seconds
+  struct pollfd *pollfds = NULL, *grown;
+  size_t count, capacity = 0;
+  struct timespec now;
+  http_zerocopy_t *state;
+  uint64_t value;
+  int reaped, hangups, socketfd;
+
+  (void)arg;
+
+  while (1) {
+    pthread_mutex_lock(&lingering_lock);
+    count = lingering_count;
+    pthread_mutex_unlock(&lingering_lock);
+    if (count + 1 > capacity) {
+      if ((grown = realloc(pollfds, (count + 1) * sizeof(*pollfds))) == NULL) {
+        sleep(1);
+        continue;
+      }
+      pollfds = grown;
+      capacity = count + 1;
+    }
+
+    // Only the reaper removes, so the first `count` entries stay put
+    // until it does. POLLERR is always reported, the error queue sets it
+    pollfds[0] = (struct pollfd) { .fd = reaper_fd, .events = POLLIN };
+    pthread_mutex_lock(&lingering_lock);
+    for (size_t i = 0; i < count; i++)
+      pollfds[i + 1] = (struct pollfd) { .fd = lingering[i] };
+    pthread_mutex_unlock(&lingering_lock);
+
+    if (poll(pollfds, count + 1, 1000) == -1 && errno != EINTR) {
+      logger(LOGL_ERROR, NULL, "zerocopy: reaper poll failed");
+      sleep(1);
+      continue;
+    }
+    if (pollfds[0].revents & POLLIN)
+      while (read(reaper_fd, &value, sizeof(value)) == -1 && errno == EINTR);
+
+    reaped = hangups = 0;
+    for (size_t i = 0; i < count; i++) {
+      if (pollfds[i + 1].revents == 0)
+        continue;
+      if (http_zerocopy_reap(pollfds[i + 1].fd) > 0)
+        reaped = 1;
+      else if (pollfds[i + 1].revents & POLLHUP)
+        hangups = 1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    pthread_mutex_lock(&lingering_lock);
+    for (size_t i = count; i-- > 0;) {
+      socketfd = lingering[i];
+      state = states[socketfd];
+      if (state->pin_count > 0 && now.tv_sec < state->linger_until)
+        continue;
+      // Forgotten before it is closed: the descriptor may be reused
+      // right away
+      http_zerocopy_forget(socketfd, state);
+      close(socketfd);
+      lingering[i] = lingering[--lingering_count];
+    }
+    pthread_mutex_unlock(&lingering_lock);
+
+    // A socket shut down both ways keeps reporting POLLHUP
+    if (hangups && !reaped)
+      usleep(1000);
+  }
+
+  return NULL;
+}
+
+int
+http_zerocopy_close(int socketfd)
+{
+  // http_zerocopy_close():
+  // Forget `socketfd` before it is closed, its error queue goes with it.
+  // If the kernel may still send from bodies it pinned, the reaper
+  // thread takes `socketfd` over instead and closes it once they are
+  // done. Returns 1 if it did, 0 if the caller closes `socketfd`.
+
+  http_zerocopy_t *state;
+
+  if (states == NULL || (size_t)socketfd >= states_max || (state = states[socketfd]) == NULL)
+    return 0;
+
+  http_zerocopy_reap(socketfd);
+  if (state->pin_count > 0 && http_zerocopy_linger(socketfd, state) == 0)
+    return 1;
+  http_zerocopy_forget(socketfd, state);
+  return 0;
+}
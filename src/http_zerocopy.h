@@ -0,0 +1,22 @@
+// SPDX-License-Identifier: MIT
+
+#ifndef _HTTP_ZEROCOPY
+#define _HTTP_ZEROCOPY
+
+#include <stddef.h>
+
+#include "http_cache.h"
+#include "http_core.h"
+
+#define HTTP_ZEROCOPY_THRESHOLD_DEFAULT (64 * 1024) // bytes
+#define HTTP_ZEROCOPY_PINS_MAX 16 // bodies per connection waiting for the kernel
+#define HTTP_ZEROCOPY_LINGER 10 // seconds a closed connection is kept open for them
+
+extern long http_zerocopy_threshold; // 0 disables
+
+int http_zerocopy_init();
+int http_zerocopy_send(int socketfd, const http_segment_t *segments, size_t count, http_cache_entry_t *pin);
+int http_zerocopy_reap(int socketfd);
+int http_zerocopy_close(int socketfd);
+
+#endif
@@ -16,60 +16,30 @@ char log_output[PATH_MAX];
 int
 log_level_string_get(wsfs_str_t* out, int level)
 {
-  switch (level)
-  {
-    case LOGL_EMERG:
-      out->len = strlen(LOGL_STRING_EMERG);
-      out->string = (char*)malloc(out->len + 1);
-      out->string = LOGL_STRING_EMERG;
-      return 0;
-    case LOGL_ALERT:
-      out->len = strlen(LOGL_STRING_ALERT);
-      out->string = (char*)malloc(out->len + 1);
-      out->string = LOGL_STRING_ALERT;
-      return 0;
-    case LOGL_CRIT:
-      out->len = strlen(LOGL_STRING_CRIT);
-      out->string = (char*)malloc(out->len + 1);
-      out->string = LOGL_STRING_CRIT;
-      return 0;
-    case LOGL_ERROR:
-      out->len = strlen(LOGL_STRING_ERROR);
-      out->string = (char*)malloc(out->len + 1);
-      out->string = LOGL_STRING_ERROR;
-      return 0;
-    case LOGL_WARN:
-      out->len = strlen(LOGL_STRING_WARN);
-      out->string = (char*)malloc(out->len + 1);
-      out->string = LOGL_STRING_WARN;
-      return 0;
-    case LOGL_NOTICE:
-      out->len = strlen(LOGL_STRING_NOTICE);
-      out->string = (char*)malloc(out->len + 1);
-      out->string = LOGL_STRING_NOTICE;
-      return 0;
-    case LOGL_INFO:
-      out->len = strlen(LOGL_STRING_INFO);
-      out->string = (char*)malloc(out->len + 1);
-      out->string = LOGL_STRING_INFO;
-      return 0;
-    case LOGL_DEBUG:
-      out->len = strlen(LOGL_STRING_DEBUG);
-      out->string = (char*)malloc(out->len + 1);
-      out->string = LOGL_STRING_DEBUG;
-      return 0;
-    default:
-      return -1;
-  }
+  static const wsfs_str_t level_strings[] = {
+    [LOGL_EMERG] = WSFS_STR(LOGL_STRING_EMERG),
+    [LOGL_ALERT] = WSFS_STR(LOGL_STRING_ALERT),
+    [LOGL_CRIT] = WSFS_STR(LOGL_STRING_CRIT),
+    [LOGL_ERROR] = WSFS_STR(LOGL_STRING_ERROR),
+    [LOGL_WARN] = WSFS_STR(LOGL_STRING_WARN),
+    [LOGL_NOTICE] = WSFS_STR(LOGL_STRING_NOTICE),
+    [LOGL_INFO] = WSFS_STR(LOGL_STRING_INFO),
+    [LOGL_DEBUG] = WSFS_STR(LOGL_STRING_DEBUG),
+  };
+
+  if (level < LOGL_EMERG || level > LOGL_DEBUG)
+    return -1;
+  *out = level_strings[level];
+  return 0;
 }
 
 int
 logger(int level, wsfs_str_t* source, char *msg)
 {
   time_t rawtime;
-  struct tm * timeinfo;
+  struct tm timeinfo;
   wsfs_str_t level_string;
-  wsfs_str_t source_string = WSFS_STR_T_CHAR("INTERNAL");
+  wsfs_str_t source_string = WSFS_STR("INTERNAL");
 
   if (level > log_level)
     return -1;
@@ -77,13 +47,15 @@ logger(int level, wsfs_str_t* source, char *msg)
   if (source != NULL)
     memcpy(&source_string, source, sizeof(wsfs_str_t));
 
-  log_level_string_get(&level_string, level);
+  if (log_level_string_get(&level_string, level) != 0)
+    return -1;
 
   time( &rawtime );
-  timeinfo = localtime ( &rawtime );
+  localtime_r(&rawtime, &timeinfo);
   char timestamp_string[32];
-  strftime(timestamp_string, 32, "%F %T %z", timeinfo);
+  strftime(timestamp_string, 32, "%F %T %z", &timeinfo);
 
-  fprintf(stderr, "%s - [%s] - %s - \"%s\"\n", source_string.string, timestamp_string, level_string.string, msg);
+  fprintf(stderr, "%.*s - [%s] - %.*s - \"%s\"\n", (int)source_string.len, source_string.string, timestamp_string,
+    (int)level_string.len, level_string.string, msg);
   return 0;
 }
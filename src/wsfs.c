@@ -3,24 +3,52 @@
 #include <arpa/inet.h>
 #include <config.h>
 #include <ctype.h>
+#include <errno.h>
 #include <getopt.h>
 #include <limits.h>
+#include <fcntl.h>
 #include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "handoff.h"
+#include "http_buffer.h"
+#include "http_cache.h"
 #include "http_core.h"
+#include "http_file_cache.h"
+#include "http_io.h"
+#include "http_limit.h"
+#include "http_negative.h"
+#include "http_profile.h"
+#include "http_proxy.h"
+#include "http_static.h"
+#include "http_tls.h"
+#include "http_trace.h"
 #include "http_utils.h"
+#include "http_vhost.h"
+#include "http_zerocopy.h"
 #include "log_levels.h"
 #include "logger.h"
 
 #define DEF_PORT 8080
 #define OPTION_ERROR 1
-#define SERVER_BACKLOG 1
+#define SERVER_BACKLOG SOMAXCONN
+#define WORKERS_MAX 1024
+#define DEF_KEEPALIVE_TIMEOUT 5 // seconds
+#define WORKER_POLLFDS 3 // listener, drain pipe and I/O pool, ahead of idle connections
+#define IDLE_CAPACITY_MIN 16
+#define DEF_DRAIN_TIMEOUT 30 // seconds
+#define DEF_CACHE_SNAPSHOT_INTERVAL 60 // seconds
 
 #define S_EQ(a, b) (strcmp(a, b) == 0)
 
@@ -32,6 +60,35 @@ enum LONG_OPTS {
   OPT_INET4_PORT,
   OPT_INET6_PORT,
   OPT_TARGET,
+  OPT_PACK,
+  OPT_VHOSTS,
+  OPT_WORKERS,
+  OPT_FILE_CACHE_ENTRIES,
+  OPT_FILE_CACHE_TTL,
+  OPT_NEGATIVE_CACHE_TTL,
+  OPT_RESPONSE_CACHE_SIZE,
+  OPT_ZEROCOPY_THRESHOLD,
+  OPT_CACHE_SNAPSHOT,
+  OPT_CACHE_SNAPSHOT_INTERVAL,
+  OPT_TLS_CERT,
+  OPT_TLS_KEY,
+  OPT_TLS_TICKET_KEY,
+  OPT_IO_THREADS,
+  OPT_RATE_LIMIT,
+  OPT_RATE_LIMIT_BURST,
+  OPT_CONNECTION_LIMIT,
+  OPT_RATE_LIMIT_CLIENTS,
+  OPT_PROXY,
+  OPT_PROXY_TIMEOUT,
+  OPT_PROXY_HEALTH_INTERVAL,
+  OPT_PROXY_HEALTH_PATH,
+  OPT_KEEPALIVE_TIMEOUT,
+  OPT_REQUEST_TIMEOUT,
+  OPT_HANDOFF_SOCKET,
+  OPT_HANDOFF_FROM,
+  OPT_DRAIN_TIMEOUT,
+  OPT_PROFILE,
+  OPT_PROFILE_FREQUENCY,
 };
 
 enum IP_MODE {
@@ -42,7 +99,37 @@ enum IP_MODE {
 int in4_socket(struct in_addr *sin4_addr, in_port_t sin4_port);
 int in6_socket(struct in6_addr *sin6_addr, in_port_t sin6_port);
 
-int handle_connection(int client_socketfd);
+// A client connection, owned by one worker or I/O thread at a time
+typedef struct {
+  int                         socketfd;
+  http_limit_entry_t          *limit;
+  uint64_t                    trace_id;
+  http_request_t              request;
+  int64_t                     idle_until; // CLOCK_MONOTONIC milliseconds, while idle
+  int                         handshake; // poll() events a TLS handshake waits for, 0 once done
+} connection_t;
+
+int handle_connection(int client_socketfd, http_limit_entry_t *limit);
+void serve_connection(connection_t *connection);
+int serve_cold(void *arg);
+void close_connection(connection_t *connection);
+void *worker(void *arg);
+
+// Graceful shutdown and listener handoff
+void drain_start();
+void drain_wait();
+static void drain_signal(int signum);
+void *handoff_control(void *arg);
+
+// Virtual host reloads
+void *vhost_reloader(void *arg);
+
+// Profiling
+static void profile_signal(int signum);
+
+// Response cache snapshots
+void *cache_restore(void *arg);
+void *cache_snapshot_writer(void *arg);
 
 // Printf info for users
 void printf_help();
@@ -55,12 +142,47 @@ int handle_sin4_addr(struct in_addr *out, char *argument);
 int handle_sin_port(in_port_t *out, char *argument);
 int handle_sin6_addr(struct in6_addr *out, char *argument);
 int handle_target(char *out, char *argument);
+int handle_number(long *out, char *argument, long min, long max);
+int handle_path(char *out, char *argument);
 
 static int check(int exp, const char *msg);
 
 // General
 static int pid6 = -1;
 static uint8_t mode = IPV6 | IPV4;
+static long workers = 1;
+static long keepalive_timeout = DEF_KEEPALIVE_TIMEOUT;
+
+// Handoff and drain options
+static char handoff_socket[PATH_MAX];
+static char handoff_from[PATH_MAX];
+static long drain_timeout = DEF_DRAIN_TIMEOUT;
+
+// Response cache snapshot options
+static char cache_snapshot[PATH_MAX];
+static long cache_snapshot_interval = DEF_CACHE_SNAPSHOT_INTERVAL;
+static int cache_snapshot_bodies_flag;
+
+// TLS options
+static char tls_cert[PATH_MAX];
+static char tls_key[PATH_MAX];
+static char tls_ticket_key[PATH_MAX];
+
+// Drain state. Closing the write end of `drain_pipe` makes its read end
+// readable for every poll() at once.
+static int drain_pipe[2] = { -1, -1 };
+static atomic_int drain_flag;
+static atomic_int connections;
+static _Atomic uint64_t connection_ids; // for tracing
+
+// Idle keep-alive connections of the calling worker. They wait in its
+// poll() next to the listener instead of holding the worker, so one
+// idle client cannot keep it from accepting and serving others.
+static __thread connection_t **idle;
+static __thread struct pollfd *idle_pollfds; // WORKER_POLLFDS, then one per idle connection
+static __thread size_t idle_count, idle_capacity;
+static int listeners[HANDOFF_FDS_MAX];
+static size_t listener_count;
 
 // Info options flags
 static int verbose_flag;
@@ -77,18 +199,14 @@ static int sin6_only_flag = 0;
 static struct in6_addr sin6_addr;
 static in_port_t sin6_port = DEF_PORT;
 
-// Target options
-static char target[PATH_MAX];
-
 int
 main(int argc, char *argv[])
 {
   int c;
-  int in4_socketfd, in6_socketfd, in_socketfd;
+  int in4_socketfd = -1, in6_socketfd = -1, in_socketfd;
   memcpy(&sin6_addr, &in6addr_any, sizeof(in6addr_any));
 
-  int client_socketfd;
-  size_t client_addr_size;
+  long number;
 
   while (1) {
     static struct option options[] = {
@@ -115,6 +233,59 @@ main(int argc, char *argv[])
 
       // Target
       { "target", required_argument, 0, OPT_TARGET },
+      { "pack", required_argument, 0, OPT_PACK },
+      { "vhosts", required_argument, 0, OPT_VHOSTS },
+
+      // Workers
+      { "workers", required_argument, 0, OPT_WORKERS },
+      { "huge-pages", no_argument, &http_buffer_huge_pages, 1 },
+
+      // Open file cache
+      { "file-cache-entries", required_argument, 0, OPT_FILE_CACHE_ENTRIES },
+      { "file-cache-ttl", required_argument, 0, OPT_FILE_CACHE_TTL },
+      { "file-cache-inotify", no_argument, &http_file_cache_inotify, 1 },
+      { "negative-cache", no_argument, &http_negative_enabled, 1 },
+      { "negative-cache-ttl", required_argument, 0, OPT_NEGATIVE_CACHE_TTL },
+
+      // Response cache
+      { "response-cache-size", required_argument, 0, OPT_RESPONSE_CACHE_SIZE },
+      { "zerocopy-threshold", required_argument, 0, OPT_ZEROCOPY_THRESHOLD },
+      { "cache-snapshot", required_argument, 0, OPT_CACHE_SNAPSHOT },
+      { "cache-snapshot-interval", required_argument, 0, OPT_CACHE_SNAPSHOT_INTERVAL },
+      { "cache-snapshot-bodies", no_argument, &cache_snapshot_bodies_flag, 1 },
+
+      // TLS
+      { "tls-cert", required_argument, 0, OPT_TLS_CERT },
+      { "tls-key", required_argument, 0, OPT_TLS_KEY },
+      { "tls-ticket-key", required_argument, 0, OPT_TLS_TICKET_KEY },
+
+      // Disk I/O
+      { "io-threads", required_argument, 0, OPT_IO_THREADS },
+
+      // Rate limiting
+      { "rate-limit", required_argument, 0, OPT_RATE_LIMIT },
+      { "rate-limit-burst", required_argument, 0, OPT_RATE_LIMIT_BURST },
+      { "connection-limit", required_argument, 0, OPT_CONNECTION_LIMIT },
+      { "rate-limit-clients", required_argument, 0, OPT_RATE_LIMIT_CLIENTS },
+
+      // Reverse proxy
+      { "proxy", required_argument, 0, OPT_PROXY },
+      { "proxy-timeout", required_argument, 0, OPT_PROXY_TIMEOUT },
+      { "proxy-health-interval", required_argument, 0, OPT_PROXY_HEALTH_INTERVAL },
+      { "proxy-health-path", required_argument, 0, OPT_PROXY_HEALTH_PATH },
+
+      // Connections
+      { "keepalive-timeout", required_argument, 0, OPT_KEEPALIVE_TIMEOUT },
+      { "request-timeout", required_argument, 0, OPT_REQUEST_TIMEOUT },
+
+      // Handoff
+      { "handoff-socket", required_argument, 0, OPT_HANDOFF_SOCKET },
+      { "handoff-from", required_argument, 0, OPT_HANDOFF_FROM },
+      { "drain-timeout", required_argument, 0, OPT_DRAIN_TIMEOUT },
+
+      // Profiling
+      { "profile", required_argument, 0, OPT_PROFILE },
+      { "profile-frequency", required_argument, 0, OPT_PROFILE_FREQUENCY },
 
       // END
       { 0, 0, 0, 0 }
@@ -155,6 +326,100 @@ main(int argc, char *argv[])
     case OPT_TARGET:
       check(handle_target(target, optarg), "wsfs: --target fail.\n");
       break;
+    case OPT_PACK:
+      check(handle_path(pack, optarg), "wsfs: --pack fail.\n");
+      break;
+    case OPT_VHOSTS:
+      check(handle_path(http_vhost_file, optarg), "wsfs: --vhosts fail.\n");
+      break;
+    case OPT_WORKERS:
+      check(handle_number(&number, optarg, 1, WORKERS_MAX), "wsfs: --workers fail.\n");
+      workers = number;
+      break;
+    case OPT_FILE_CACHE_ENTRIES:
+      check(handle_number(&number, optarg, 0, LONG_MAX / 2), "wsfs: --file-cache-entries fail.\n");
+      http_file_cache_entries = number;
+      break;
+    case OPT_FILE_CACHE_TTL:
+      check(handle_number(&number, optarg, 0, INT32_MAX), "wsfs: --file-cache-ttl fail.\n");
+      http_file_cache_ttl = number;
+      break;
+    case OPT_NEGATIVE_CACHE_TTL:
+      check(handle_number(&number, optarg, 0, INT32_MAX), "wsfs: --negative-cache-ttl fail.\n");
+      http_negative_ttl = number;
+      break;
+    case OPT_RESPONSE_CACHE_SIZE:
+      check(handle_number(&number, optarg, 0, LONG_MAX), "wsfs: --response-cache-size fail.\n");
+      http_cache_size = number;
+      break;
+    case OPT_ZEROCOPY_THRESHOLD:
+      check(handle_number(&http_zerocopy_threshold, optarg, 0, LONG_MAX), "wsfs: --zerocopy-threshold fail.\n");
+      break;
+    case OPT_CACHE_SNAPSHOT:
+      check(handle_path(cache_snapshot, optarg), "wsfs: --cache-snapshot fail.\n");
+      break;
+    case OPT_CACHE_SNAPSHOT_INTERVAL:
+      check(handle_number(&cache_snapshot_interval, optarg, 1, 86400), "wsfs: --cache-snapshot-interval fail.\n");
+      break;
+    case OPT_TLS_CERT:
+      check(handle_path(tls_cert, optarg), "wsfs: --tls-cert fail.\n");
+      break;
+    case OPT_TLS_KEY:
+      check(handle_path(tls_key, optarg), "wsfs: --tls-key fail.\n");
+      break;
+    case OPT_TLS_TICKET_KEY:
+      check(handle_path(tls_ticket_key, optarg), "wsfs: --tls-ticket-key fail.\n");
+      break;
+    case OPT_IO_THREADS:
+      check(handle_number(&http_io_threads, optarg, 0, WORKERS_MAX), "wsfs: --io-threads fail.\n");
+      break;
+    case OPT_RATE_LIMIT:
+      check(handle_number(&http_limit_rate, optarg, 0, 1000000), "wsfs: --rate-limit fail.\n");
+      break;
+    case OPT_RATE_LIMIT_BURST:
+      check(handle_number(&http_limit_burst, optarg, 1, 1000000), "wsfs: --rate-limit-burst fail.\n");
+      break;
+    case OPT_CONNECTION_LIMIT:
+      check(handle_number(&http_limit_connections, optarg, 0, INT32_MAX), "wsfs: --connection-limit fail.\n");
+      break;
+    case OPT_RATE_LIMIT_CLIENTS:
+      check(handle_number(&number, optarg, 1, 1L << 30), "wsfs: --rate-limit-clients fail.\n");
+      http_limit_clients = number;
+      break;
+    case OPT_PROXY:
+      check(http_vhost_proxy(optarg), "wsfs: --proxy fail.\n");
+      break;
+    case OPT_PROXY_TIMEOUT:
+      check(handle_number(&http_proxy_timeout, optarg, 1, 3600), "wsfs: --proxy-timeout fail.\n");
+      break;
+    case OPT_PROXY_HEALTH_INTERVAL:
+      check(handle_number(&http_proxy_health_interval, optarg, 0, 3600), "wsfs: --proxy-health-interval fail.\n");
+      break;
+    case OPT_PROXY_HEALTH_PATH:
+      check(optarg[0] != '/' || strlen(optarg) >= sizeof(http_proxy_health_path), "wsfs: --proxy-health-path fail.\n");
+      strcpy(http_proxy_health_path, optarg);
+      break;
+    case OPT_KEEPALIVE_TIMEOUT:
+      check(handle_number(&keepalive_timeout, optarg, 0, 3600), "wsfs: --keepalive-timeout fail.\n");
+      break;
+    case OPT_REQUEST_TIMEOUT:
+      check(handle_number(&http_request_timeout, optarg, 1, 3600), "wsfs: --request-timeout fail.\n");
+      break;
+    case OPT_HANDOFF_SOCKET:
+      check(handle_path(handoff_socket, optarg), "wsfs: --handoff-socket fail.\n");
+      break;
+    case OPT_HANDOFF_FROM:
+      check(handle_path(handoff_from, optarg), "wsfs: --handoff-from fail.\n");
+      break;
+    case OPT_DRAIN_TIMEOUT:
+      check(handle_number(&drain_timeout, optarg, 0, 86400), "wsfs: --drain-timeout fail.\n");
+      break;
+    case OPT_PROFILE:
+      check(handle_path(http_profile_file, optarg), "wsfs: --profile fail.\n");
+      break;
+    case OPT_PROFILE_FREQUENCY:
+      check(handle_number(&http_profile_frequency, optarg, 1, 10000), "wsfs: --profile-frequency fail.\n");
+      break;
 
     case '?':
       break;
@@ -179,45 +444,602 @@ main(int argc, char *argv[])
   check(sin4_only_flag && sin6_only_flag,
     "--only4 argument conflicts with --only6 argument\n");
 
+  if (target[0] == '\0')
+    check(handle_target(target, "."), "wsfs: --target fail.\n");
+
+  // A client closing its end mid-response must not kill the server
+  signal(SIGPIPE, SIG_IGN);
+
+  if (pack[0] != '\0')
+    check(http_static_init(), "wsfs: --pack is not a readable site pack.\n");
+  else
+    check(http_static_init(), "wsfs: --target is not an accessible directory.\n");
+  check(http_vhost_init(), "wsfs: --vhosts fail.\n");
+
+  // SIGHUP reloads the virtual hosts. It is taken by a thread of its own,
+  // so every thread started from here on must have it blocked.
+  if (http_vhost_file[0] != '\0') {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+  }
+
+  // Before fork(), both processes must accept each other's session tickets
+  if (tls_cert[0] != '\0' || tls_key[0] != '\0') {
+    check(tls_cert[0] == '\0' || tls_key[0] == '\0', "wsfs: --tls-cert and --tls-key go together.\n");
+    check(http_tls_init(tls_cert, tls_key, tls_ticket_key), "wsfs: TLS initialization failed.\n");
+  }
+
   if (sin4_only_flag)
     mode ^= IPV6;
   if (sin6_only_flag)
     mode ^= IPV4;
 
+  // Take over the listening sockets of a running wsfs, if there is one
+  if (handoff_from[0] != '\0') {
+    int fds[HANDOFF_FDS_MAX];
+    size_t count;
+    struct sockaddr_storage address;
+    socklen_t address_size;
+
+    if (handoff_receive(handoff_from, fds, &count) == 0) {
+      for (size_t i = 0; i < count; i++) {
+        address_size = sizeof(address);
+        getsockname(fds[i], (struct sockaddr *)&address, &address_size);
+        if (address.ss_family == AF_INET && (mode & IPV4))
+          in4_socketfd = fds[i];
+        else if (address.ss_family == AF_INET6 && (mode & IPV6))
+          in6_socketfd = fds[i];
+        else
+          close(fds[i]);
+      }
+    } else
+      logger(LOGL_WARN, NULL, "handoff: nothing to take over, creating new sockets");
+  }
+
+  // Both sockets exist before fork(), so the IPv4 process can hand both of
+  // them over
+  if ((mode & IPV4) && in4_socketfd == -1)
+    in4_socketfd = in4_socket(&sin4_addr, sin4_port);
+  if ((mode & IPV6) && in6_socketfd == -1)
+    in6_socketfd = in6_socket(&sin6_addr, sin6_port);
+
+  if (in4_socketfd != -1)
+    listeners[listener_count++] = in4_socketfd;
+  if (in6_socketfd != -1)
+    listeners[listener_count++] = in6_socketfd;
+
   if (mode == (IPV6 | IPV4)) {
     // you may ask "Why fork()?"
     // Why not? <https://youtu.be/kVTx0JFQCkg?si=DJzJolab_20zk0I5&t=30>
-    if ((pid6 = fork()) == 0)
-      in_socketfd = in6_socketfd = in6_socket(&sin6_addr, sin6_port);
-    else
-      in_socketfd = in4_socketfd = in4_socket(&sin4_addr, sin4_port);
+    if ((pid6 = fork()) == 0) {
+      close(in4_socketfd);
+      // Each process profiles itself
+      if (http_profile_file[0] != '\0') {
+        check(strlen(http_profile_file) + sizeof(".ipv6") > sizeof(http_profile_file), "wsfs: --profile fail.\n");
+        strcat(http_profile_file, ".ipv6");
+      }
+      in_socketfd = in6_socketfd;
+    } else
+      in_socketfd = in4_socketfd;
   } else if (mode == IPV6)
-    in_socketfd = in6_socketfd = in6_socket(&sin6_addr, sin6_port);
+    in_socketfd = in6_socketfd;
   else
-    in_socketfd = in4_socketfd = in4_socket(&sin4_addr, sin4_port);
+    in_socketfd = in4_socketfd;
+
+  // Threads do not survive fork(), so everything that starts one comes
+  // after it
+  check(http_file_cache_init(), "wsfs: file cache initialization failed.\n");
+  check(http_negative_init(), "wsfs: negative cache initialization failed.\n");
+  check(http_cache_init(), "wsfs: response cache initialization failed.\n");
+  check(http_zerocopy_init(), "wsfs: zerocopy table allocation failed.\n");
+  check(http_io_init(serve_cold), "wsfs: I/O thread creation failed.\n");
+  check(http_limit_init(), "wsfs: rate limit table allocation failed.\n");
+  check(http_proxy_init(), "wsfs: proxy health check thread creation failed.\n");
+  check(http_profile_init(), "wsfs: --profile fail.\n");
+  signal(SIGUSR2, profile_signal);
+
+  if (http_vhost_file[0] != '\0') {
+    pthread_t thread;
+    check(pthread_create(&thread, NULL, vhost_reloader, NULL), "wsfs: vhost reload thread creation failed.\n");
+    pthread_detach(thread);
+  }
 
-  struct sockaddr_in client_addr;
-  while (1) {
-    client_addr_size = sizeof(struct sockaddr_in);
-    check((client_socketfd = accept(in_socketfd, (struct sockaddr *)&client_addr,
-             (socklen_t *)&client_addr_size))
-        == -1,
-      "accept failed.\n");
-    handle_connection(client_socketfd);
+  // Refill the response cache in the background, requests are served
+  // from the start. Only the process owning every listening socket
+  // writes snapshots, both restore from them.
+  if (cache_snapshot[0] != '\0') {
+    pthread_t thread;
+    check(pthread_create(&thread, NULL, cache_restore, NULL), "wsfs: cache restore thread creation failed.\n");
+    pthread_detach(thread);
+    if (pid6 != 0) {
+      check(pthread_create(&thread, NULL, cache_snapshot_writer, NULL), "wsfs: cache snapshot thread creation failed.\n");
+      pthread_detach(thread);
+    }
   }
 
+  check(pipe2(drain_pipe, O_CLOEXEC), "wsfs: pipe creation failed.\n");
+  signal(SIGTERM, drain_signal);
+  signal(SIGINT, drain_signal);
+
+  // Workers poll() before accept(), so the shared listening socket must
+  // not block the ones that lose the race
+  fcntl(in_socketfd, F_SETFL, fcntl(in_socketfd, F_GETFL) | O_NONBLOCK);
+
+  // Every worker thread accepts on the same listening socket
+  for (long i = 0; i < workers; i++) {
+    pthread_t thread;
+    check(pthread_create(&thread, NULL, worker, &in_socketfd), "wsfs: worker creation failed.\n");
+    pthread_detach(thread);
+  }
+
+  // Only the process owning every listening socket can hand them over
+  if (handoff_socket[0] != '\0' && pid6 != 0) {
+    pthread_t thread;
+    int control_socketfd = handoff_listen(handoff_socket);
+    check(control_socketfd == -1, "wsfs: --handoff-socket fail.\n");
+    check(pthread_create(&thread, NULL, handoff_control, &control_socketfd), "wsfs: handoff thread creation failed.\n");
+    pthread_detach(thread);
+  }
+
+  drain_wait();
+
+  if (http_profile_file[0] != '\0' && http_profile_write() != 0)
+    logger(LOGL_WARN, NULL, "profile: writing folded stacks failed");
+
+  // The next start begins where this one left off
+  if (cache_snapshot[0] != '\0' && pid6 != 0)
+    http_cache_snapshot(cache_snapshot, cache_snapshot_bodies_flag);
+
   exit(EXIT_SUCCESS);
 }
 
+void
+drain_start()
+{
+  // drain_start():
+  // Stop accepting and let open connections finish. Async-signal-safe.
+
+  if (atomic_exchange(&drain_flag, 1) == 0)
+    close(drain_pipe[1]);
+}
+
+static int
+draining()
+{
+  return atomic_load(&drain_flag);
+}
+
+void
+drain_wait()
+{
+  // drain_wait():
+  // Block until drain_start() is called, then wait up to `drain_timeout`
+  // seconds for in-flight and keep-alive connections to close.
+
+  struct pollfd pollfd = { .fd = drain_pipe[0], .events = POLLIN };
+  struct timespec now, deadline;
+
+  while (poll(&pollfd, 1, -1) != 1)
+    ;
+
+  // The IPv6 process drains alongside this one
+  if (pid6 > 0)
+    kill(pid6, SIGTERM);
+
+  logger(LOGL_NOTICE, NULL, "draining connections");
+
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  deadline.tv_sec += drain_timeout;
+
+  do {
+    if (atomic_load(&connections) == 0)
+      break;
+    usleep(10000);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+  } while (now.tv_sec < deadline.tv_sec
+    || (now.tv_sec == deadline.tv_sec && now.tv_nsec < deadline.tv_nsec));
+
+  if (pid6 > 0)
+    waitpid(pid6, NULL, 0);
+}
+
+static void
+drain_signal(int signum)
+{
+  (void)signum;
+  drain_start();
+}
+
+void *
+handoff_control(void *arg)
+{
+  // Serve handoff requests until one succeeds, then drain
+  int control_socketfd = *(int *)arg;
+
+  while (handoff_send(control_socketfd, listeners, listener_count) != 0)
+    ;
+
+  logger(LOGL_NOTICE, NULL, "handoff: listening sockets passed on");
+  close(control_socketfd);
+  drain_start();
+  return NULL;
+}
+
+void *
+vhost_reloader(void *arg)
+{
+  // Reload the virtual hosts on every SIGHUP, in both processes
+  sigset_t set;
+  int signum;
+  (void)arg;
+
+  sigemptyset(&set);
+  sigaddset(&set, SIGHUP);
+
+  while (sigwait(&set, &signum) == 0) {
+    if (pid6 > 0)
+      kill(pid6, SIGHUP);
+    if (http_vhost_reload() != 0)
+      logger(LOGL_WARN, NULL, "vhosts: reload failed, keeping the previous virtual hosts");
+  }
+  return NULL;
+}
+
+static void
+profile_signal(int signum)
+{
+  // SIGUSR2 pauses or resumes profiling, in both processes
+  (void)signum;
+  if (pid6 > 0)
+    kill(pid6, SIGUSR2);
+  http_profile_toggle();
+}
+
+void *
+cache_restore(void *arg)
+{
+  (void)arg;
+
+  if (http_cache_restore(cache_snapshot, http_static_warm) == 0)
+    logger(LOGL_NOTICE, NULL, "response cache restored from snapshot");
+  return NULL;
+}
+
+void *
+cache_snapshot_writer(void *arg)
+{
+  (void)arg;
+
+  while (!draining()) {
+    sleep(cache_snapshot_interval);
+    if (http_cache_snapshot(cache_snapshot, cache_snapshot_bodies_flag) != 0)
+      logger(LOGL_WARN, NULL, "response cache snapshot failed");
+  }
+  return NULL;
+}
+
+static int64_t
+monotonic_ms()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static int
+idle_grow()
+{
+  // Make room for one more idle connection. Returns 0 or -1.
+  struct pollfd *pollfds;
+  connection_t **connections;
+  size_t capacity = idle_capacity != 0 ? idle_capacity * 2 : IDLE_CAPACITY_MIN;
+
+  if ((pollfds = realloc(idle_pollfds, (WORKER_POLLFDS + capacity) * sizeof(*pollfds))) == NULL)
+    return -1;
+  idle_pollfds = pollfds;
+  if ((connections = realloc(idle, capacity * sizeof(*connections))) == NULL)
+    return -1;
+  idle = connections;
+  idle_capacity = capacity;
+  return 0;
+}
+
+static void
+idle_park(connection_t *connection, long timeout)
+{
+  // Serve what `connection` already has buffered, or leave it to the
+  // worker's poll() until its next request arrives or `timeout` seconds
+  // pass
+  if (connection->handshake == 0 && (connection->request.raw_len > 0 || http_tls_pending(connection->socketfd))) {
+    serve_connection(connection);
+    return;
+  }
+  if (idle_count == idle_capacity && idle_grow() != 0) {
+    close_connection(connection);
+    return;
+  }
+  connection->idle_until = monotonic_ms() + timeout * 1000;
+  idle[idle_count++] = connection;
+}
+
+static int
+idle_timeout()
+{
+  // Milliseconds until the first idle connection times out, -1 if none
+  int64_t first = INT64_MAX;
+
+  if (idle_count == 0)
+    return -1;
+  for (size_t i = 0; i < idle_count; i++)
+    if (idle[i]->idle_until < first)
+      first = idle[i]->idle_until;
+  first -= monotonic_ms();
+  return first > 0 ? (int)first : 0;
+}
+
+static void
+idle_handshake(connection_t *connection)
+{
+  // Take the TLS handshake of `connection` one step further. The
+  // connection keeps the deadline it was accepted with, for the
+  // handshake and its first request.
+  if ((connection->handshake = http_tls_accept(connection->socketfd)) == -1) {
+    close_connection(connection);
+    return;
+  }
+  if (connection->handshake == 0 && http_tls_pending(connection->socketfd)) {
+    serve_connection(connection);
+    return;
+  }
+  idle[idle_count++] = connection;
+}
+
+static void
+idle_serve()
+{
+  // Serve the idle connections poll() found a request on and close those
+  // past the keep-alive timeout. Walked from the end, so a connection
+  // moved into a freed slot, or parked again, has been looked at.
+  connection_t *connection;
+  int64_t now = monotonic_ms();
+  short revents;
+
+  for (size_t i = idle_count; i-- > 0;) {
+    connection = idle[i];
+    revents = idle_pollfds[WORKER_POLLFDS + i].revents;
+
+    // Zero-copy completions on the error queue report POLLERR too
+    if (revents == POLLERR && http_zerocopy_reap(connection->socketfd) > 0)
+      revents = 0;
+    if (revents == 0 && connection->idle_until > now)
+      continue;
+
+    idle[i] = idle[--idle_count];
+    if (revents == 0) {
+      close_connection(connection);
+      continue;
+    }
+    http_trace_connection = connection->trace_id;
+    if (connection->handshake != 0)
+      idle_handshake(connection);
+    else
+      serve_connection(connection);
+  }
+}
+
+void *
+worker(void *arg)
+{
+  int in_socketfd = *(int *)arg;
+  int client_socketfd;
+  struct sockaddr_storage client_addr;
+  socklen_t client_addr_size;
+  http_limit_entry_t *limit;
+  connection_t *connection;
+
+  http_profile_thread();
+
+  if (idle_grow() != 0) {
+    logger(LOGL_ERROR, NULL, "worker: out of memory");
+    return NULL;
+  }
+
+  while (1) {
+    idle_pollfds[0] = (struct pollfd) { .fd = in_socketfd, .events = POLLIN };
+    idle_pollfds[1] = (struct pollfd) { .fd = drain_pipe[0], .events = POLLIN };
+    idle_pollfds[2] = (struct pollfd) { .fd = http_io_completion_fd, .events = POLLIN };
+    for (size_t i = 0; i < idle_count; i++)
+      idle_pollfds[WORKER_POLLFDS + i] = (struct pollfd) { .fd = idle[i]->socketfd, .events = idle[i]->handshake != 0 ? idle[i]->handshake : POLLIN };
+
+    if (poll(idle_pollfds, WORKER_POLLFDS + idle_count, idle_timeout()) == -1)
+      continue;
+    if (idle_pollfds[1].revents != 0) {
+      while (idle_count > 0)
+        close_connection(idle[--idle_count]);
+      break;
+    }
+
+    // Connections coming back from the I/O pool
+    if (idle_pollfds[2].revents != 0 && (connection = http_io_completed()) != NULL) {
+      http_trace_connection = connection->trace_id;
+      idle_park(connection, keepalive_timeout);
+    }
+
+    idle_serve();
+
+    if (idle_pollfds[0].revents == 0)
+      continue;
+
+    client_addr_size = sizeof(client_addr);
+    client_socketfd = accept4(in_socketfd, (struct sockaddr *)&client_addr, &client_addr_size, SOCK_CLOEXEC);
+    if (client_socketfd == -1) {
+      // Another worker or process took it, or the client gave up
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED)
+        logger(LOGL_ERROR, NULL, "accept failed");
+      continue;
+    }
+
+    // Turned away before anything is read from it. A TLS client could
+    // not read a plaintext 429.
+    if (http_limit_acquire(&limit, (struct sockaddr *)&client_addr) != 0) {
+      if (!http_tls_enabled())
+        http_send_error(client_socketfd, ERROR_TOO_MANY_REQUESTS, NULL, NULL);
+      close(client_socketfd);
+      continue;
+    }
+
+    http_trace_connection = atomic_fetch_add(&connection_ids, 1);
+    HTTP_TRACE(accept, http_trace_connection, client_socketfd);
+
+    atomic_fetch_add(&connections, 1);
+    handle_connection(client_socketfd, limit);
+  }
+
+  free(idle_pollfds);
+  free(idle);
+  return NULL;
+}
+
 int
-handle_connection(int client_socketfd)
+handle_connection(int client_socketfd, http_limit_entry_t *limit)
 {
-  http_request_t *http_client_request = (http_request_t *)malloc(sizeof(http_request_t));
-  http_parse_request(http_client_request, client_socketfd);
-  free(http_client_request);
+  struct timeval timeout = { .tv_sec = http_request_timeout };
+  connection_t *connection = (connection_t *)malloc(sizeof(connection_t));
+
+  if (connection == NULL) {
+    close(client_socketfd);
+    http_limit_release(limit);
+    atomic_fetch_sub(&connections, 1);
+    return -1;
+  }
+
+  connection->socketfd = client_socketfd;
+  connection->limit = limit;
+  connection->trace_id = http_trace_connection;
+  connection->request.raw = NULL;
+  connection->request.raw_len = 0;
+  // The handshake is left to the worker's poll() like a request
+  connection->handshake = http_tls_enabled() ? POLLIN : 0;
+
+  // Bound how long a blocking read or send may wait for the client, a
+  // worker serves every other connection in between
+  setsockopt(client_socketfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(client_socketfd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+  idle_park(connection, http_request_timeout);
   return 0;
 }
 
+static int
+serve_request(connection_t *connection)
+{
+  const http_vhost_t *vhost = http_vhost_enter(&connection->request);
+  http_proxy_route_t *route;
+  int result;
+
+  if ((route = http_vhost_route(vhost, &connection->request)) != NULL)
+    result = http_proxy_serve(&connection->request, connection->socketfd, route);
+  else
+    result = http_static_serve(&connection->request, connection->socketfd, &vhost->root);
+
+  http_vhost_exit();
+  return result;
+}
+
+static void
+next_request(http_request_t *request)
+{
+  // Keep what the client pipelined after this request
+  request->raw_len -= request->header_len;
+  memmove(request->raw, request->raw + request->header_len, request->raw_len);
+  http_request_release(request);
+}
+
+void
+serve_connection(connection_t *connection)
+{
+  // serve_connection():
+  // Serve requests on `connection`, which has one to read, until it is
+  // closed or waits for the next one in the worker's poll(), or until a
+  // response has to wait for the disk and the connection moves to the
+  // I/O pool.
+
+  int status, result = 0;
+  char retry_after_header[64];
+  time_t retry_after;
+  int client_socketfd = connection->socketfd;
+  http_request_t *http_client_request = &connection->request;
+
+  do {
+    status = http_parse_request(http_client_request, client_socketfd);
+    if (status != 0) {
+      if (status > 0)
+        http_send_error(client_socketfd, status, NULL, NULL);
+      break;
+    }
+
+    if (draining() || keepalive_timeout == 0)
+      http_client_request->keep_alive = 0;
+
+    // Refused before any file or upstream is touched for it
+    if (http_limit_request(connection->limit, &retry_after) != 0) {
+      snprintf(retry_after_header, sizeof(retry_after_header), "Retry-After: %ld\r\n", (long)retry_after);
+      result = http_send_error(client_socketfd, ERROR_TOO_MANY_REQUESTS, retry_after_header, http_client_request);
+    } else if ((result = serve_request(connection)) == HTTP_IO_COLD) {
+      http_io_submit(connection);
+      return;
+    }
+
+    next_request(http_client_request);
+
+    // Waiting for the next request is left to the worker's poll()
+    if (result == 0 && http_client_request->keep_alive && http_client_request->raw_len == 0
+      && !http_tls_pending(client_socketfd)) {
+      idle_park(connection, keepalive_timeout);
+      return;
+    }
+  } while (result == 0 && http_client_request->keep_alive);
+
+  close_connection(connection);
+}
+
+int
+serve_cold(void *arg)
+{
+  // serve_cold():
+  // Send the response that was waiting for the disk, on an I/O thread.
+  // Returns 1 to have a worker continue with the connection.
+
+  connection_t *connection = arg;
+  int result;
+
+  http_trace_connection = connection->trace_id;
+  result = serve_request(connection);
+  next_request(&connection->request);
+
+  if (result == 0 && connection->request.keep_alive && !draining())
+    return 1;
+  close_connection(connection);
+  return 0;
+}
+
+void
+close_connection(connection_t *connection)
+{
+  http_tls_close(connection->socketfd);
+  // With zero-copy sends in flight the socket is closed by their reaper
+  if (http_zerocopy_close(connection->socketfd) == 0)
+    close(connection->socketfd);
+  HTTP_TRACE(close, connection->trace_id);
+  connection->request.raw_len = 0;
+  http_request_release(&connection->request);
+  http_limit_release(connection->limit);
+  free(connection);
+  atomic_fetch_sub(&connections, 1);
+}
+
 int
 in4_socket(struct in_addr *in4_addr, in_port_t in4_port)
 {
@@ -398,9 +1220,29 @@ handle_sin6_addr(struct in6_addr *out, char *argument)
 int
 handle_target(char *out, char *argument)
 {
-  char temp[PATH_MAX];
-  if (realpath(argument, temp) == NULL)
+  if (realpath(argument, out) == NULL)
+    return OPTION_ERROR;
+  return 0;
+}
+
+int
+handle_path(char *out, char *argument)
+{
+  if (strlen(argument) >= PATH_MAX)
+    return OPTION_ERROR;
+  strcpy(out, argument);
+  return 0;
+}
+
+int
+handle_number(long *out, char *argument, long min, long max)
+{
+  char *end;
+  long temp = strtol(argument, &end, 10);
+  if (end == argument || *end != '\0' || temp < min || temp > max)
     return OPTION_ERROR;
+
+  *out = temp;
   return 0;
 }
 
@@ -412,6 +1254,62 @@ printf_help()
                                  "Options:\n"
                                  "--help           Show this help page.\n"
                                  "--version        Show package version.\n"
+                                 "--target=DIR     Serve files from DIR (default: current directory).\n"
+                                 "--pack=FILE      Serve the site pack FILE built by wsfs-pack instead of --target.\n"
+                                 "--vhosts=FILE    Serve the virtual hosts defined in FILE by their Host field,\n"
+                                 "                 other requests from --target. SIGHUP reloads FILE.\n"
+                                 "--workers=N      Handle connections with N threads (default: 1).\n"
+                                 "--huge-pages     Back request buffers with reserved huge pages.\n"
+                                 "--keepalive-timeout=SEC  Close idle connections after SEC seconds, 0 closes every\n"
+                                 "                 connection after one request (default: 5).\n"
+                                 "--request-timeout=SEC  Close connections that take longer than SEC seconds to send\n"
+                                 "                 a request, or to take any part of a response (default: 10).\n"
+                                 "--io-threads=N   Send files that are not in the page cache from N threads,\n"
+                                 "                 0 sends them from the workers (default: 4).\n"
+                                 "\n"
+                                 "Open file cache:\n"
+                                 "--file-cache-entries=N  Keep up to N files open, 0 disables (default: 1024).\n"
+                                 "--file-cache-ttl=SEC    Trust a cached file for SEC seconds (default: 10).\n"
+                                 "--file-cache-inotify    Drop cached files as soon as they change.\n"
+                                 "--negative-cache        Answer requests for missing files without looking them up, from an\n"
+                                 "                        index of the --target tree kept current with inotify.\n"
+                                 "--negative-cache-ttl=SEC  Remember other missing files for SEC seconds, 0 disables (default: 2).\n"
+                                 "\n"
+                                 "Compression:\n"
+                                 "--response-cache-size=BYTES  Memory for compressed responses, 0 disables (default: 64 MiB).\n"
+                                 "--zerocopy-threshold=BYTES  Send cached responses of at least BYTES with MSG_ZEROCOPY,\n"
+                                 "                        0 disables (default: 64 KiB).\n"
+                                 "--cache-snapshot=FILE   Save the hot response cache keys to FILE and refill from it on start.\n"
+                                 "--cache-snapshot-interval=SEC  Save a snapshot every SEC seconds (default: 60).\n"
+                                 "--cache-snapshot-bodies  Save the cached bodies too, not only their keys.\n"
+                                 "\n"
+                                 "TLS:\n"
+                                 "--tls-cert=FILE         Speak TLS with the PEM certificate chain in FILE.\n"
+                                 "--tls-key=FILE          Private key for --tls-cert.\n"
+                                 "--tls-ticket-key=FILE   Session ticket keys (80 random bytes), resumption survives restarts.\n"
+                                 "\n"
+                                 "Rate limiting, per IPv4 address or IPv6 /64:\n"
+                                 "--rate-limit=N          Allow N requests per second, 0 disables (default: 0).\n"
+                                 "--rate-limit-burst=N    Allow bursts of N requests (default: the rate).\n"
+                                 "--connection-limit=N    Allow N open connections, 0 disables (default: 0).\n"
+                                 "--rate-limit-clients=N  Track up to about N clients (default: 65536).\n"
+                                 "\n"
+                                 "Reverse proxy:\n"
+                                 "--proxy=PREFIX=UPSTREAM[,UPSTREAM]...  Forward requests under PREFIX to the HTTP/1.1\n"
+                                 "                        upstreams, each HOST:PORT or unix:PATH. Repeatable.\n"
+                                 "--proxy-timeout=SEC     Give up on an upstream after SEC seconds (default: 30).\n"
+                                 "--proxy-health-interval=SEC  Probe upstreams every SEC seconds, 0 disables (default: 5).\n"
+                                 "--proxy-health-path=PATH  Path of the HEAD request probing upstreams (default: /).\n"
+                                 "\n"
+                                 "Restarts:\n"
+                                 "--handoff-socket=PATH   Pass listening sockets to a new wsfs connecting to PATH.\n"
+                                 "--handoff-from=PATH     Take over listening sockets from the wsfs at PATH.\n"
+                                 "--drain-timeout=SEC     Wait up to SEC seconds for connections on shutdown (default: 30).\n"
+                                 "\n"
+                                 "Profiling:\n"
+                                 "--profile=FILE          Sample the request threads and keep FILE updated with folded stacks.\n"
+                                 "                        The IPv6 process writes FILE.ipv6. SIGUSR2 pauses and resumes.\n"
+                                 "--profile-frequency=HZ  Take HZ samples per second of CPU time (default: 99).\n"
                                  "\n"
                                  "Report bugs to: <" PACKAGE_URL "/issues>\n"
                                  "Wsfs home page: <" PACKAGE_URL ">\n";
@@ -0,0 +1,509 @@
+// SPDX-License-Identifier: MIT
+
+#include <config.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <getopt.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/ptrace.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// wsfs-budget
+//
+// Start wsfs on loopback under ptrace() with wsfs-budget-shim.so
+// preloaded, drive fixed request scenarios against it and count the
+// system calls made by all of its threads and the calls into its
+// allocator. Each scenario sends SCENARIO_REQUESTS requests on one
+// keep-alive connection after a warm-up request, one or several per
+// write. It is measured from the moment wsfs goes quiet after the
+// warm-up to the moment it goes quiet again, so accept() and close()
+// are not part of it. The counts per request are checked against a
+// budgets file and any scenario over budget fails the run.
+//
+// The budgets file has one "SCENARIO SYSCALLS ALLOCATIONS" line per
+// scenario, averages per request that may be fractional: calls made
+// once in a while, such as the allocator growing its heap, are spread
+// over the requests. Blank lines and lines starting with '#' are
+// skipped.
+
+#define OPTION_ERROR 1
+#define SCENARIO_REQUESTS 64
+#define QUIET_INTERVAL 20 // milliseconds without a count changing ...
+#define QUIET_ROUNDS 5 // ... this many times in a row
+#define START_TIMEOUT 5 // seconds wsfs may take to accept connections
+#define RESPONSE_MAX 65536
+#define SMALL_SIZE 2048
+#define LARGE_SIZE (1024 * 1024)
+
+typedef struct {
+  const char                  *name;
+  const char                  *path; // %d is the request number
+  const char                  *fields; // added to every request
+  int                         depth; // requests per write
+  int                         budgeted;
+  double                      budget_syscalls; // per request
+  double                      budget_allocations;
+  double                      syscalls; // per request, as measured
+  double                      allocations;
+} scenario_t;
+
+static scenario_t scenarios[] = {
+  { .name = "cached", .path = "/index.html", .depth = 1 },
+  { .name = "miss", .path = "/miss/%d.html", .depth = 1 },
+  { .name = "not-modified", .path = "/index.html", .fields = "If-None-Match: %s\r\n", .depth = 1 },
+  { .name = "range", .path = "/large.bin", .fields = "Range: bytes=1000-1999\r\n", .depth = 1 },
+  { .name = "pipelined", .path = "/index.html", .depth = 8 },
+};
+
+#define SCENARIOS (sizeof(scenarios) / sizeof(scenarios[0]))
+
+static int help_flag;
+static int version_flag;
+
+static char root[] = "/tmp/wsfs-budget.XXXXXX";
+static char etag[256];
+static int port;
+static pid_t server_pid;
+static _Atomic unsigned long syscalls;
+static _Atomic unsigned long *allocations;
+static int result = EXIT_FAILURE;
+
+static void
+fail(const char *what)
+{
+  fprintf(stderr, "wsfs-budget: %s: %s\n", what, strerror(errno));
+  exit(EXIT_FAILURE);
+}
+
+static void
+budgets_read(const char *path)
+{
+  char line[256], name[64];
+  double budget_syscalls, budget_allocations;
+  size_t i;
+  FILE *file;
+
+  if ((file = fopen(path, "r")) == NULL)
+    fail(path);
+
+  while (fgets(line, sizeof(line), file) != NULL) {
+    if (line[0] == '#' || line[strspn(line, " \t\n")] == '\0')
+      continue;
+    if (sscanf(line, "%63s %lf %lf", name, &budget_syscalls, &budget_allocations) != 3) {
+      fprintf(stderr, "wsfs-budget: %s: bad line: %s", path, line);
+      exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < SCENARIOS && strcmp(scenarios[i].name, name) != 0; i++)
+      ;
+    if (i == SCENARIOS) {
+      fprintf(stderr, "wsfs-budget: %s: unknown scenario %s\n", path, name);
+      exit(EXIT_FAILURE);
+    }
+    scenarios[i].budget_syscalls = budget_syscalls;
+    scenarios[i].budget_allocations = budget_allocations;
+    scenarios[i].budgeted = 1;
+  }
+  fclose(file);
+
+  // Every scenario needs a budget, a missing one would always pass
+  for (i = 0; i < SCENARIOS; i++) {
+    if (!scenarios[i].budgeted) {
+      fprintf(stderr, "wsfs-budget: %s: no budget for %s\n", path, scenarios[i].name);
+      exit(EXIT_FAILURE);
+    }
+  }
+}
+
+static void
+file_write(const char *name, size_t size)
+{
+  char path[PATH_MAX];
+  char *data;
+  int fd;
+
+  snprintf(path, sizeof(path), "%s/%s", root, name);
+  if ((data = malloc(size)) == NULL)
+    fail(path);
+  for (size_t i = 0; i < size; i++)
+    data[i] = 'a' + i % 26;
+  if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) == -1
+    || write(fd, data, size) != (ssize_t)size || close(fd) == -1)
+    fail(path);
+  free(data);
+}
+
+static void
+site_create()
+{
+  char name[64];
+
+  if (mkdtemp(root) == NULL)
+    fail(root);
+  file_write("index.html", SMALL_SIZE);
+  file_write("large.bin", LARGE_SIZE);
+
+  snprintf(name, sizeof(name), "%s/miss", root);
+  if (mkdir(name, 0755) == -1)
+    fail(name);
+  for (int i = 0; i < SCENARIO_REQUESTS; i++) {
+    snprintf(name, sizeof(name), "miss/%d.html", i);
+    file_write(name, SMALL_SIZE);
+  }
+}
+
+static int
+site_remove_entry(const char *path, const struct stat *sb, int typeflag, struct FTW *ftwbuf)
+{
+  (void)sb;
+  (void)ftwbuf;
+  return typeflag == FTW_DP ? rmdir(path) : unlink(path);
+}
+
+static void
+port_pick()
+{
+  struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+  socklen_t addr_len = sizeof(addr);
+  int socketfd;
+
+  // A port the kernel just handed out is free for the moment
+  if ((socketfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1
+    || bind(socketfd, (struct sockaddr *)&addr, sizeof(addr)) == -1
+    || getsockname(socketfd, (struct sockaddr *)&addr, &addr_len) == -1)
+    fail("port");
+  port = ntohs(addr.sin_port);
+  close(socketfd);
+}
+
+static void
+server_start(char *wsfs, char **extra, int extra_count, const char *shim)
+{
+  char port_arg[16], fd_arg[16];
+  char **args;
+  int fd, null_fd, i = 0;
+
+  // The shim counts into this page, it survives exec() as a descriptor
+  if ((fd = memfd_create("wsfs-budget", 0)) == -1 || ftruncate(fd, sizeof(*allocations)) == -1)
+    fail("memfd_create");
+  allocations = mmap(NULL, sizeof(*allocations), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (allocations == MAP_FAILED)
+    fail("mmap");
+
+  if ((args = calloc(extra_count + 10, sizeof(*args))) == NULL)
+    fail("calloc");
+  snprintf(port_arg, sizeof(port_arg), "%d", port);
+  args[i++] = wsfs;
+  args[i++] = "--only4";
+  args[i++] = "--port4";
+  args[i++] = port_arg;
+  args[i++] = "--target";
+  args[i++] = root;
+  // Revalidating open files would land in whichever scenario runs then
+  args[i++] = "--file-cache-ttl";
+  args[i++] = "3600";
+  for (int j = 0; j < extra_count; j++)
+    args[i++] = extra[j];
+
+  if ((server_pid = fork()) == -1)
+    fail("fork");
+  if (server_pid > 0) {
+    close(fd);
+    free(args);
+    return;
+  }
+
+  snprintf(fd_arg, sizeof(fd_arg), "%d", fd);
+  setenv("WSFS_BUDGET_FD", fd_arg, 1);
+  setenv("LD_PRELOAD", shim, 1);
+  if ((null_fd = open("/dev/null", O_WRONLY)) != -1)
+    dup2(null_fd, STDOUT_FILENO);
+
+  if (ptrace(PTRACE_TRACEME, 0, NULL, NULL) == -1)
+    fail("ptrace");
+  raise(SIGSTOP);
+  execv(wsfs, args);
+  fail(wsfs);
+}
+
+static void
+server_trace()
+{
+  // Count system call entries of every thread of wsfs until it exits.
+  // Other stops are resumed, with their signal unless it is the SIGSTOP
+  // new threads start with.
+  uint8_t op;
+  pid_t tid;
+  int status, deliver;
+
+  if (waitpid(server_pid, &status, 0) == -1 || !WIFSTOPPED(status))
+    fail("waitpid");
+  if (ptrace(PTRACE_SETOPTIONS, server_pid, NULL,
+        PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE | PTRACE_O_TRACEFORK | PTRACE_O_TRACEEXEC | PTRACE_O_EXITKILL)
+    == -1)
+    fail("ptrace");
+  ptrace(PTRACE_SYSCALL, server_pid, NULL, NULL);
+
+  while ((tid = waitpid(-1, &status, __WALL)) != -1 || errno == EINTR) {
+    if (tid == -1 || !WIFSTOPPED(status))
+      continue;
+
+    deliver = WSTOPSIG(status);
+    if (deliver == (SIGTRAP | 0x80)) {
+      // Only the op byte is copied
+      if (ptrace(PTRACE_GET_SYSCALL_INFO, tid, (void *)sizeof(op), &op) > 0 && op == PTRACE_SYSCALL_INFO_ENTRY)
+        atomic_fetch_add(&syscalls, 1);
+      deliver = 0;
+    } else if (deliver == SIGSTOP || (deliver == SIGTRAP && status >> 16 != 0))
+      deliver = 0;
+    ptrace(PTRACE_SYSCALL, tid, NULL, (void *)(long)deliver);
+  }
+}
+
+static void
+counts_quiet(unsigned long *syscalls_out, unsigned long *allocations_out)
+{
+  // Wait until wsfs stops making calls
+  struct timespec interval = { .tv_nsec = QUIET_INTERVAL * 1000000L };
+  unsigned long last_syscalls, last_allocations;
+  int rounds = 0;
+
+  *syscalls_out = atomic_load(&syscalls);
+  *allocations_out = atomic_load(allocations);
+  while (rounds < QUIET_ROUNDS) {
+    nanosleep(&interval, NULL);
+    last_syscalls = *syscalls_out;
+    last_allocations = *allocations_out;
+    *syscalls_out = atomic_load(&syscalls);
+    *allocations_out = atomic_load(allocations);
+    rounds = *syscalls_out == last_syscalls && *allocations_out == last_allocations ? rounds + 1 : 0;
+  }
+}
+
+static int
+server_connect()
+{
+  struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(port), .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+  struct timespec interval = { .tv_nsec = 50000000L };
+  int socketfd;
+
+  for (int tries = 0; tries < START_TIMEOUT * 20; tries++) {
+    if ((socketfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1)
+      return -1;
+    if (connect(socketfd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+      return socketfd;
+    close(socketfd);
+    nanosleep(&interval, NULL);
+  }
+  return -1;
+}
+
+static int
+request_format(char *out, size_t size, const scenario_t *scenario, int number)
+{
+  char path[64], fields[320] = "";
+
+  snprintf(path, sizeof(path), scenario->path, number);
+  if (scenario->fields != NULL)
+    snprintf(fields, sizeof(fields), scenario->fields, etag);
+  return snprintf(out, size, "GET %s HTTP/1.1\r\nHost: localhost\r\n%s\r\n", path, fields);
+}
+
+static int
+responses_read(int socketfd, int count)
+{
+  // Read `count` responses. Returns the status of the last one or -1.
+  // The ETag field of the last one is kept for conditional requests.
+  static char buffer[RESPONSE_MAX + 1];
+  static size_t buffer_len;
+  char *end, *field;
+  size_t head_len, body_len;
+  ssize_t bytes_read;
+  int status = -1;
+
+  while (count-- > 0) {
+    while ((end = memmem(buffer, buffer_len, "\r\n\r\n", 4)) == NULL) {
+      if (buffer_len == RESPONSE_MAX || (bytes_read = read(socketfd, buffer + buffer_len, RESPONSE_MAX - buffer_len)) <= 0)
+        return -1;
+      buffer_len += bytes_read;
+    }
+    head_len = end + 4 - buffer;
+    buffer[head_len - 2] = '\0';
+
+    if (sscanf(buffer, "HTTP/1.1 %d", &status) != 1)
+      return -1;
+    body_len = 0;
+    if (status != 304 && (field = strcasestr(buffer, "\r\nContent-Length:")) != NULL)
+      body_len = strtoul(field + 17, NULL, 10);
+    if ((field = strcasestr(buffer, "\r\nETag:")) != NULL)
+      sscanf(field + 7, " %255[^\r]", etag);
+
+    // The body is skipped
+    body_len += head_len;
+    while (buffer_len < body_len) {
+      body_len -= buffer_len;
+      if ((bytes_read = read(socketfd, buffer, RESPONSE_MAX < body_len ? RESPONSE_MAX : body_len)) <= 0)
+        return -1;
+      buffer_len = bytes_read;
+    }
+    memmove(buffer, buffer + body_len, buffer_len - body_len);
+    buffer_len -= body_len;
+  }
+
+  return status;
+}
+
+static int
+scenario_run(scenario_t *scenario)
+{
+  char requests[SCENARIO_REQUESTS * 512];
+  char warm[512];
+  unsigned long syscalls_start, allocations_start, syscalls_end, allocations_end;
+  size_t len;
+  int socketfd, status;
+
+  if ((socketfd = server_connect()) == -1)
+    return -1;
+
+  // The connection, the open file and the ETag are there before counting
+  request_format(warm, sizeof(warm), strstr(scenario->path, "%d") != NULL ? &scenarios[0] : scenario, 0);
+  if (write(socketfd, warm, strlen(warm)) == -1 || responses_read(socketfd, 1) == -1) {
+    close(socketfd);
+    return -1;
+  }
+  counts_quiet(&syscalls_start, &allocations_start);
+
+  for (int i = 0; i < SCENARIO_REQUESTS; i += scenario->depth) {
+    len = 0;
+    for (int j = i; j < i + scenario->depth; j++)
+      len += request_format(requests + len, sizeof(requests) - len, scenario, j);
+    if (write(socketfd, requests, len) != (ssize_t)len || (status = responses_read(socketfd, scenario->depth)) == -1) {
+      close(socketfd);
+      return -1;
+    }
+    if (status >= 400) {
+      fprintf(stderr, "wsfs-budget: %s: status %d\n", scenario->name, status);
+      close(socketfd);
+      return -1;
+    }
+  }
+
+  counts_quiet(&syscalls_end, &allocations_end);
+  close(socketfd);
+
+  scenario->syscalls = (double)(syscalls_end - syscalls_start) / SCENARIO_REQUESTS;
+  scenario->allocations = (double)(allocations_end - allocations_start) / SCENARIO_REQUESTS;
+  return 0;
+}
+
+static void *
+driver(void *arg)
+{
+  int over = 0, over_budget;
+
+  (void)arg;
+
+  printf("%-14s %10s %8s %12s %8s\n", "scenario", "syscalls", "budget", "allocations", "budget");
+  for (size_t i = 0; i < SCENARIOS; i++) {
+    scenario_t *scenario = &scenarios[i];
+
+    if (scenario_run(scenario) != 0) {
+      fprintf(stderr, "wsfs-budget: %s: no answer from wsfs\n", scenario->name);
+      over = 1;
+      break;
+    }
+
+    over_budget = scenario->syscalls > scenario->budget_syscalls || scenario->allocations > scenario->budget_allocations;
+    printf("%-14s %10.3f %8.2f %12.3f %8.2f%s\n", scenario->name, scenario->syscalls, scenario->budget_syscalls,
+      scenario->allocations, scenario->budget_allocations, over_budget ? "  over budget" : "");
+    over |= over_budget;
+  }
+
+  if (!over)
+    result = EXIT_SUCCESS;
+  kill(server_pid, SIGKILL);
+  return NULL;
+}
+
+static void
+printf_help()
+{
+  static const char *help_text = "Usage: wsfs-budget [OPTION]... BUDGETS SHIM WSFS [ARG]...\n"
+                                 "Run WSFS with SHIM preloaded and check the system calls and allocations\n"
+                                 "of each request scenario against the budgets in BUDGETS. ARGs are passed\n"
+                                 "on to WSFS.\n"
+                                 "\n"
+                                 "Options:\n"
+                                 "--help           Show this help page.\n"
+                                 "--version        Show package version.\n"
+                                 "\n"
+                                 "Report bugs to: <" PACKAGE_URL "/issues>\n";
+
+  printf("%s", help_text);
+}
+
+int
+main(int argc, char *argv[])
+{
+  pthread_t thread;
+  int c;
+
+  while (1) {
+    static struct option options[] = {
+      { "help", no_argument, &help_flag, 1 },
+      { "version", no_argument, &version_flag, 1 },
+      { 0, 0, 0, 0 }
+    };
+
+    int option_index = 0;
+
+    // Options after WSFS belong to it
+    c = getopt_long(argc, argv, "+", options, &option_index);
+    if (c == -1)
+      break;
+    if (c == '?')
+      exit(OPTION_ERROR);
+  }
+
+  if (help_flag) {
+    printf_help();
+    exit(EXIT_SUCCESS);
+  }
+
+  if (version_flag) {
+    printf("wsfs-budget (" PACKAGE_STRING ")\n");
+    exit(EXIT_SUCCESS);
+  }
+
+  if (argc - optind < 3) {
+    fprintf(stderr, "wsfs-budget: expected BUDGETS, SHIM and WSFS. Use --help flag to see usage.\n");
+    exit(OPTION_ERROR);
+  }
+
+  budgets_read(argv[optind]);
+  site_create();
+  port_pick();
+  server_start(argv[optind + 2], argv + optind + 3, argc - optind - 3, argv[optind + 1]);
+
+  if (pthread_create(&thread, NULL, driver, NULL) != 0)
+    fail("pthread_create");
+  server_trace();
+  pthread_join(thread, NULL);
+
+  nftw(root, site_remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+  exit(result);
+}
@@ -0,0 +1,92 @@
+// SPDX-License-Identifier: MIT
+
+#include <config.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// wsfs-budget-shim.so
+//
+// Preloaded into wsfs by wsfs-budget. Every call into the allocator
+// bumps a counter that lives in memory shared with the harness: the
+// descriptor named by WSFS_BUDGET_FD. Memory itself still comes from the
+// C library.
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+
+static _Atomic unsigned long *allocations;
+
+__attribute__((constructor)) static void
+shim_init()
+{
+  const char *fd = getenv("WSFS_BUDGET_FD");
+  void *map;
+
+  if (fd == NULL)
+    return;
+  map = mmap(NULL, sizeof(*allocations), PROT_READ | PROT_WRITE, MAP_SHARED, atoi(fd), 0);
+  close(atoi(fd));
+  if (map != MAP_FAILED)
+    allocations = map;
+}
+
+static void
+shim_count()
+{
+  if (allocations != NULL)
+    atomic_fetch_add_explicit(allocations, 1, memory_order_relaxed);
+}
+
+void *
+malloc(size_t size)
+{
+  shim_count();
+  return __libc_malloc(size);
+}
+
+void *
+calloc(size_t count, size_t size)
+{
+  shim_count();
+  return __libc_calloc(count, size);
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+  shim_count();
+  return __libc_realloc(ptr, size);
+}
+
+void *
+memalign(size_t alignment, size_t size)
+{
+  shim_count();
+  return __libc_memalign(alignment, size);
+}
+
+void *
+aligned_alloc(size_t alignment, size_t size)
+{
+  shim_count();
+  return __libc_memalign(alignment, size);
+}
+
+int
+posix_memalign(void **out, size_t alignment, size_t size)
+{
+  void *ptr;
+
+  if (alignment < sizeof(void *) || (alignment & (alignment - 1)) != 0)
+    return EINVAL;
+  shim_count();
+  if ((ptr = __libc_memalign(alignment, size)) == NULL)
+    return ENOMEM;
+  *out = ptr;
+  return 0;
+}
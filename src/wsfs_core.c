@@ -2,52 +2,79 @@
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "wsfs_core.h"
 
-wsfs_str_t*
-wsfs_str_t_alloc(const size_t size)
+int
+wsfs_string_set(wsfs_string_t *out, wsfs_str_t value)
 {
-  wsfs_str_t* ptr = (wsfs_str_t*)malloc(sizeof(wsfs_str_t));
+  // wsfs_string_set():
+  // Make `out` an owned copy of `value`. `out` must not hold a heap
+  // string, see wsfs_string_free(). Returns 0, or -1 if out of memory.
 
-  ptr->len = size;
+  if (value.len < sizeof(out->small))
+    out->string = out->small;
+  else if ((out->string = malloc(value.len + 1)) == NULL)
+    return -1;
 
-  ptr->string = (char*)malloc(sizeof(char) * size);
-
-  return ptr;
+  memcpy(out->string, value.string, value.len);
+  out->string[value.len] = '\0';
+  out->len = value.len;
+  return 0;
 }
 
-wsfs_str_t*
-wsfs_str_t_calloc(const size_t size)
+void
+wsfs_string_free(wsfs_string_t *s)
 {
-  wsfs_str_t* ptr = (wsfs_str_t*)calloc(1, sizeof(wsfs_str_t));
+  if (s->string != s->small)
+    free(s->string);
+  s->string = s->small;
+  s->small[0] = '\0';
+  s->len = 0;
+}
 
-  ptr->len = size;
+int
+wsfs_epoch_enter(wsfs_epoch_t *domain, wsfs_epoch_reader_t **reader)
+{
+  // wsfs_epoch_enter():
+  // Start a read section of `domain`. `*reader` is the calling thread's
+  // record for it, a thread local registered on first use. Returns 0, or
+  // -1 if out of memory: the caller must not read then.
 
-  ptr->string = (char*)malloc(sizeof(char) * size);
+  if (*reader == NULL) {
+    if ((*reader = calloc(1, sizeof(**reader))) == NULL)
+      return -1;
+    (*reader)->next = atomic_load(&domain->readers);
+    while (!atomic_compare_exchange_weak(&domain->readers, &(*reader)->next, *reader))
+      ;
+  }
 
-  return ptr;
+  // Published before the data is read, see wsfs_epoch_synchronize()
+  atomic_store(&(*reader)->epoch, atomic_load(&domain->epoch));
+  return 0;
 }
 
 void
-wsfs_str_t_destroy(wsfs_str_t* ptr)
+wsfs_epoch_exit(wsfs_epoch_reader_t *reader)
 {
-  free(ptr->string);
-  free(ptr);
+  if (reader != NULL)
+    atomic_store(&reader->epoch, 0);
 }
 
-wsfs_str_t*
-char_to_wsfs_str_t(wsfs_str_t* ptr, const char* s, const size_t len)
+void
+wsfs_epoch_synchronize(wsfs_epoch_t *domain)
 {
-  if (ptr == NULL)
-    ptr = wsfs_str_t_alloc(len+1);
+  // wsfs_epoch_synchronize():
+  // Wait for a grace period: every read section of `domain` that may
+  // have seen data no longer published has ended. Sections starting from
+  // now on carry the new epoch and are not waited for.
 
-  size_t i = 0;
-  while ((ptr->string[i] = s[i]) != '\0')
-    i++;
+  uint64_t now = atomic_fetch_add(&domain->epoch, 1) + 1;
+  uint64_t seen;
 
-  ptr->string[i+1] = '\0'; // Add null terminator to the end of the string
-  ptr->len = i;
-  
-  return ptr;
+  for (wsfs_epoch_reader_t *r = atomic_load(&domain->readers); r != NULL; r = r->next)
+    while ((seen = atomic_load(&r->epoch)) != 0 && seen < now)
+      usleep(1000);
 }
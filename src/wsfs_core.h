@@ -3,13 +3,125 @@
 #ifndef _WSFS_CORE
 #define _WSFS_CORE
 
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <strings.h>
 
-#define WSFS_STR_T_CHAR(A) { .len=strlen(A), .string=A }
-
+// STRING VIEW //
+// `len` bytes at `string`, owned by someone else. Not necessarily NUL
+// terminated: compare views with the helpers below, not with str*().
 typedef struct {
-  size_t  len;
-  char    *string;
+  size_t                      len;
+  const char                  *string;
 } wsfs_str_t;
 
+// View of a string literal, its length counted at compile time
+#define WSFS_STR(A) { .len = sizeof(A) - 1, .string = (A) }
+
+static inline wsfs_str_t
+wsfs_str_from(const char *s)
+{
+  return (wsfs_str_t) { .len = strlen(s), .string = s };
+}
+
+static inline int
+wsfs_str_eq(wsfs_str_t a, wsfs_str_t b)
+{
+  return a.len == b.len && memcmp(a.string, b.string, a.len) == 0;
+}
+
+static inline int
+wsfs_str_case_eq(wsfs_str_t a, wsfs_str_t b)
+{
+  return a.len == b.len && strncasecmp(a.string, b.string, a.len) == 0;
+}
+
+// OWNED STRING //
+// A NUL terminated copy. Short strings live in `small`, so most of them
+// need no allocation at all.
+#define WSFS_STRING_SMALL 40
+
+typedef struct {
+  size_t                      len;
+  char                        *string; // `small` or heap
+  char                        small[WSFS_STRING_SMALL];
+} wsfs_string_t;
+
+int wsfs_string_set(wsfs_string_t *out, wsfs_str_t value);
+void wsfs_string_free(wsfs_string_t *s);
+
+static inline wsfs_str_t
+wsfs_string_view(const wsfs_string_t *s)
+{
+  return (wsfs_str_t) { .len = s->len, .string = s->string };
+}
+
+// FNV-1a //
+// `seed` is folded into the offset basis. Not avalanched: mix the result
+// before using its low bits alone.
+#define WSFS_FNV32_BASIS 2166136261u
+#define WSFS_FNV64_BASIS 14695981039346656037ull
+
+static inline uint32_t
+wsfs_fnv1a32_byte(uint32_t hash, unsigned char byte)
+{
+  return (hash ^ byte) * 16777619u;
+}
+
+static inline uint64_t
+wsfs_fnv1a64_byte(uint64_t hash, unsigned char byte)
+{
+  return (hash ^ byte) * 1099511628211ull;
+}
+
+static inline uint32_t
+wsfs_fnv1a32(const void *data, size_t len, uint32_t seed)
+{
+  const unsigned char *bytes = data;
+  uint32_t hash = WSFS_FNV32_BASIS ^ seed;
+
+  for (size_t i = 0; i < len; i++)
+    hash = wsfs_fnv1a32_byte(hash, bytes[i]);
+  return hash;
+}
+
+static inline uint64_t
+wsfs_fnv1a64(const void *data, size_t len, uint64_t seed)
+{
+  const unsigned char *bytes = data;
+  uint64_t hash = WSFS_FNV64_BASIS ^ seed;
+
+  for (size_t i = 0; i < len; i++)
+    hash = wsfs_fnv1a64_byte(hash, bytes[i]);
+  return hash;
+}
+
+// EPOCHS //
+// Grace periods for data replaced while threads read it. A reader
+// enters a read section before it loads the published pointer and exits
+// once it is done with what it points to. The writer publishes a
+// replacement, then waits in wsfs_epoch_synchronize() before it frees
+// the old one.
+
+// A thread that has entered a section of a domain. `epoch` is the epoch
+// its current section started in, 0 outside of one. Threads live as
+// long as the process, so readers are never removed.
+typedef struct wsfs_epoch_reader {
+  struct wsfs_epoch_reader    *next;
+  _Atomic uint64_t            epoch;
+} wsfs_epoch_reader_t;
+
+typedef struct {
+  _Atomic uint64_t            epoch;
+  _Atomic(wsfs_epoch_reader_t *) readers;
+} wsfs_epoch_t;
+
+#define WSFS_EPOCH_INIT { .epoch = 1 }
+
+int wsfs_epoch_enter(wsfs_epoch_t *domain, wsfs_epoch_reader_t **reader);
+void wsfs_epoch_exit(wsfs_epoch_reader_t *reader);
+void wsfs_epoch_synchronize(wsfs_epoch_t *domain);
+
 #endif
@@ -0,0 +1,599 @@
+// SPDX-License-Identifier: MIT
+
+#include <config.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <getopt.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "http_conditional.h"
+#include "http_core.h"
+#include "http_encoding.h"
+#include "http_mime.h"
+#include "http_pack.h"
+#include "http_static.h"
+
+// wsfs-pack
+//
+// Compile a directory into a site pack for `wsfs --pack` (see
+// http_pack.h). Every regular file is reachable under its path and
+// directories under their index file, as wsfs would serve them.
+// Up to date precompressed siblings become variants of their file; with
+// --compress, missing variants are produced at the best level.
+// Symlinks are followed as long as they stay inside the directory,
+// symlinked directories are not descended into.
+//
+// The pack is written to a temporary file and renamed into place.
+
+#define OPTION_ERROR 1
+#define NFTW_FDS 32
+#define COPY_BUFFER_SIZE (64 * 1024)
+
+// Perfect hash shape: keys per bucket and spare slots
+#define KEYS_PER_BUCKET 4
+#define SLOTS_SPARE_DIVISOR 10
+#define SEED_MAX (1u << 24)
+
+typedef struct {
+  char                       *name; // relative to the directory
+  struct stat                 st;
+  const char                 *content_type;
+  http_file_meta_t            meta[HTTP_ENCODINGS];
+  int                         present; // bit mask of variants
+  char                       *data[HTTP_ENCODINGS]; // compressed here...
+  const char                 *source[HTTP_ENCODINGS]; // ...or copied from a sibling
+  uint64_t                    content_type_offset;
+  uint64_t                    last_modified_offset;
+  http_pack_variant_t         variants[HTTP_ENCODINGS];
+} pack_file_t;
+
+typedef struct {
+  char                       *path;
+  size_t                      len;
+  size_t                      file;
+  uint32_t                    slot;
+} pack_key_t;
+
+static int compress_flag;
+static int verbose_flag;
+static int help_flag;
+static int version_flag;
+
+static char root[PATH_MAX];
+static size_t root_len;
+static struct stat output_st;
+
+static pack_file_t *files;
+static size_t file_count, file_capacity;
+static pack_key_t *keys;
+static size_t key_count, key_capacity;
+static char *strings;
+static size_t strings_len, strings_capacity;
+
+static void
+fail(const char *what)
+{
+  fprintf(stderr, "wsfs-pack: %s: %s\n", what, strerror(errno));
+  exit(EXIT_FAILURE);
+}
+
+static void *
+grow(void *array, size_t *capacity, size_t count, size_t size)
+{
+  if (count < *capacity)
+    return array;
+  *capacity = *capacity == 0 ? 64 : *capacity * 2;
+  if ((array = realloc(array, *capacity * size)) == NULL)
+    fail("realloc");
+  return array;
+}
+
+static uint64_t
+string_add(const char *s, size_t len)
+{
+  // Append `len` bytes and a NUL to the string area, returns the offset
+  // relative to its start
+  uint64_t offset = strings_len;
+
+  while (strings_len + len + 1 > strings_capacity)
+    strings = grow(strings, &strings_capacity, strings_capacity, 1);
+
+  memcpy(strings + strings_len, s, len);
+  strings[strings_len + len] = '\0';
+  strings_len += len + 1;
+  return offset;
+}
+
+static void
+key_add(const char *path, size_t len, size_t file)
+{
+  keys = grow(keys, &key_capacity, key_count, sizeof(*keys));
+  if ((keys[key_count].path = strndup(path, len)) == NULL)
+    fail("strndup");
+  keys[key_count].len = len;
+  keys[key_count].file = file;
+  key_count++;
+}
+
+static int
+collect(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+  char resolved[PATH_MAX];
+  struct stat target_st;
+
+  (void)ftw;
+
+  if (type == FTW_SL) {
+    if (realpath(path, resolved) == NULL || strncmp(resolved, root, root_len) != 0
+      || resolved[root_len] != '/' || stat(resolved, &target_st) != 0)
+      return 0;
+    st = &target_st;
+  } else if (type != FTW_F)
+    return 0;
+
+  // Never pack an older version of the output itself
+  if (!S_ISREG(st->st_mode) || (st->st_dev == output_st.st_dev && st->st_ino == output_st.st_ino))
+    return 0;
+
+  files = grow(files, &file_capacity, file_count, sizeof(*files));
+  memset(&files[file_count], 0, sizeof(*files));
+  if ((files[file_count].name = strdup(path + root_len + 1)) == NULL)
+    fail("strdup");
+  files[file_count].st = *st;
+  file_count++;
+  return 0;
+}
+
+static int
+file_compare(const void *a, const void *b)
+{
+  return strcmp(((const pack_file_t *)a)->name, ((const pack_file_t *)b)->name);
+}
+
+static pack_file_t *
+file_find(const char *name)
+{
+  pack_file_t key = { .name = (char *)name };
+  return bsearch(&key, files, file_count, sizeof(*files), file_compare);
+}
+
+static char *
+read_file(const char *name, off_t size)
+{
+  char full[PATH_MAX * 2];
+  char *data;
+  ssize_t bytes_read;
+  off_t done = 0;
+  int fd;
+
+  snprintf(full, sizeof(full), "%s/%s", root, name);
+  if ((fd = open(full, O_RDONLY | O_CLOEXEC)) == -1)
+    fail(full);
+  if ((data = malloc(size > 0 ? size : 1)) == NULL)
+    fail("malloc");
+
+  while (done < size && (bytes_read = read(fd, data + done, size - done)) > 0)
+    done += bytes_read;
+  close(fd);
+
+  if (done != size) {
+    errno = EAGAIN;
+    fail(full);
+  }
+  return data;
+}
+
+static void
+prepare(pack_file_t *file)
+{
+  // prepare():
+  // Fill the metadata of `file` and find or produce its variants
+
+  char sibling_name[PATH_MAX];
+  pack_file_t *sibling;
+  char *data = NULL, *body;
+  size_t len;
+  int compressible;
+
+  file->content_type = http_mime_type(file->name);
+  compressible = http_mime_compressible(file->content_type);
+  if (http_conditional_meta_set(&file->meta[HTTP_ENCODING_IDENTITY], &file->st, compressible) != 0)
+    fail(file->name);
+  file->present = 1 << HTTP_ENCODING_IDENTITY;
+  file->source[HTTP_ENCODING_IDENTITY] = file->name;
+
+  if (!compressible || file->st.st_size < HTTP_ENCODING_SIZE_MIN)
+    return;
+
+  for (int encoding = HTTP_ENCODING_IDENTITY + 1; encoding < HTTP_ENCODINGS; encoding++) {
+    snprintf(sibling_name, sizeof(sibling_name), "%s%s", file->name, http_encoding_extension(encoding));
+
+    // Same staleness rule as http_static_sidecars()
+    if ((sibling = file_find(sibling_name)) != NULL
+      && (sibling->st.st_mtim.tv_sec > file->st.st_mtim.tv_sec
+        || (sibling->st.st_mtim.tv_sec == file->st.st_mtim.tv_sec && sibling->st.st_mtim.tv_nsec >= file->st.st_mtim.tv_nsec))) {
+      if (http_conditional_meta_set(&file->meta[encoding], &sibling->st, 1) != 0
+        || http_conditional_meta_variant(&file->meta[encoding], http_encoding_name(encoding), sibling->st.st_size) != 0)
+        fail(sibling_name);
+      file->source[encoding] = sibling->name;
+      file->present |= 1 << encoding;
+      continue;
+    }
+
+    if (!compress_flag || !http_encoding_supported(encoding))
+      continue;
+
+    if (data == NULL)
+      data = read_file(file->name, file->st.st_size);
+    if (http_encoding_compress(encoding, HTTP_ENCODING_LEVEL_BEST, data, file->st.st_size, &body, &len) != 0)
+      continue;
+
+    file->meta[encoding] = file->meta[HTTP_ENCODING_IDENTITY];
+    if (http_conditional_meta_variant(&file->meta[encoding], http_encoding_name(encoding), len) != 0)
+      fail(file->name);
+    file->data[encoding] = body;
+    file->present |= 1 << encoding;
+  }
+
+  free(data);
+}
+
+static void
+index_keys(uint32_t *seeds, uint32_t bucket_count, uint32_t slot_count)
+{
+  // index_keys():
+  // Hash and displace: group the keys into buckets by a first hash, then
+  // for each bucket, biggest first, search the seed whose second hash
+  // sends all of its keys to free slots.
+
+  uint32_t *bucket_of, *order, *first, *members, *fill;
+  unsigned char *taken;
+  uint32_t slot;
+  size_t i, j, k;
+
+  bucket_of = calloc(key_count, sizeof(*bucket_of));
+  members = calloc(key_count, sizeof(*members));
+  first = calloc(bucket_count + 1, sizeof(*first));
+  fill = calloc(bucket_count, sizeof(*fill));
+  order = calloc(bucket_count, sizeof(*order));
+  taken = calloc(slot_count, 1);
+  if (bucket_of == NULL || members == NULL || first == NULL || fill == NULL || order == NULL || taken == NULL)
+    fail("calloc");
+
+  for (i = 0; i < key_count; i++) {
+    bucket_of[i] = http_pack_hash(keys[i].path, keys[i].len, 0) % bucket_count;
+    first[bucket_of[i] + 1]++;
+  }
+  for (i = 0; i < bucket_count; i++)
+    first[i + 1] += first[i];
+  for (i = 0; i < key_count; i++)
+    members[first[bucket_of[i]] + fill[bucket_of[i]]++] = i;
+
+  // Counting sort of the buckets by size, biggest first
+  for (i = 0, k = 0; k < bucket_count; k++)
+    if (fill[k] > fill[i])
+      i = k;
+  for (size_t size = fill[i] + 1, n = 0; size-- > 0;)
+    for (k = 0; k < bucket_count; k++)
+      if (fill[k] == size)
+        order[n++] = k;
+
+  for (i = 0; i < bucket_count && fill[order[i]] > 0; i++) {
+    uint32_t bucket = order[i];
+    uint32_t seed;
+
+    for (seed = 1; seed < SEED_MAX; seed++) {
+      for (j = 0; j < fill[bucket]; j++) {
+        pack_key_t *key = &keys[members[first[bucket] + j]];
+        key->slot = http_pack_hash(key->path, key->len, seed) % slot_count;
+        if (taken[key->slot])
+          break;
+        for (k = 0; k < j && keys[members[first[bucket] + k]].slot != key->slot; k++)
+          ;
+        if (k < j)
+          break;
+      }
+      if (j == fill[bucket])
+        break;
+    }
+
+    if (seed == SEED_MAX) {
+      errno = EDEADLK;
+      fail("perfect hash");
+    }
+
+    seeds[bucket] = seed;
+    for (j = 0; j < fill[bucket]; j++) {
+      slot = keys[members[first[bucket] + j]].slot;
+      taken[slot] = 1;
+    }
+  }
+
+  free(bucket_of);
+  free(members);
+  free(first);
+  free(fill);
+  free(order);
+  free(taken);
+}
+
+static uint64_t
+align(uint64_t offset, uint64_t alignment)
+{
+  return (offset + alignment - 1) / alignment * alignment;
+}
+
+static void
+copy_body(int out, uint64_t offset, const char *name, uint64_t len)
+{
+  // Copy `name` into the pack, it must still have the size it had when
+  // its headers were built
+  char full[PATH_MAX * 2];
+  char *buffer;
+  ssize_t bytes_read;
+  uint64_t done = 0;
+  int fd;
+
+  snprintf(full, sizeof(full), "%s/%s", root, name);
+  if ((fd = open(full, O_RDONLY | O_CLOEXEC)) == -1)
+    fail(full);
+  if ((buffer = malloc(COPY_BUFFER_SIZE)) == NULL)
+    fail("malloc");
+
+  while ((bytes_read = read(fd, buffer, COPY_BUFFER_SIZE)) > 0) {
+    if (done + bytes_read > len)
+      break;
+    if (pwrite(out, buffer, bytes_read, offset + done) != bytes_read)
+      fail("write");
+    done += bytes_read;
+  }
+  close(fd);
+  free(buffer);
+
+  if (bytes_read != 0 || done != len) {
+    errno = EAGAIN;
+    fail(full);
+  }
+}
+
+static void
+write_pack(const char *output)
+{
+  char temp[PATH_MAX];
+  char block[HTTP_RESPONSE_HEADERS_MAX];
+  char content_encoding[64];
+  http_pack_header_t header;
+  http_pack_entry_t *slots;
+  http_pack_variant_t *variant;
+  pack_file_t *file;
+  uint32_t *seeds;
+  uint32_t bucket_count = key_count / KEYS_PER_BUCKET + 1;
+  uint32_t slot_count = key_count + key_count / SLOTS_SPARE_DIVISOR + 1;
+  uint64_t seeds_offset, slots_offset, strings_offset, cursor;
+  int block_len, out;
+
+  if ((seeds = calloc(bucket_count, sizeof(*seeds))) == NULL
+    || (slots = calloc(slot_count, sizeof(*slots))) == NULL)
+    fail("calloc");
+
+  index_keys(seeds, bucket_count, slot_count);
+
+  // Strings: paths, content types, dates, entity tags and header blocks
+  for (size_t i = 0; i < key_count; i++)
+    slots[keys[i].slot].path_offset = string_add(keys[i].path, keys[i].len);
+
+  for (size_t i = 0; i < file_count; i++) {
+    file = &files[i];
+    file->content_type_offset = string_add(file->content_type, strlen(file->content_type));
+    file->last_modified_offset = string_add(file->meta[0].last_modified, strlen(file->meta[0].last_modified));
+
+    for (int encoding = 0; encoding < HTTP_ENCODINGS; encoding++) {
+      if (!(file->present & 1 << encoding))
+        continue;
+
+      content_encoding[0] = '\0';
+      if (encoding != HTTP_ENCODING_IDENTITY)
+        snprintf(content_encoding, sizeof(content_encoding), "Content-Encoding: %s\r\n", http_encoding_name(encoding));
+
+      // Same fields and order as http_static_send()
+      block_len = snprintf(block, sizeof(block),
+        "Content-Type: %s\r\n"
+        "%s"
+        "Content-Length: %lld\r\n"
+        "Accept-Ranges: bytes\r\n"
+        "%s",
+        file->content_type, content_encoding, (long long)file->meta[encoding].size, file->meta[encoding].validators);
+      if (block_len < 0 || (size_t)block_len >= sizeof(block)) {
+        errno = ENAMETOOLONG;
+        fail(file->name);
+      }
+
+      variant = &file->variants[encoding];
+      variant->headers_offset = string_add(block, block_len);
+      variant->headers_len = block_len;
+      variant->validators_len = file->meta[encoding].validators_len;
+      variant->etag_offset = string_add(file->meta[encoding].etag, strlen(file->meta[encoding].etag));
+      variant->body_len = file->meta[encoding].size;
+    }
+  }
+
+  seeds_offset = align(sizeof(header), sizeof(uint64_t));
+  slots_offset = align(seeds_offset + (uint64_t)bucket_count * sizeof(*seeds), sizeof(uint64_t));
+  strings_offset = slots_offset + (uint64_t)slot_count * sizeof(*slots);
+  cursor = align(strings_offset + strings_len, HTTP_PACK_ALIGN);
+
+  // Bodies, each on its own pages
+  for (size_t i = 0; i < file_count; i++) {
+    file = &files[i];
+    file->content_type_offset += strings_offset;
+    file->last_modified_offset += strings_offset;
+    for (int encoding = 0; encoding < HTTP_ENCODINGS; encoding++) {
+      if (!(file->present & 1 << encoding))
+        continue;
+      variant = &file->variants[encoding];
+      variant->headers_offset += strings_offset;
+      variant->etag_offset += strings_offset;
+      variant->body_offset = cursor;
+      cursor = align(cursor + variant->body_len, HTTP_PACK_ALIGN);
+    }
+  }
+
+  for (size_t i = 0; i < key_count; i++) {
+    http_pack_entry_t *entry = &slots[keys[i].slot];
+    file = &files[keys[i].file];
+    entry->path_offset += strings_offset;
+    entry->path_len = keys[i].len;
+    entry->flags = HTTP_PACK_ENTRY_USED | (file->meta[0].vary ? HTTP_PACK_ENTRY_VARY : 0);
+    entry->mtime_sec = file->st.st_mtim.tv_sec;
+    entry->mtime_nsec = file->st.st_mtim.tv_nsec;
+    entry->content_type_offset = file->content_type_offset;
+    entry->last_modified_offset = file->last_modified_offset;
+    memcpy(entry->variants, file->variants, sizeof(entry->variants));
+  }
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, HTTP_PACK_MAGIC, sizeof(header.magic));
+  header.version = HTTP_PACK_VERSION;
+  header.bucket_count = bucket_count;
+  header.slot_count = slot_count;
+  header.entry_count = key_count;
+  header.seeds_offset = seeds_offset;
+  header.slots_offset = slots_offset;
+  header.size = cursor;
+
+  if (snprintf(temp, sizeof(temp), "%s.XXXXXX", output) >= (int)sizeof(temp)) {
+    errno = ENAMETOOLONG;
+    fail(output);
+  }
+  if ((out = mkstemp(temp)) == -1)
+    fail(temp);
+
+  if (pwrite(out, &header, sizeof(header), 0) != sizeof(header)
+    || pwrite(out, seeds, bucket_count * sizeof(*seeds), seeds_offset) != (ssize_t)(bucket_count * sizeof(*seeds))
+    || pwrite(out, slots, slot_count * sizeof(*slots), slots_offset) != (ssize_t)(slot_count * sizeof(*slots))
+    || pwrite(out, strings, strings_len, strings_offset) != (ssize_t)strings_len)
+    fail(temp);
+
+  for (size_t i = 0; i < file_count; i++) {
+    file = &files[i];
+    for (int encoding = 0; encoding < HTTP_ENCODINGS; encoding++) {
+      if (!(file->present & 1 << encoding))
+        continue;
+      variant = &file->variants[encoding];
+      if (file->data[encoding] != NULL) {
+        if (pwrite(out, file->data[encoding], variant->body_len, variant->body_offset) != (ssize_t)variant->body_len)
+          fail(temp);
+      } else
+        copy_body(out, variant->body_offset, file->source[encoding], variant->body_len);
+
+      if (verbose_flag)
+        printf("%s%s%s (%llu)\n", file->name, encoding != HTTP_ENCODING_IDENTITY ? " " : "",
+          encoding != HTTP_ENCODING_IDENTITY ? http_encoding_name(encoding) : "", (unsigned long long)variant->body_len);
+    }
+  }
+
+  if (ftruncate(out, cursor) == -1 || fchmod(out, 0644) == -1 || fsync(out) == -1 || close(out) == -1
+    || rename(temp, output) == -1) {
+    unlink(temp);
+    fail(output);
+  }
+
+  printf("%zu files, %zu paths, %llu bytes\n", file_count, key_count, (unsigned long long)cursor);
+
+  free(seeds);
+  free(slots);
+}
+
+static void
+printf_help()
+{
+  static const char *help_text = "Usage: wsfs-pack [OPTION]... DIR FILE\n"
+                                 "Compile the site in DIR into the site pack FILE for wsfs --pack.\n"
+                                 "\n"
+                                 "Options:\n"
+                                 "--compress       Add compressed variants missing as precompressed siblings.\n"
+                                 "--verbose        List every body written.\n"
+                                 "--help           Show this help page.\n"
+                                 "--version        Show package version.\n"
+                                 "\n"
+                                 "Report bugs to: <" PACKAGE_URL "/issues>\n";
+
+  printf("%s", help_text);
+}
+
+int
+main(int argc, char *argv[])
+{
+  const char *slash;
+  int c;
+
+  while (1) {
+    static struct option options[] = {
+      { "compress", no_argument, &compress_flag, 1 },
+      { "verbose", no_argument, &verbose_flag, 1 },
+      { "help", no_argument, &help_flag, 1 },
+      { "version", no_argument, &version_flag, 1 },
+      { 0, 0, 0, 0 }
+    };
+
+    int option_index = 0;
+
+    c = getopt_long(argc, argv, "", options, &option_index);
+    if (c == -1)
+      break;
+    if (c == '?')
+      exit(OPTION_ERROR);
+  }
+
+  if (help_flag) {
+    printf_help();
+    exit(EXIT_SUCCESS);
+  }
+
+  if (version_flag) {
+    printf("wsfs-pack (" PACKAGE_STRING ")\n");
+    exit(EXIT_SUCCESS);
+  }
+
+  if (argc - optind != 2) {
+    fprintf(stderr, "wsfs-pack: expected DIR and FILE. Use --help flag to see usage.\n");
+    exit(OPTION_ERROR);
+  }
+
+  if (realpath(argv[optind], root) == NULL)
+    fail(argv[optind]);
+  root_len = strlen(root);
+  if (stat(argv[optind + 1], &output_st) == -1)
+    memset(&output_st, 0, sizeof(output_st));
+
+  if (nftw(root, collect, NFTW_FDS, FTW_PHYS) != 0)
+    fail(root);
+
+  qsort(files, file_count, sizeof(*files), file_compare);
+
+  for (size_t i = 0; i < file_count; i++) {
+    prepare(&files[i]);
+
+    // Directories are served through their index file, with and without
+    // the trailing slash
+    key_add(files[i].name, strlen(files[i].name), i);
+    slash = strrchr(files[i].name, '/');
+    if (strcmp(slash != NULL ? slash + 1 : files[i].name, HTTP_STATIC_INDEX) == 0) {
+      size_t dir_len = slash != NULL ? (size_t)(slash - files[i].name) : 0;
+      if (dir_len > 0) {
+        key_add(files[i].name, dir_len + 1, i);
+        key_add(files[i].name, dir_len, i);
+      } else
+        key_add("", 0, i);
+    }
+  }
+
+  write_pack(argv[optind + 1]);
+  exit(EXIT_SUCCESS);
+}
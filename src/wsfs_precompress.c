@@ -0,0 +1,225 @@
+// SPDX-License-Identifier: MIT
+
+#include <config.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <getopt.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "http_encoding.h"
+#include "http_mime.h"
+
+// wsfs-precompress
+//
+// Write ".gz", ".br" and ".zst" siblings next to every compressible file
+// of a directory tree, at the best compression level, so wsfs can serve
+// them with sendfile() instead of compressing on the fly. Siblings that
+// are newer than their file are left alone unless --force is given.
+
+#define OPTION_ERROR 1
+#define NFTW_FDS 32
+
+static int force_flag;
+static int verbose_flag;
+static int help_flag;
+static int version_flag;
+
+static size_t files_written;
+static size_t files_skipped;
+static size_t errors;
+
+static int
+is_sidecar(const char *path)
+{
+  size_t len = strlen(path);
+  for (int encoding = HTTP_ENCODING_IDENTITY + 1; encoding < HTTP_ENCODINGS; encoding++) {
+    const char *extension = http_encoding_extension(encoding);
+    size_t extension_len = strlen(extension);
+    if (len > extension_len && strcmp(path + len - extension_len, extension) == 0)
+      return 1;
+  }
+  return 0;
+}
+
+static int
+read_file(const char *path, off_t size, char **out)
+{
+  char *data;
+  ssize_t bytes_read;
+  off_t done = 0;
+  int fd;
+
+  if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+    return -1;
+
+  if ((data = malloc(size)) == NULL) {
+    close(fd);
+    return -1;
+  }
+
+  while (done < size && (bytes_read = read(fd, data + done, size - done)) > 0)
+    done += bytes_read;
+  close(fd);
+
+  if (done != size) {
+    free(data);
+    return -1;
+  }
+
+  *out = data;
+  return 0;
+}
+
+static int
+write_file(const char *path, const char *data, size_t len)
+{
+  // Write through a temporary file, a running wsfs must never see a
+  // partially written sibling
+  char temp[PATH_MAX];
+  ssize_t bytes_written;
+  size_t done = 0;
+  int fd;
+
+  if (snprintf(temp, sizeof(temp), "%s.XXXXXX", path) >= (int)sizeof(temp))
+    return -1;
+  if ((fd = mkstemp(temp)) == -1)
+    return -1;
+
+  while (done < len && (bytes_written = write(fd, data + done, len - done)) > 0)
+    done += bytes_written;
+
+  if (done != len || fchmod(fd, 0644) == -1 || close(fd) == -1 || rename(temp, path) == -1) {
+    unlink(temp);
+    return -1;
+  }
+
+  return 0;
+}
+
+static int
+precompress(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+  char sidecar[PATH_MAX];
+  struct stat sidecar_st;
+  char *data = NULL, *body;
+  size_t len;
+  int result;
+
+  (void)ftw;
+
+  if (type != FTW_F || !S_ISREG(st->st_mode) || is_sidecar(path)
+    || st->st_size < HTTP_ENCODING_SIZE_MIN || !http_mime_compressible(http_mime_type(path)))
+    return 0;
+
+  for (int encoding = HTTP_ENCODING_IDENTITY + 1; encoding < HTTP_ENCODINGS; encoding++) {
+    if (!http_encoding_supported(encoding))
+      continue;
+
+    if (snprintf(sidecar, sizeof(sidecar), "%s%s", path, http_encoding_extension(encoding)) >= (int)sizeof(sidecar))
+      continue;
+
+    if (!force_flag && stat(sidecar, &sidecar_st) == 0
+      && (sidecar_st.st_mtim.tv_sec > st->st_mtim.tv_sec
+        || (sidecar_st.st_mtim.tv_sec == st->st_mtim.tv_sec && sidecar_st.st_mtim.tv_nsec >= st->st_mtim.tv_nsec))) {
+      files_skipped++;
+      continue;
+    }
+
+    if (data == NULL && read_file(path, st->st_size, &data) != 0) {
+      fprintf(stderr, "wsfs-precompress: %s: %s\n", path, strerror(errno));
+      errors++;
+      return 0;
+    }
+
+    result = http_encoding_compress(encoding, HTTP_ENCODING_LEVEL_BEST, data, st->st_size, &body, &len);
+    if (result == 1) {
+      // Not worth it, a stale sibling must not be served either
+      unlink(sidecar);
+      continue;
+    }
+    if (result != 0 || write_file(sidecar, body, len) != 0) {
+      fprintf(stderr, "wsfs-precompress: %s: failed\n", sidecar);
+      errors++;
+    } else {
+      files_written++;
+      if (verbose_flag)
+        printf("%s (%lld -> %zu)\n", sidecar, (long long)st->st_size, len);
+    }
+    free(body);
+  }
+
+  free(data);
+  return 0;
+}
+
+static void
+printf_help()
+{
+  static const char *help_text = "Usage: wsfs-precompress [OPTION]... DIR...\n"
+                                 "Write precompressed siblings of the compressible files in DIR.\n"
+                                 "\n"
+                                 "Options:\n"
+                                 "--force          Rewrite siblings that are up to date.\n"
+                                 "--verbose        List every sibling written.\n"
+                                 "--help           Show this help page.\n"
+                                 "--version        Show package version.\n"
+                                 "\n"
+                                 "Report bugs to: <" PACKAGE_URL "/issues>\n";
+
+  printf("%s", help_text);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int c;
+
+  while (1) {
+    static struct option options[] = {
+      { "force", no_argument, &force_flag, 1 },
+      { "verbose", no_argument, &verbose_flag, 1 },
+      { "help", no_argument, &help_flag, 1 },
+      { "version", no_argument, &version_flag, 1 },
+      { 0, 0, 0, 0 }
+    };
+
+    int option_index = 0;
+
+    c = getopt_long(argc, argv, "", options, &option_index);
+    if (c == -1)
+      break;
+    if (c == '?')
+      exit(OPTION_ERROR);
+  }
+
+  if (help_flag) {
+    printf_help();
+    exit(EXIT_SUCCESS);
+  }
+
+  if (version_flag) {
+    printf("wsfs-precompress (" PACKAGE_STRING ")\n");
+    exit(EXIT_SUCCESS);
+  }
+
+  if (optind == argc) {
+    fprintf(stderr, "wsfs-precompress: no directory given. Use --help flag to see usage.\n");
+    exit(OPTION_ERROR);
+  }
+
+  for (int i = optind; i < argc; i++) {
+    if (nftw(argv[i], precompress, NFTW_FDS, FTW_PHYS) != 0) {
+      fprintf(stderr, "wsfs-precompress: %s: %s\n", argv[i], strerror(errno));
+      errors++;
+    }
+  }
+
+  printf("%zu written, %zu up to date, %zu errors\n", files_written, files_skipped, errors);
+  exit(errors == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}